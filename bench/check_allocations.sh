@@ -0,0 +1,32 @@
+#!/bin/sh
+# Check that enumerating devices costs a fixed number of allocations per GATT
+# object, by running gatt_bench (see run_bench.sh) against 10 and then 100
+# mock devices. Exits non-zero if the allocations or mallocs per object grow
+# by more than 10% between the two, which means something has started to cost
+# more the more devices there are.
+#
+#    bench/check_allocations.sh [build dir]
+
+set -e
+
+BUILD=${1:-build}
+DIR=$(dirname "$0")
+
+# Prints "<allocations per object> <mallocs per object>"; mallocs are only
+# counted in builds without a sanitizer, and come out as 0 otherwise.
+PerObject()
+{
+   "$DIR/run_bench.sh" "$BUILD" --devices "$1" --characteristics 20 --notify-rate 0 -- --writes 0 --duration 0 2> /dev/null |
+      awk '/ allocations, .* per GATT object/ { a = $3 } / mallocs, .* per GATT object/ { m = $3 } END { print a + 0, m + 0 }'
+}
+
+SMALL=$(PerObject 10)
+LARGE=$(PerObject 100)
+echo "per GATT object with 10 devices:  $SMALL (allocations, mallocs)"
+echo "per GATT object with 100 devices: $LARGE (allocations, mallocs)"
+
+echo "$SMALL $LARGE" | awk '{
+   if ($1 == 0 || $3 == 0) { print "gatt_bench reported no allocations"; exit 1 }
+   if ($3 > $1 * 1.1) { print "Allocations per GATT object grew from " $1 " to " $3; exit 1 }
+   if ($4 > $2 * 1.1) { print "Mallocs per GATT object grew from " $2 " to " $4; exit 1 }
+}'
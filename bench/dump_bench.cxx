@@ -0,0 +1,147 @@
+// Benchmark of GVariantDump on a GetManagedObjects reply. Give it a file with a
+// captured reply, in the text format that
+//
+//    gdbus call --system --dest org.bluez --object-path / --method
+//       org.freedesktop.DBus.ObjectManager.GetManagedObjects > reply.txt
+//
+// (all on one line)
+//
+// prints, or it makes up a bluez-like reply of about 5 MB.
+
+#include "src/GVariantDump.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+   // Throws away everything written to it, so that only the formatting gets
+   // timed.
+   class NullBuffer: public std::streambuf
+   {
+   protected:
+      int overflow(int c) override { return c; }
+      std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+   };
+
+
+   GVariant* Load(const char* filename)
+   {
+      std::ifstream in(filename);
+      std::stringstream text;
+      text << in.rdbuf();
+
+      GError* err = nullptr;
+      GVariant* reply = g_variant_parse(G_VARIANT_TYPE("(a{oa{sa{sv}}})"), text.str().c_str(), nullptr, nullptr, &err);
+      if (!reply)
+      {
+         std::cerr << "Unable to parse " << filename << ": " << err->message << '\n';
+         g_error_free(err);
+         exit(1);
+      }
+      return g_variant_ref_sink(reply);
+   }
+
+
+   // Adds one object to the reply, returning its serialized size.
+   size_t AddObject(GVariantBuilder* objects, const char* path, const char* iface, GVariantBuilder* props)
+   {
+      GVariantBuilder ifaces;
+      g_variant_builder_init(&ifaces, G_VARIANT_TYPE("a{sa{sv}}"));
+      g_variant_builder_add(&ifaces, "{s@a{sv}}", iface, g_variant_builder_end(props));
+      GVariant* entry = g_variant_new("{o@a{sa{sv}}}", path, g_variant_builder_end(&ifaces));
+      size_t size = g_variant_get_size(entry);
+      g_variant_builder_add_value(objects, entry);
+      return size;
+   }
+
+
+   // Roughly what bluez reports for a busy area: lots of devices with
+   // manufacturer data, each with a few services full of characteristics.
+   GVariant* MakeUp(size_t target_bytes)
+   {
+      GVariantBuilder objects;
+      g_variant_builder_init(&objects, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+
+      std::string blob(64, '\x5a');
+      size_t size = 0;
+      for (unsigned d = 0; size < target_bytes; ++d)
+      {
+         char device[64];
+         snprintf(device, sizeof(device), "/org/bluez/hci0/dev_00_00_00_00_%02X_%02X", (d >> 8) & 0xff, d & 0xff);
+
+         GVariantBuilder props;
+         g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+         g_variant_builder_add(&props, "{sv}", "Address", g_variant_new_string(device + 20));
+         g_variant_builder_add(&props, "{sv}", "Name", g_variant_new_string("Some hearing aid"));
+         g_variant_builder_add(&props, "{sv}", "RSSI", g_variant_new_int16(-60));
+         g_variant_builder_add(&props, "{sv}", "Connected", g_variant_new_boolean(true));
+         const char* uuids[] = {"0000fdf0-0000-1000-8000-00805f9b34fb", "0000180a-0000-1000-8000-00805f9b34fb", nullptr};
+         g_variant_builder_add(&props, "{sv}", "UUIDs", g_variant_new_strv(uuids, -1));
+         GVariantBuilder mfr;
+         g_variant_builder_init(&mfr, G_VARIANT_TYPE("a{qv}"));
+         g_variant_builder_add(&mfr, "{qv}", 0x004c,
+            g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, blob.data(), blob.size(), 1));
+         g_variant_builder_add(&props, "{sv}", "ManufacturerData", g_variant_builder_end(&mfr));
+
+         size += AddObject(&objects, device, "org.bluez.Device1", &props);
+
+         for (unsigned c = 1; c <= 32; ++c)
+         {
+            char path[96];
+            snprintf(path, sizeof(path), "%s/service0001/char%04x", device, c);
+
+            g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+            g_variant_builder_add(&props, "{sv}", "UUID", g_variant_new_string("6333651e-c481-4a3e-9169-7c902aad37bb"));
+            g_variant_builder_add(&props, "{sv}", "Service", g_variant_new_object_path(device));
+            g_variant_builder_add(&props, "{sv}", "Value",
+               g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, blob.data(), 20, 1));
+            const char* flags[] = {"read", "notify", nullptr};
+            g_variant_builder_add(&props, "{sv}", "Flags", g_variant_new_strv(flags, -1));
+            g_variant_builder_add(&props, "{sv}", "NotifyAcquired", g_variant_new_boolean(false));
+            size += AddObject(&objects, path, "org.bluez.GattCharacteristic1", &props);
+         }
+      }
+
+      return g_variant_ref_sink(g_variant_new("(@a{oa{sa{sv}}})", g_variant_builder_end(&objects)));
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   GVariant* reply = argc > 1 ? Load(argv[1]) : MakeUp(5 << 20);
+   int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+   double mb = g_variant_get_size(reply) / 1e6;
+   std::cout << "reply is " << std::fixed << std::setprecision(2) << mb << " MB serialized\n";
+
+   NullBuffer null_buffer;
+   std::ostream null(&null_buffer);
+
+   auto start = std::chrono::steady_clock::now();
+   for (int i = 0; i < iterations; ++i)
+      GVariantDump(reply, null);
+   std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+   std::cout << "GVariantDump     " << std::setw(10) << elapsed.count() / iterations << " ms  "
+             << std::setw(8) << mb * iterations * 1000 / elapsed.count() << " MB/s\n";
+
+   // glib's own printer, for scale.
+   start = std::chrono::steady_clock::now();
+   for (int i = 0; i < iterations; ++i)
+      g_free(g_variant_print(reply, false));
+   elapsed = std::chrono::steady_clock::now() - start;
+   std::cout << "g_variant_print  " << std::setw(10) << elapsed.count() / iterations << " ms  "
+             << std::setw(8) << mb * iterations * 1000 / elapsed.count() << " MB/s\n";
+
+   g_variant_unref(reply);
+   return 0;
+}
@@ -0,0 +1,117 @@
+// Micro benchmark of the value formatters in src/Hex.hh, against the
+// stringstream versions they replaced, for a typical notification (20 bytes)
+// and a long read (512 bytes).
+
+#include "src/Hex.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+   std::string HexDumpStream(const std::vector<uint8_t>& bytes)
+   {
+      std::stringstream ss;
+      bool first = true;
+      for (uint8_t b: bytes)
+      {
+         if (!first) ss << ' ';
+         ss << std::hex << std::setfill('0') << std::setw(2) << (unsigned)b;
+         first = false;
+      }
+      return ss.str();
+   }
+
+   std::string PrintableStream(const std::vector<uint8_t>& bytes)
+   {
+      std::string ret;
+      for (uint8_t c: bytes)
+      {
+         switch (c)
+         {
+         case '\0': ret += "\\0"; break;
+         case '\a': ret += "\\a"; break;
+         case '\b': ret += "\\b"; break;
+         case '\t': ret += "\\t"; break;
+         case '\n': ret += "\\n"; break;
+         case '\v': ret += "\\v"; break;
+         case '\f': ret += "\\f"; break;
+         case '\r': ret += "\\r"; break;
+         default:
+            if (c >= 32 && c < 127)
+               ret += (char)c;
+            else
+            {
+               std::stringstream ss;
+               ss << std::setfill('0') << std::setw(3) << std::oct << (unsigned)c;
+               ret += "\\" + ss.str();
+            }
+         }
+      }
+      return ret;
+   }
+
+   // Keeps the compiler from throwing the work away.
+   volatile size_t g_sink;
+
+   template <typename Fn>
+   void Time(const char* name, size_t size, size_t iterations, Fn fn)
+   {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < iterations; ++i)
+         g_sink = g_sink + fn();
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+      double per_call = elapsed.count() / iterations;
+      std::cout << std::left << std::setw(20) << name << std::right
+                << std::setw(6) << size << " bytes "
+                << std::fixed << std::setprecision(1) << std::setw(10) << per_call << " ns/call "
+                << std::setw(8) << std::setprecision(2) << per_call / size << " ns/byte\n";
+   }
+
+   void Run(size_t size, size_t iterations)
+   {
+      // Every byte value, so that Printable() hits all of its cases.
+      std::vector<uint8_t> bytes(size);
+      for (size_t i = 0; i < size; ++i)
+         bytes[i] = (uint8_t)(i * 37);
+      asha::ByteView view(bytes);
+      std::vector<char> buffer(std::max(asha::HexDumpSize(size), asha::PrintableSize(size)));
+
+      if (asha::HexDump(bytes) != HexDumpStream(bytes) || asha::Printable(bytes) != PrintableStream(bytes))
+      {
+         std::cerr << "Formatters disagree at " << size << " bytes\n";
+         exit(1);
+      }
+
+      Time("HexDump stream", size, iterations, [&]() { return HexDumpStream(bytes).size(); });
+      Time("HexDump string", size, iterations, [&]() { return asha::HexDump(view).size(); });
+      Time("HexDump scalar", size, iterations, [&]() { return asha::HexDumpScalar(view, buffer.data()); });
+      Time("HexDump buffer", size, iterations, [&]() { return asha::HexDump(view, buffer.data()); });
+      Time("Printable stream", size, iterations, [&]() { return PrintableStream(bytes).size(); });
+      Time("Printable string", size, iterations, [&]() { return asha::Printable(view).size(); });
+      Time("Printable buffer", size, iterations, [&]() { return asha::Printable(view, buffer.data()); });
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+
+#ifdef __SSSE3__
+   std::cout << "SSSE3 HexDump enabled\n";
+#else
+   std::cout << "SSSE3 HexDump disabled (build with -DENABLE_NATIVE=ON to use it)\n";
+#endif
+   Run(20, iterations);
+   Run(512, iterations / 10);
+   return 0;
+}
@@ -0,0 +1,490 @@
+// End to end benchmark of the dump path against a bluez on some bus, which
+// will normally be mock_bluez on a private dbus-daemon (see run_bench.sh).
+// Reports how long it takes to enumerate the devices, how fast every readable
+// characteristic can be read, and how many notifications per second make it
+// through, with latency percentiles for each, and how much memory and how
+// many allocations holding the enumerated devices takes.
+
+#include "src/Bluetooth.hh"
+#include "src/Latency.hh"
+
+#include <glib-2.0/glib.h>
+#include <gio/gio.h>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace
+{
+   // Everything C++ allocates, so that adding a device can be checked to
+   // cost a fixed number of allocations per GATT object (see
+   // check_allocations.sh).
+   std::atomic<uint64_t> g_allocations{0};
+   // Every malloc, C++ allocations included, which takes in glib's and the
+   // GDBus worker's as well.
+   // Only counted where malloc can be replaced, which the sanitizers don't
+   // allow.
+   std::atomic<uint64_t> g_mallocs{0};
+   // The same, for this thread only, so that the main loop's share can be
+   // told apart from the GDBus worker's.
+   thread_local uint64_t t_mallocs = 0;
+}
+
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define COUNT_MALLOCS 1
+
+extern "C"
+{
+   void* __libc_malloc(size_t size);
+   void* __libc_calloc(size_t count, size_t size);
+   void* __libc_realloc(void* p, size_t size);
+
+   void* malloc(size_t size)
+   {
+      g_mallocs.fetch_add(1, std::memory_order_relaxed);
+      ++t_mallocs;
+      return __libc_malloc(size);
+   }
+
+   void* calloc(size_t count, size_t size)
+   {
+      g_mallocs.fetch_add(1, std::memory_order_relaxed);
+      ++t_mallocs;
+      return __libc_calloc(count, size);
+   }
+
+   void* realloc(void* p, size_t size)
+   {
+      if (!p)
+      {
+         g_mallocs.fetch_add(1, std::memory_order_relaxed);
+         ++t_mallocs;
+      }
+      return __libc_realloc(p, size);
+   }
+}
+#endif
+
+
+void* operator new(size_t size)
+{
+   g_allocations.fetch_add(1, std::memory_order_relaxed);
+   if (void* p = malloc(size ? size : 1))
+      return p;
+   throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+
+namespace
+{
+   struct Options
+   {
+      std::string bus = asha::Bus::SESSION;
+      size_t window = 8;
+      double duration = 5.0;
+      bool socket = false;
+      // Subscribe with the Notify overload that hands out a copy of every
+      // value, rather than a view of it.
+      bool copy = false;
+      size_t writes = 10000;
+      asha::ReadPolicy read_policy = asha::ReadPolicy::RADIO;
+   };
+
+
+   double Seconds(int64_t us) { return us / 1e6; }
+
+
+   // CPU time used by the whole process, in microseconds.
+   int64_t CpuTime()
+   {
+      rusage usage{};
+      getrusage(RUSAGE_SELF, &usage);
+      return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ll + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+   }
+
+
+   // Resident set size in bytes, or 0 if /proc isn't around.
+   size_t Rss()
+   {
+      std::ifstream statm("/proc/self/statm");
+      size_t size = 0;
+      size_t resident = 0;
+      if (!(statm >> size >> resident))
+         return 0;
+      return resident * sysconf(_SC_PAGESIZE);
+   }
+
+
+   // Latency samples in microseconds.
+   class Samples
+   {
+   public:
+      void Add(int64_t us) { m_samples.push_back(us); }
+      size_t Count() const { return m_samples.size(); }
+
+      void Print(const char* name, double seconds)
+      {
+         std::cout << std::left << std::setw(16) << name << std::right
+                   << std::setw(10) << m_samples.size() << " in " << std::fixed << std::setprecision(3) << seconds << "s  "
+                   << std::setw(10) << std::setprecision(1) << (seconds > 0 ? m_samples.size() / seconds : 0) << "/s";
+         if (!m_samples.empty())
+         {
+            std::sort(m_samples.begin(), m_samples.end());
+            std::cout << "  p50 " << Percentile(0.50) << "us  p99 " << Percentile(0.99) << "us  max " << m_samples.back() << "us";
+         }
+         std::cout << '\n';
+      }
+
+   private:
+      int64_t Percentile(double p) const
+      {
+         size_t i = std::min(m_samples.size() - 1, (size_t)(p * m_samples.size()));
+         return m_samples[i];
+      }
+
+      std::vector<int64_t> m_samples;
+   };
+
+
+   // Spin the main loop until done() says so, or until timeout seconds pass.
+   bool RunUntil(const std::function<bool()>& done, double timeout)
+   {
+      // Make sure the loop wakes up for the deadline even if nothing else
+      // happens.
+      bool expired = false;
+      unsigned deadline = g_timeout_add((unsigned)(timeout * 1000), [](gpointer p) {
+         *(bool*)p = true;
+         return (gboolean)G_SOURCE_REMOVE;
+      }, &expired);
+
+      bool finished;
+      while (!(finished = done()) && !expired)
+         g_main_context_iteration(nullptr, true);
+
+      if (!expired)
+         g_source_remove(deadline);
+      return finished;
+   }
+
+
+   // mock_bluez takes a moment to claim its name, so don't race it.
+   bool WaitForBluez(const std::shared_ptr<asha::Bus>& bus, double timeout)
+   {
+      int64_t end = g_get_monotonic_time() + (int64_t)(timeout * 1e6);
+      while (g_get_monotonic_time() < end)
+      {
+         GVariant* result = g_dbus_connection_call_sync(bus->Connection(),
+            "org.freedesktop.DBus",
+            "/org/freedesktop/DBus",
+            "org.freedesktop.DBus",
+            "NameHasOwner",
+            g_variant_new("(s)", bus->Service().c_str()),
+            G_VARIANT_TYPE("(b)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            nullptr,
+            nullptr
+         );
+         if (result)
+         {
+            gboolean has_owner = false;
+            g_variant_get(result, "(b)", &has_owner);
+            g_variant_unref(result);
+            if (has_owner)
+               return true;
+         }
+         g_usleep(50000);
+      }
+      return false;
+   }
+
+
+   class Bench
+   {
+   public:
+      explicit Bench(const Options& options): m_options(options) {}
+
+      int Run()
+      {
+         std::shared_ptr<asha::Bus> bus;
+         try
+         {
+            bus = asha::Bus::Connect(m_options.bus);
+         }
+         catch (const std::exception& e)
+         {
+            std::cerr << e.what() << '\n';
+            return 1;
+         }
+         if (!WaitForBluez(bus, 10))
+         {
+            std::cerr << "Nothing owns " << bus->Service() << " on " << m_options.bus << '\n';
+            return 1;
+         }
+
+         Enumerate(bus);
+         if (m_characteristics.empty())
+         {
+            std::cerr << "No characteristics found\n";
+            return 1;
+         }
+         Read();
+         Notify();
+         Write();
+         return 0;
+      }
+
+   private:
+      void Enumerate(const std::shared_ptr<asha::Bus>& bus)
+      {
+         size_t devices = 0;
+         size_t objects = 0;
+         size_t tables = 0;
+         size_t rss = Rss();
+         uint64_t allocations = g_allocations.load();
+         uint64_t mallocs = g_mallocs.load();
+         int64_t start = g_get_monotonic_time();
+         m_b.reset(new asha::Bluetooth(
+            [&](asha::Bluetooth::BluezDevice&& d) {
+               ++devices;
+               tables += d.gatt.MemoryUsage();
+               objects += d.gatt.Services().size();
+               for (auto c: d.gatt.Characteristics())
+               {
+                  objects += 1 + c.Descriptors().size();
+                  m_characteristics.push_back(std::make_shared<asha::Characteristic>(c, d.bus, m_options.read_policy));
+               }
+            },
+            [](const std::string&) {},
+            bus
+         ));
+         // Construction returns straight away, and enumeration happens from
+         // the main loop.
+         int64_t constructed = g_get_monotonic_time() - start;
+         RunUntil([&]() { return m_b->Settled(); }, 60);
+         int64_t elapsed = g_get_monotonic_time() - start;
+         allocations = g_allocations.load() - allocations;
+         mallocs = g_mallocs.load() - mallocs;
+
+         std::cout << "enumerate       " << devices << " devices, " << m_characteristics.size() << " characteristics in "
+                   << std::fixed << std::setprecision(3) << Seconds(elapsed) * 1000 << "ms, "
+                   << (Rss() - rss) / 1024 << "KiB resident, " << tables / 1024 << "KiB in GATT tables\n"
+                   << "                " << allocations << " allocations, " << std::setprecision(1)
+                   << (objects ? (double)allocations / objects : 0) << " per GATT object\n";
+#ifdef COUNT_MALLOCS
+         std::cout << "                " << mallocs << " mallocs, " << std::setprecision(1)
+                   << (objects ? (double)mallocs / objects : 0) << " per GATT object\n";
+#endif
+         std::cout << "                constructor returned after " << std::setprecision(3) << Seconds(constructed) * 1000 << "ms\n";
+      }
+
+      void Read()
+      {
+         Samples samples;
+         size_t next = 0;
+         size_t in_flight = 0;
+         size_t failed = 0;
+
+         std::function<void()> issue = [&]() {
+            while (in_flight < m_options.window && next < m_characteristics.size())
+            {
+               auto& c = m_characteristics[next++];
+               if (!c->HasFlag(asha::Characteristic::READ))
+                  continue;
+               ++in_flight;
+               int64_t start = g_get_monotonic_time();
+               c->ReadAsync([&, start](const std::vector<uint8_t>& v) {
+                  samples.Add(g_get_monotonic_time() - start);
+                  if (v.empty())
+                     ++failed;
+                  --in_flight;
+                  issue();
+               }, m_options.read_policy);
+            }
+         };
+
+         int64_t start = g_get_monotonic_time();
+         issue();
+         RunUntil([&]() { return in_flight == 0 && next == m_characteristics.size(); }, 60);
+         samples.Print("reads", Seconds(g_get_monotonic_time() - start));
+         if (failed)
+            std::cout << "                " << failed << " reads failed\n";
+      }
+
+      void Notify()
+      {
+         Samples samples;
+         auto mode = m_options.socket ? asha::Characteristic::NotifyMode::Socket : asha::Characteristic::NotifyMode::Signal;
+         auto record = [&](asha::ByteView v) {
+            // mock_bluez puts the time it sent the notification up front.
+            int64_t sent = 0;
+            if (v.size() >= sizeof(sent))
+            {
+               memcpy(&sent, v.data(), sizeof(sent));
+               samples.Add(g_get_monotonic_time() - sent);
+            }
+         };
+
+         int64_t start = g_get_monotonic_time();
+         for (auto& c: m_characteristics)
+         {
+            if (!c->HasFlag(asha::Characteristic::NOTIFY))
+               continue;
+            // The copying overload only knows about StartNotify.
+            if (m_options.copy)
+               c->Notify([&](const std::vector<uint8_t>& v) { record(asha::ByteView(v)); });
+            else
+               c->Notify(record, mode);
+         }
+         int64_t subscribed = g_get_monotonic_time();
+         std::cout << "subscribe       " << std::fixed << std::setprecision(3) << Seconds(subscribed - start) * 1000 << "ms\n";
+
+         int64_t cpu = CpuTime();
+         uint64_t allocations = g_allocations.load();
+         uint64_t mallocs = g_mallocs.load();
+         uint64_t main_mallocs = t_mallocs;
+         RunUntil([]() { return false; }, m_options.duration);
+         allocations = g_allocations.load() - allocations;
+         mallocs = g_mallocs.load() - mallocs;
+         main_mallocs = t_mallocs - main_mallocs;
+         cpu = CpuTime() - cpu;
+         const char* name = m_options.copy ? "notify (copy)" : m_options.socket ? "notify (socket)" : "notify";
+         samples.Print(name, Seconds(g_get_monotonic_time() - subscribed));
+         if (samples.Count())
+            std::cout << "                " << std::setprecision(1) << (double)cpu / samples.Count() << "us CPU, "
+                      << (double)allocations / samples.Count() << " allocations per notification\n";
+#ifdef COUNT_MALLOCS
+         if (samples.Count())
+            std::cout << "                " << (double)mallocs / samples.Count() << " mallocs per notification, "
+                      << (double)main_mallocs / samples.Count() << " on the main thread\n";
+#endif
+         if (asha::latency::Enabled())
+            asha::latency::Dump();
+
+         for (auto& c: m_characteristics)
+            c->StopNotify();
+      }
+
+      void Write()
+      {
+         if (m_options.writes == 0)
+            return;
+
+         auto it = std::find_if(m_characteristics.begin(), m_characteristics.end(), [](const std::shared_ptr<asha::Characteristic>& c) {
+            return c->HasFlag(asha::Characteristic::WRITE_WITHOUT_RESPONSE);
+         });
+         if (it == m_characteristics.end())
+            return;
+         auto& c = **it;
+         bool acquired = c.AcquireWrite();
+
+         std::vector<uint8_t> packet(20, 0x55);
+         size_t sent = 0;
+         size_t stalls = 0;
+         int64_t start = g_get_monotonic_time();
+         RunUntil([&]() {
+            // Push until the socket backs up, then let the main loop drain it.
+            while (sent < m_options.writes && c.Command(packet))
+               ++sent;
+            if (sent < m_options.writes)
+               ++stalls;
+            return sent == m_options.writes;
+         }, 60);
+         double seconds = Seconds(g_get_monotonic_time() - start);
+
+         std::cout << std::left << std::setw(16) << (acquired ? "write (socket)" : "write") << std::right
+                   << std::setw(10) << sent << " in " << std::fixed << std::setprecision(3) << seconds << "s  "
+                   << std::setw(10) << std::setprecision(1) << (seconds > 0 ? sent / seconds : 0) << "/s  "
+                   << stalls << " stalls\n";
+      }
+
+      Options m_options;
+      std::vector<std::shared_ptr<asha::Characteristic>> m_characteristics;
+      std::unique_ptr<asha::Bluetooth> m_b;
+   };
+
+
+   void Usage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " [options]\n"
+                   "   -b, --bus ADDR       system, session (default), or a dbus address\n"
+                   "   -w, --window N       Reads in flight at once (default 8)\n"
+                   "   -p, --read-policy P  radio (default), cached-then-radio or cached\n"
+                   "   -t, --duration S     Seconds to count notifications for (default 5)\n"
+                   "   -s, --socket         Subscribe with AcquireNotify instead of StartNotify\n"
+                   "   -c, --copy           Subscribe with the Notify overload that copies each\n"
+                   "                        value into a vector, rather than the ByteView one\n"
+                   "   -n, --writes N       Write commands to send (default 10000, 0 to skip)\n"
+                   "   -L, --latency        Record notification latency the way gatt_dump -L\n"
+                   "                        does, and print it after the notify run\n"
+                   "   -h, --help           Show this message\n";
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   Options options;
+
+   const option long_options[] = {
+      {"bus",         required_argument, nullptr, 'b'},
+      {"window",      required_argument, nullptr, 'w'},
+      {"duration",    required_argument, nullptr, 't'},
+      {"read-policy", required_argument, nullptr, 'p'},
+      {"socket",      no_argument,       nullptr, 's'},
+      {"copy",        no_argument,       nullptr, 'c'},
+      {"writes",      required_argument, nullptr, 'n'},
+      {"latency",     no_argument,       nullptr, 'L'},
+      {"help",        no_argument,       nullptr, 'h'},
+      {nullptr,       0,                 nullptr, 0},
+   };
+   int opt;
+   while ((opt = getopt_long(argc, argv, "b:w:t:p:scn:Lh", long_options, nullptr)) != -1)
+   {
+      switch (opt)
+      {
+      case 'b': options.bus = optarg; break;
+      case 'w': options.window = std::max<size_t>(1, strtoul(optarg, nullptr, 10)); break;
+      case 't': options.duration = strtod(optarg, nullptr); break;
+      case 'p':
+         if (!asha::ParseReadPolicy(optarg, options.read_policy))
+         {
+            std::cerr << "Invalid read policy: " << optarg << '\n';
+            return 1;
+         }
+         break;
+      case 's': options.socket = true; break;
+      case 'c': options.copy = true; break;
+      case 'n': options.writes = strtoul(optarg, nullptr, 10); break;
+      case 'L': asha::latency::Enable(true); break;
+      case 'h':
+         Usage(argv[0]);
+         return 0;
+      default:
+         Usage(argv[0]);
+         return 1;
+      }
+   }
+
+   Bench bench(options);
+   return bench.Run();
+}
@@ -0,0 +1,77 @@
+// Micro benchmark of what notification latency recording (gatt_dump -L) adds
+// to every notification: two clock reads and a NotifyLatency::Record(). Also
+// checks that the histogram's percentiles land where they should.
+
+#include "src/Latency.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+namespace
+{
+   // Keeps the compiler from throwing the work away.
+   volatile int64_t g_sink;
+
+   template <typename Fn>
+   void Time(const char* name, size_t iterations, Fn fn)
+   {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < iterations; ++i)
+         fn(i);
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      std::cout << std::left << std::setw(28) << name << std::right
+                << std::fixed << std::setprecision(1) << std::setw(10) << elapsed.count() / iterations << " ns/event\n";
+   }
+
+   bool Check()
+   {
+      // 1..10000ns, evenly, so the percentiles are known.
+      asha::LatencyHistogram h;
+      for (uint64_t i = 1; i <= 10000; ++i)
+         h.Record(i);
+      bool ok = true;
+      for (double p: {0.5, 0.9, 0.99})
+      {
+         double expected = p * 10000;
+         double got = h.Percentile(p);
+         // Within a sub-bucket, which is 1/16th of the power of two below.
+         if (got < expected || got > expected * 1.0625 + 1)
+         {
+            std::cerr << "p" << p * 100 << " is " << got << ", expected about " << expected << '\n';
+            ok = false;
+         }
+      }
+      if (h.Max() != 10000 || h.Count() != 10000)
+         ok = false;
+      return ok;
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+
+   if (!Check())
+   {
+      std::cerr << "Histogram percentiles are off\n";
+      return 1;
+   }
+
+   std::unique_ptr<asha::NotifyLatency> recorder(new asha::NotifyLatency("/bench"));
+   Time("latency::Now", iterations, [](size_t) { g_sink = g_sink + asha::latency::Now(); });
+   Time("Record", iterations, [&](size_t i) {
+      // Spread over the buckets a little, like real latencies.
+      int64_t t = (int64_t)i * 1000;
+      recorder->Record(t, t + (int64_t)(i & 0xffff), t + (int64_t)(i & 0xffff) + 500);
+   });
+   Time("Now, Now, Record (per event)", iterations, [&](size_t) {
+      int64_t entered = asha::latency::Now();
+      recorder->Record(entered - 1000, entered, asha::latency::Now());
+   });
+   return 0;
+}
@@ -0,0 +1,242 @@
+// Benchmark of PropertiesChanged dispatch as the number of watched objects
+// grows. It takes a name on the bus for itself, emits PropertiesChanged for
+// N characteristic paths in turn, and times how long they take to reach
+// their handlers: first through Bus, with its one subscription and table of
+// paths, then through a GDBus subscription and match rule per path, which is
+// what a proxy per characteristic amounts to.
+//
+// Run it on a private dbus-daemon, so that nothing else is listening:
+//
+//    dbus-run-session -- build/props_bench
+
+#include "src/Bus.hh"
+#include "src/Characteristic.hh"
+
+#include <glib-2.0/glib.h>
+#include <gio/gio.h>
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+   constexpr char SERVICE[] = "org.bluez.PropsBench";
+   constexpr char PROPERTIES_INTERFACE[] = "org.freedesktop.DBus.Properties";
+   // Signals emitted before waiting for them all to arrive, so that the
+   // daemon and the GDBus worker never have more than this queued up.
+   constexpr size_t BATCH = 256;
+
+   struct Options
+   {
+      std::string bus = asha::Bus::SESSION;
+      size_t signals = 20000;
+   };
+
+
+   // CPU time used by the whole process, emitting included, in seconds.
+   double CpuSeconds()
+   {
+      rusage usage{};
+      getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+   }
+
+
+   // A round trip to the daemon, after which it has seen every match rule
+   // the connection asked for before it.
+   void Sync(GDBusConnection* connection)
+   {
+      GVariant* result = g_dbus_connection_call_sync(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+         "org.freedesktop.DBus", "GetId", nullptr, nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, nullptr);
+      if (result)
+         g_variant_unref(result);
+   }
+
+
+   class Emitter
+   {
+   public:
+      explicit Emitter(const std::string& address)
+      {
+         GError* err = nullptr;
+         std::shared_ptr<gchar> resolved;
+         if (address == asha::Bus::SYSTEM || address == asha::Bus::SESSION)
+            resolved.reset(g_dbus_address_get_for_bus_sync(address == asha::Bus::SYSTEM ? G_BUS_TYPE_SYSTEM : G_BUS_TYPE_SESSION, nullptr, &err), g_free);
+         else
+            resolved.reset(g_strdup(address.c_str()), g_free);
+         if (resolved)
+            m_connection.reset(g_dbus_connection_new_for_address_sync(resolved.get(),
+               (GDBusConnectionFlags)(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+               nullptr, nullptr, &err), g_object_unref);
+         if (err)
+         {
+            std::cerr << "Unable to connect to " << address << ": " << err->message << '\n';
+            g_error_free(err);
+            exit(1);
+         }
+
+         GVariant* result = g_dbus_connection_call_sync(m_connection.get(), "org.freedesktop.DBus", "/org/freedesktop/DBus",
+            "org.freedesktop.DBus", "RequestName", g_variant_new("(su)", SERVICE, 0u), G_VARIANT_TYPE("(u)"),
+            G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &err);
+         if (!result)
+         {
+            std::cerr << "Unable to own " << SERVICE << ": " << err->message << '\n';
+            g_error_free(err);
+            exit(1);
+         }
+         g_variant_unref(result);
+
+         const uint8_t value[20] = {};
+         GVariantBuilder changed;
+         g_variant_builder_init(&changed, G_VARIANT_TYPE_VARDICT);
+         g_variant_builder_add(&changed, "{sv}", "Value", g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, value, sizeof(value), 1));
+         m_parameters.reset(g_variant_ref_sink(g_variant_new("(s@a{sv}@as)", asha::CHARACTERISTIC_INTERFACE,
+            g_variant_builder_end(&changed), g_variant_new_strv(nullptr, 0))), g_variant_unref);
+      }
+
+      void Emit(const std::string& path)
+      {
+         g_dbus_connection_emit_signal(m_connection.get(), nullptr, path.c_str(), PROPERTIES_INTERFACE, "PropertiesChanged",
+            m_parameters.get(), nullptr);
+      }
+
+      void Flush() { g_dbus_connection_flush_sync(m_connection.get(), nullptr, nullptr); }
+
+   private:
+      std::shared_ptr<GDBusConnection> m_connection;
+      std::shared_ptr<GVariant> m_parameters;
+   };
+
+
+   std::vector<std::string> Paths(size_t count)
+   {
+      std::vector<std::string> paths;
+      for (size_t i = 0; i < count; ++i)
+      {
+         char path[96];
+         snprintf(path, sizeof(path), "/org/bluez/hci0/dev_00_00_00_00_00_%02zX/service0001/char%04zx", i / 100, i % 100 + 2);
+         paths.push_back(path);
+      }
+      return paths;
+   }
+
+
+   // Emit that many signals, round robin over paths, a batch at a time, and
+   // wait for received to catch up with each batch.
+   void Run(const char* name, Emitter& emitter, const std::vector<std::string>& paths, size_t signals, const uint64_t& received)
+   {
+      uint64_t base = received;
+      auto start = std::chrono::steady_clock::now();
+      double cpu = CpuSeconds();
+      size_t emitted = 0;
+      int64_t deadline = g_get_monotonic_time() + 60 * G_USEC_PER_SEC;
+      while (emitted < signals && g_get_monotonic_time() < deadline)
+      {
+         for (size_t i = 0; i < BATCH && emitted < signals; ++i, ++emitted)
+            emitter.Emit(paths[emitted % paths.size()]);
+         emitter.Flush();
+         while (received - base < emitted && g_get_monotonic_time() < deadline)
+            g_main_context_iteration(nullptr, true);
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      cpu = CpuSeconds() - cpu;
+
+      uint64_t got = received - base;
+      std::cout << std::left << std::setw(10) << name << std::right << std::setw(6) << paths.size() << " paths  "
+                << std::setw(8) << got << " signals  " << std::fixed << std::setprecision(0)
+                << std::setw(8) << got / elapsed.count() << "/s  " << std::setprecision(1)
+                << std::setw(6) << (got ? cpu * 1e6 / got : 0) << "us CPU each\n";
+      if (got != signals)
+         std::cout << "          only " << got << " of " << signals << " arrived\n";
+   }
+
+
+   void Usage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " [options]\n"
+                   "   -b, --bus ADDR       system, session (default), or a dbus address\n"
+                   "   -n, --signals N      Signals to send for each run (default 20000)\n"
+                   "   -h, --help           Show this message\n";
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   Options options;
+
+   const option long_options[] = {
+      {"bus",     required_argument, nullptr, 'b'},
+      {"signals", required_argument, nullptr, 'n'},
+      {"help",    no_argument,       nullptr, 'h'},
+      {nullptr,   0,                 nullptr, 0},
+   };
+   int opt;
+   while ((opt = getopt_long(argc, argv, "b:n:h", long_options, nullptr)) != -1)
+   {
+      switch (opt)
+      {
+      case 'b': options.bus = optarg; break;
+      case 'n': options.signals = strtoul(optarg, nullptr, 10); break;
+      case 'h':
+         Usage(argv[0]);
+         return 0;
+      default:
+         Usage(argv[0]);
+         return 1;
+      }
+   }
+
+   Emitter emitter(options.bus);
+   uint64_t received = 0;
+   for (size_t count: {10, 100, 1000})
+   {
+      auto paths = Paths(count);
+      std::shared_ptr<asha::Bus> bus;
+      try
+      {
+         bus = asha::Bus::Connect(options.bus, SERVICE);
+      }
+      catch (const std::exception& e)
+      {
+         std::cerr << e.what() << '\n';
+         return 1;
+      }
+
+      for (auto& path: paths)
+         bus->WatchProperties(path, [&received](const char*, const char*, GVariant*, GVariant*) { ++received; });
+      Sync(bus->Connection());
+      Run("Bus", emitter, paths, options.signals, received);
+
+      // Without its subscription, so that only the per path ones see the
+      // signals.
+      bus = asha::Bus::Connect(options.bus, SERVICE, std::string(), asha::Bus::Signals::NONE);
+
+      // Lambda doesn't work with a C callback that needs a user_data.
+      struct Callback {
+         static void Signal(GDBusConnection* c, const gchar* sender, const gchar* path, const gchar* iface, const gchar* signal, GVariant* parameters, gpointer user_data)
+         {
+            ++*(uint64_t*)user_data;
+         }
+      };
+      std::vector<unsigned> subscriptions;
+      for (auto& path: paths)
+         subscriptions.push_back(g_dbus_connection_signal_subscribe(bus->Connection(), SERVICE, PROPERTIES_INTERFACE,
+            "PropertiesChanged", path.c_str(), asha::CHARACTERISTIC_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE,
+            &Callback::Signal, &received, nullptr));
+      Sync(bus->Connection());
+      Run("per path", emitter, paths, options.signals, received);
+      for (auto id: subscriptions)
+         g_dbus_connection_signal_unsubscribe(bus->Connection(), id);
+   }
+   return 0;
+}
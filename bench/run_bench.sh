@@ -0,0 +1,36 @@
+#!/bin/sh
+# Run gatt_bench against mock_bluez on a private dbus-daemon, so that nothing
+# touches the system bus or any real radios.
+#
+#    bench/run_bench.sh [build dir] [mock_bluez options] -- [gatt_bench options]
+#
+# For example:
+#    bench/run_bench.sh build --devices 30 --characteristics 80 --read-latency 20 -- --window 16
+
+set -e
+
+BUILD=${1:-build}
+[ $# -gt 0 ] && shift
+
+MOCK_ARGS=""
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+   MOCK_ARGS="$MOCK_ARGS $1"
+   shift
+done
+[ "$1" = "--" ] && shift
+
+OUT=$(dbus-daemon --session --fork --print-address=1 --print-pid=1)
+ADDRESS=$(echo "$OUT" | sed -n 1p)
+DAEMON_PID=$(echo "$OUT" | sed -n 2p)
+
+"$BUILD/mock_bluez" --bus "$ADDRESS" $MOCK_ARGS > /dev/null &
+MOCK_PID=$!
+
+cleanup()
+{
+   kill "$MOCK_PID" 2> /dev/null || true
+   kill "$DAEMON_PID" 2> /dev/null || true
+}
+trap cleanup EXIT
+
+"$BUILD/gatt_bench" --bus "$ADDRESS" "$@"
@@ -0,0 +1,153 @@
+// Benchmark of building GATT tables from the object cache, the single pass
+// over the managed objects that Bluetooth makes for every device it adds. It
+// makes up a bluez-like GetManagedObjects reply of about 10,000 objects
+// (a{oa{sa{sv}}}), loads it into an ObjectCache, and times
+// Bluetooth::ReadGattTable for every device in it.
+
+#include "src/Bluetooth.hh"
+#include "src/ObjectCache.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+   // Per device: its Device1, SERVICES services of CHARACTERISTICS
+   // characteristics, each with DESCRIPTORS descriptors. 100 objects.
+   constexpr unsigned SERVICES = 3;
+   constexpr unsigned CHARACTERISTICS = 8;
+   constexpr unsigned DESCRIPTORS = 3;
+   constexpr unsigned OBJECTS_PER_DEVICE = 1 + SERVICES * (1 + CHARACTERISTICS * (1 + DESCRIPTORS));
+
+   // Keeps the compiler from throwing the work away.
+   volatile size_t g_sink;
+
+   void AddObject(GVariantBuilder* objects, const char* path, const char* iface, GVariantBuilder* props)
+   {
+      GVariantBuilder ifaces;
+      g_variant_builder_init(&ifaces, G_VARIANT_TYPE("a{sa{sv}}"));
+      g_variant_builder_add(&ifaces, "{s@a{sv}}", iface, g_variant_builder_end(props));
+      g_variant_builder_add(objects, "{o@a{sa{sv}}}", path, g_variant_builder_end(&ifaces));
+   }
+
+
+   // Returns the reply's a{oa{sa{sv}}}, and the device paths in devices.
+   GVariant* MakeUp(unsigned device_count, std::vector<std::string>& devices)
+   {
+      GVariantBuilder objects;
+      g_variant_builder_init(&objects, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+      const uint8_t value[20] = {};
+      const char* flags[] = {"read", "notify", nullptr};
+
+      GVariantBuilder props;
+      g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add(&props, "{sv}", "Address", g_variant_new_string("00:00:00:00:00:00"));
+      AddObject(&objects, "/org/bluez/hci0", "org.bluez.Adapter1", &props);
+
+      for (unsigned d = 0; d < device_count; ++d)
+      {
+         char device[64];
+         snprintf(device, sizeof(device), "/org/bluez/hci0/dev_00_00_00_00_%02X_%02X", (d >> 8) & 0xff, d & 0xff);
+         devices.push_back(device);
+
+         g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+         g_variant_builder_add(&props, "{sv}", "Address", g_variant_new_string(device + 20));
+         g_variant_builder_add(&props, "{sv}", "Name", g_variant_new_string("Some hearing aid"));
+         g_variant_builder_add(&props, "{sv}", "Connected", g_variant_new_boolean(true));
+         g_variant_builder_add(&props, "{sv}", "ServicesResolved", g_variant_new_boolean(true));
+         AddObject(&objects, device, "org.bluez.Device1", &props);
+
+         for (unsigned s = 0; s < SERVICES; ++s)
+         {
+            char service[96];
+            snprintf(service, sizeof(service), "%s/service%04x", device, s * 0x40);
+            g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+            g_variant_builder_add(&props, "{sv}", "UUID", g_variant_new_string("0000fdf0-0000-1000-8000-00805f9b34fb"));
+            g_variant_builder_add(&props, "{sv}", "Device", g_variant_new_object_path(device));
+            g_variant_builder_add(&props, "{sv}", "Primary", g_variant_new_boolean(true));
+            AddObject(&objects, service, "org.bluez.GattService1", &props);
+
+            for (unsigned c = 0; c < CHARACTERISTICS; ++c)
+            {
+               char characteristic[128];
+               snprintf(characteristic, sizeof(characteristic), "%s/char%04x", service, s * 0x40 + c * 4 + 1);
+               g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+               g_variant_builder_add(&props, "{sv}", "UUID", g_variant_new_string("6333651e-c481-4a3e-9169-7c902aad37bb"));
+               g_variant_builder_add(&props, "{sv}", "Service", g_variant_new_object_path(service));
+               g_variant_builder_add(&props, "{sv}", "Value", g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, value, sizeof(value), 1));
+               g_variant_builder_add(&props, "{sv}", "Flags", g_variant_new_strv(flags, -1));
+               g_variant_builder_add(&props, "{sv}", "NotifyAcquired", g_variant_new_boolean(false));
+               AddObject(&objects, characteristic, "org.bluez.GattCharacteristic1", &props);
+
+               for (unsigned n = 0; n < DESCRIPTORS; ++n)
+               {
+                  char descriptor[160];
+                  snprintf(descriptor, sizeof(descriptor), "%s/desc%04x", characteristic, s * 0x40 + c * 4 + n + 2);
+                  g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+                  g_variant_builder_add(&props, "{sv}", "UUID", g_variant_new_string("00002902-0000-1000-8000-00805f9b34fb"));
+                  g_variant_builder_add(&props, "{sv}", "Characteristic", g_variant_new_object_path(characteristic));
+                  g_variant_builder_add(&props, "{sv}", "Value", g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, value, 2, 1));
+                  AddObject(&objects, descriptor, "org.bluez.GattDescriptor1", &props);
+               }
+            }
+         }
+      }
+
+      return g_variant_ref_sink(g_variant_builder_end(&objects));
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   size_t target = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+   int iterations = argc > 2 ? atoi(argv[2]) : 20;
+   unsigned device_count = std::max<unsigned>(1, (unsigned)(target / OBJECTS_PER_DEVICE));
+
+   std::vector<std::string> devices;
+   GVariant* objects = MakeUp(device_count, devices);
+   size_t object_count = g_variant_n_children(objects);
+
+   auto start = std::chrono::steady_clock::now();
+   asha::ObjectCache cache;
+   cache.Reset(objects);
+   std::chrono::duration<double, std::milli> reset = std::chrono::steady_clock::now() - start;
+
+   // Check that the table came out the shape it went in.
+   auto table = asha::Bluetooth::ReadGattTable(cache, devices.front());
+   size_t characteristics = table.Characteristics().size(), descriptors = 0;
+   for (auto c: table.Characteristics())
+      descriptors += c.Descriptors().size();
+   if (table.Services().size() != SERVICES || characteristics != SERVICES * CHARACTERISTICS ||
+       descriptors != SERVICES * CHARACTERISTICS * DESCRIPTORS)
+   {
+      std::cerr << "Wrong table for " << devices.front() << ": " << table.Services().size() << " services, "
+                << characteristics << " characteristics, " << descriptors << " descriptors\n";
+      return 1;
+   }
+
+   start = std::chrono::steady_clock::now();
+   for (int i = 0; i < iterations; ++i)
+      for (auto& device: devices)
+         g_sink = g_sink + asha::Bluetooth::ReadGattTable(cache, device).Characteristics().size();
+   std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+   double pass = elapsed.count() / iterations;
+
+   std::cout << object_count << " objects, " << devices.size() << " devices\n"
+             << std::fixed << std::setprecision(2)
+             << "ObjectCache::Reset  " << std::setw(10) << reset.count() << " ms\n"
+             << "ReadGattTable       " << std::setw(10) << pass << " ms for all devices  "
+             << std::setw(8) << pass * 1000 / devices.size() << " us/device  "
+             << std::setw(8) << pass * 1e6 / object_count << " ns/object\n";
+
+   g_variant_unref(objects);
+   return 0;
+}
@@ -1,176 +1,970 @@
+#include "src/AdapterWatch.hh"
 #include "src/Bluetooth.hh"
+#include "src/DumpPlan.hh"
+#include "src/Hex.hh"
+#include "src/IoThread.hh"
+#include "src/Latency.hh"
+#include "src/Log.hh"
+#include "src/Metrics.hh"
+#include "src/MetricsServer.hh"
+#include "src/OutputSink.hh"
+#include "src/Quarantine.hh"
+#include "src/ReadTimeout.hh"
+#include "src/ValueCache.hh"
+#include "src/WorkerPool.hh"
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <glib-2.0/glib.h>
 #include <glib-2.0/glib-unix.h>
 
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <vector>
 #include <fstream>
-#include <sstream>
 #include <iomanip>
 #include <set>
 
 
-const std::set<std::string> bad_read_uuids = {
-   "30e69638-3752-4feb-a3aa-3226bcd05ace",    // It disconnects when I try to read this, but notification subscriptions succeed.
-   "2bdcaebe-8746-45df-a841-96b840980fb8",    // Disconnects on read.
-   "2bdcaebe-8746-45df-a841-96b840980fb7",    // Disconnects on read.
-};
+// How many reads can be outstanding on a single device at once.
+constexpr size_t DEFAULT_MAX_READS = 8;
+// How much output each worker thread can fall behind by before it gets dropped.
+constexpr size_t DEFAULT_QUEUE_SIZE = 4096;
+// How much output gets held back before it is written, when it isn't
+// written per event.
+constexpr size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+// How often buffered output gets written out anyway, so that a quiet
+// stretch doesn't leave it sitting there.
+constexpr unsigned OUTPUT_FLUSH_SECONDS = 1;
+
+using namespace asha::literals;
 
-const std::map<std::string, std::string> descriptors = {
-   {"00002901-0000-1000-8000-00805f9b34fb", "description"},
-   {"00002902-0000-1000-8000-00805f9b34fb", "CCC"}
+// A read that failed this long before its device went away gets some of
+// the blame for it.
+constexpr int64_t DISCONNECT_BLAME_NS = 2000000000;
+
+// Never read unless a plan says otherwise. Plans can add more, and the
+// quarantine learns more as it goes.
+constexpr asha::Uuid bad_read_uuids[] = {
+   "30e69638-3752-4feb-a3aa-3226bcd05ace"_uuid,    // It disconnects when I try to read this, but notification subscriptions succeed.
+   "2bdcaebe-8746-45df-a841-96b840980fb8"_uuid,    // Disconnects on read.
+   "2bdcaebe-8746-45df-a841-96b840980fb7"_uuid,    // Disconnects on read.
 };
 
-template <typename T>
-std::string join(const std::string& s, const T& list)
-{
-   if (list.empty()) return "";
-   auto it = list.begin();
-   std::stringstream ss;
-   ss << *it;
-   for (++it; it != list.end(); ++it)
-      ss << s << *it;
-   return ss.str();
-}
+// The value of this keys the value cache, when the device has one.
+constexpr asha::Uuid DATABASE_HASH = asha::Uuid::FromShort(0x2b2a);
+// Indicated when the device's database changes under us.
+constexpr asha::Uuid SERVICE_CHANGED = asha::Uuid::FromShort(0x2a05);
+
+const std::map<asha::Uuid, std::string> descriptors = {
+   {asha::Uuid::FromShort(0x2901), "description"},
+   {asha::Uuid::FromShort(0x2902), "CCC"}
+};
 
 class GattDump
 {
 public:
-   GattDump():
+   // With a pool, all of the output gets encoded and written by its workers,
+   // so that a slow stdout can't hold up dbus.
+   // An empty cache_dir turns the value cache off. Only what plan selects
+   // gets dumped. Characteristics in quarantine don't get read, and ones
+   // whose reads time out or take their device down get added to it.
+   // read_policy says whether values bluez has cached will do.
+   GattDump(asha::OutputSink& sink, size_t max_reads = DEFAULT_MAX_READS, const std::shared_ptr<asha::Bus>& bus = nullptr,
+            asha::WorkerPool* pool = nullptr, const std::string& cache_dir = asha::ValueCache::DefaultDirectory(),
+            const asha::DumpPlan& plan = asha::DumpPlan(), const std::shared_ptr<asha::Quarantine>& quarantine = nullptr,
+            asha::ReadPolicy read_policy = asha::ReadPolicy::RADIO):
+      m_sink(sink),
+      m_plan(plan),
+      m_max_reads(max_reads),
+      m_pool(pool),
+      m_cache(cache_dir.empty() ? nullptr : std::make_shared<asha::ValueCache>(cache_dir)),
+      m_quarantine(quarantine),
+      m_read_policy(read_policy),
       m_b(
-         [this](const asha::Bluetooth::BluezDevice& d) { OnAddDevice(d); },
-         [this](const std::string& p) { OnRemoveDevice(p); }
+         [this](asha::Bluetooth::BluezDevice&& d) { OnAddDevice(std::move(d)); },
+         [this](const std::string& p) { OnRemoveDevice(p); },
+         bus
       )
    {
       
    }
 
 protected:
-   static std::string HexDump(const std::vector<uint8_t>& bytes)
+   // Output events, either right here or on a worker. Everything emitted with
+   // the same key comes out in order.
+   void Emit(const std::string& key, std::vector<asha::OutputEvent> events)
    {
-      std::stringstream ss;
-      bool first = true;
-      for (uint8_t b: bytes)
+      if (!m_pool)
       {
-         if (!first) ss << ' ';
-         ss << std::hex << std::setfill('0') << std::setw(2) << (unsigned)b;
-         first = false;
+         m_sink.Write(events);
+         return;
       }
-      return ss.str();
+      auto sink = &m_sink;
+      m_pool->Post(std::hash<std::string>()(key), [sink, events]() {
+         sink->Write(events);
+      });
+   }
+
+   // An event about the object at path on the device at device_path,
+   // timestamped now.
+   static asha::OutputEvent Event(asha::OutputEvent::Type type, const std::string& device_path, const std::string& path = std::string(),
+                                  const asha::Uuid& uuid = asha::Uuid())
+   {
+      asha::OutputEvent e;
+      e.type = type;
+      e.time = g_get_real_time();
+      e.device = device_path;
+      e.path = path;
+      e.uuid = uuid;
+      return e;
    }
 
-   static std::string Printable(const std::vector<uint8_t>& bytes)
+   // Whether the plan reads anything at all, which is all the value cache is
+   // good for.
+   bool Reads() const
    {
-      std::string ret;
-      for (uint8_t c: bytes)
+      return m_plan.Wants(asha::DumpPlan::READ) || m_plan.Wants(asha::DumpPlan::DESCRIPTORS);
+   }
+
+   void OnAddDevice(asha::Bluetooth::BluezDevice&& d)
+   {
+      if (!m_plan.WantsDevice(d.mac))
+      {
+         g_info("Leaving %s alone, it isn't selected", d.name.c_str());
+         return;
+      }
+
+      auto e = Event(asha::OutputEvent::Type::DEVICE, d.path);
+      e.name = d.name;
+      e.address = d.mac;
+      for (auto service: d.gatt.Services())
+         e.services += m_plan.WantsService(service.UUID());
+      Emit(d.path, {std::move(e)});
+
+      // Keep the device, so that its GATT table is still around if we have
+      // to wait for the Database Hash.
+      auto path = d.path;
+      auto& added = m_added[path];
+      added.device = std::move(d);
+      uint64_t generation = added.generation = ++m_generation;
+      auto& device = added.device;
+
+      if (m_cache && Reads() && !device.mac.empty())
       {
-         switch (c)
+         for (auto gc: device.gatt.Characteristics())
          {
-         case '\0': ret += "\\0"; break;
-         case '\a': ret += "\\a"; break;
-         case '\b': ret += "\\b"; break;
-         case '\t': ret += "\\t"; break;
-         case '\n': ret += "\\n"; break;
-         case '\v': ret += "\\v"; break;
-         case '\f': ret += "\\f"; break;
-         case '\r': ret += "\\r"; break;
-         default:
-            if (c >= 32 && c < 127)
-               ret += (char)c;
-            else
-            {
-               std::stringstream ss;
-               ss << std::setfill('0') << std::setw(3) << std::oct << (unsigned)c;
-               ret += "\\" + ss.str();
-            }
+            if (gc.UUID() != DATABASE_HASH || !gc.HasFlag(asha::Characteristic::READ))
+               continue;
+            // Timed like any other read, so that a device that never answers
+            // doesn't hold up its dump for bluez's 25 seconds. Always from the
+            // device, whatever the read policy: a hash bluez cached before
+            // the database changed would key stale values.
+            auto hash = std::make_shared<asha::Characteristic>(gc, device.bus);
+            GuardedRead(hash, ReadsFor(device), false)([this, path, generation, hash](const std::vector<uint8_t>& value) {
+               // The device may have been removed, or even added again, while
+               // the read was in flight.
+               auto it = m_added.find(path);
+               if (it == m_added.end() || it->second.generation != generation)
+                  return;
+               auto& device = it->second.device;
+               Dump(device, value.empty() ? asha::ValueCache::TableKey(path, device.gatt) : asha::ValueCache::HashKey(asha::ByteView(value)));
+            });
+            return;
          }
       }
-      return ret;
+      Dump(device, m_cache && Reads() ? asha::ValueCache::TableKey(path, device.gatt) : std::string());
    }
 
+   // Reads on one device, which keeps learning how long they take across
+   // reconnects.
+   struct DeviceReads
+   {
+      std::string mac;
+      asha::ReadTimeout timeout;
+      // Every read that hasn't been answered yet, oldest first.
+      std::set<uint64_t> pending;
+      // Characteristic reads that haven't been answered yet, and ones that
+      // failed lately, any of which might be why the device goes away.
+      std::map<uint64_t, asha::Uuid> in_flight;
+      std::deque<std::pair<int64_t, asha::Uuid>> failed;
+      // When a read last timed out. bluez issues one ATT request at a time
+      // per link, so reads started before then were stuck behind it.
+      int64_t stalled = 0;
+      uint64_t next_id = 0;
+   };
+
+   std::shared_ptr<DeviceReads> ReadsFor(const asha::Bluetooth::BluezDevice& d)
+   {
+      auto& reads = m_reads[d.path];
+      if (!reads)
+         reads = std::make_shared<DeviceReads>();
+      reads->mac = d.mac;
+      return reads;
+   }
 
-   void OnAddDevice(const asha::Bluetooth::BluezDevice& d)
+   // A read that gives up once it has taken far longer than the device's
+   // reads usually do. A characteristic whose read times out gets
+   // quarantined if it was the oldest read outstanding; the reads queued up
+   // behind it time out too, through no fault of their own, so they only
+   // get a strike. Descriptors never do, since every characteristic has the
+   // same few. These always go to the device, so that every time recorded is
+   // a real round trip; values bluez has cached never come through here.
+   template <typename T>
+   std::function<void(asha::Characteristic::ReadCallback)> GuardedRead(const std::shared_ptr<T>& attribute, const std::shared_ptr<DeviceReads>& reads, bool characteristic)
    {
-      std::cout << d.name << " with " << d.services.size() << " services\n";
+      auto quarantine = characteristic ? m_quarantine : nullptr;
+      return [attribute, reads, quarantine](asha::Characteristic::ReadCallback cb) {
+         auto uuid = attribute->UUID();
+         uint64_t id = reads->next_id++;
+         reads->pending.insert(id);
+         if (quarantine)
+            reads->in_flight[id] = uuid;
+         int timeout = reads->timeout.Timeout();
+         int64_t start = asha::latency::Now();
+         attribute->ReadAsync(timeout, [reads, quarantine, id, uuid, timeout, start, cb](const std::vector<uint8_t>& value, asha::Bus::CallStatus status) {
+            int64_t now = asha::latency::Now();
+            bool oldest = reads->pending.begin() != reads->pending.end() && *reads->pending.begin() == id;
+            bool behind = start < reads->stalled;
+            reads->pending.erase(id);
+            reads->in_flight.erase(id);
+            if (status == asha::Bus::CallStatus::OK)
+            {
+               reads->timeout.Record(now - start);
+            }
+            else if (status == asha::Bus::CallStatus::TIMED_OUT)
+            {
+               std::string reason = "read timed out after " + std::to_string(timeout) + "ms";
+               if (quarantine && oldest && !behind)
+                  quarantine->Add(uuid, reads->mac, reason);
+               else if (quarantine)
+                  quarantine->Strike(uuid, reads->mac, reason + " behind another read");
+               if (!behind)
+                  reads->stalled = now;
+            }
+            else if (quarantine)
+            {
+               reads->failed.emplace_back(now, uuid);
+               while (reads->failed.front().first < now - DISCONNECT_BLAME_NS)
+                  reads->failed.pop_front();
+            }
+            cb(value);
+         });
+      };
+   }
 
+   void Dump(const asha::Bluetooth::BluezDevice& d, const std::string& cache_key)
+   {
       auto& characteristics = m_devices[d.path];
+      auto path = d.path;
+      auto mac = d.mac;
+      auto reads = ReadsFor(d);
+      auto job = std::make_shared<DumpJob>([this, path](std::vector<asha::OutputEvent> events) { Emit(path, std::move(events)); });
+      m_jobs[d.path] = job;
+
+      // Static values can come straight out of the cache, as long as the
+      // database hasn't changed since they went in.
+      auto cache = Reads() ? m_cache : nullptr;
+      bool cached = cache && cache->Open(mac, cache_key);
+      size_t served = 0;
+      // Whether any value gets served from the cache or stored in it.
+      bool uses_cache = false;
+      // Reads a value that may or may not be cached, and stores it if it
+      // should be.
+      auto append_read = [&](asha::OutputEvent e, DumpJob::Reader reader) {
+         auto uuid = e.uuid;
+         if (!cache || !asha::ValueCache::IsStatic(uuid))
+         {
+            job->AppendRead(std::move(e), std::move(reader));
+            return;
+         }
+         uses_cache = true;
+         std::string attribute = e.path.substr(std::min(path.size(), e.path.size()));
+         std::vector<uint8_t> value;
+         if (cached && cache->Find(mac, attribute, uuid, value))
+         {
+            job->AppendValue(std::move(e), std::move(value));
+            ++served;
+            return;
+         }
+         job->AppendRead(std::move(e), [cache, mac, attribute, uuid, reader](asha::Characteristic::ReadCallback cb) {
+            reader([cache, mac, attribute, uuid, cb](const std::vector<uint8_t>& value) {
+               if (!value.empty())
+                  cache->Store(mac, attribute, uuid, asha::ByteView(value));
+               cb(value);
+            });
+         });
+      };
 
-      for (auto& kv: d.services)
+      // Values bluez has cached need no round trip at all, when the policy
+      // lets us use them.
+      size_t from_bluez = 0;
+      auto append_attribute = [&](asha::OutputEvent e, const std::vector<uint8_t>* cached_value, DumpJob::Reader reader) {
+         if (cached_value && m_read_policy != asha::ReadPolicy::RADIO)
+         {
+            job->AppendValue(std::move(e), *cached_value);
+            ++from_bluez;
+         }
+         else if (m_read_policy == asha::ReadPolicy::CACHED)
+         {
+            e.read = asha::OutputEvent::Read::SKIPPED;
+            job->Append(std::move(e));
+         }
+         else
+         {
+            append_read(std::move(e), std::move(reader));
+         }
+      };
+
+      for (auto service: d.gatt.Services())
       {
-         std::cout << "   " << kv.second.uuid << " " << kv.second.path << '\n';
-         for (auto& read_only_c: kv.second.characteristics)
+         if (!m_plan.WantsService(service.UUID()))
+            continue;
+         job->Append(Event(asha::OutputEvent::Type::SERVICE, path, service.Path(), service.UUID()));
+         for (auto gc: service.Characteristics())
          {
-            // Copy this so that we can change its state (for notifications)
-            characteristics[read_only_c.Path()].reset(new asha::Characteristic(read_only_c));
-            auto& c = *characteristics[read_only_c.Path()];
-            std::cout << "      " << c.UUID() << " " << c.Path().substr(c.Path().rfind('/'))  << " [" << join(", ", c.Flags()) << "] ";
-            if (c.Flags().count("notify"))
-            {
-               std::cout << "[subscribed] ";
+            if (!m_plan.WantsCharacteristic(gc.UUID()))
+               continue;
+            std::string cpath = gc.Path();
+            auto line = Event(asha::OutputEvent::Type::CHARACTERISTIC, path, cpath, gc.UUID());
+            line.flags = gc.Flags();
 
-               c.Notify([=](const std::vector<uint8_t> &v) {
-                  std::cout << "Notify: " << c.UUID() << " " << c.Path() << " " << HexDump(v) << '\n';
-               });
+            // Only characteristics that we read or subscribe to need an
+            // object of their own.
+            bool notify = gc.HasFlag(asha::Characteristic::NOTIFY) && m_plan.Wants(asha::DumpPlan::NOTIFY);
+            bool read = gc.HasFlag(asha::Characteristic::READ) && m_plan.Wants(asha::DumpPlan::READ);
+            bool skip_read = read && (!m_plan.WantsRead(gc.UUID()) || (m_quarantine && m_quarantine->Contains(gc.UUID(), mac)));
+            std::shared_ptr<asha::Characteristic> pc;
+            if (notify || (read && !skip_read))
+            {
+               auto& existing = characteristics[cpath];
+               if (!existing)
+                  existing = std::make_shared<asha::Characteristic>(gc, d.bus, m_read_policy);
+               pc = existing;
             }
-            if (c.Flags().count("read"))
+            if (notify)
             {
-               if (bad_read_uuids.count(c.UUID()))
-                  std::cout << " <not read>";
+               // Capture what gets output rather than the characteristic,
+               // which can't be copied. Only the bytes get copied here; the
+               // encoding happens on the worker, if there is one.
+               auto sink = &m_sink;
+               auto pool = m_pool;
+               auto uuid = gc.UUID();
+               // Service Changed drops the cache as well, since this is the
+               // only subscription it gets.
+               auto invalidate = uuid == SERVICE_CHANGED ? cache : nullptr;
+               // StartNotify is bounded by Bus::CALL_TIMEOUT_MS, so a device
+               // that never acknowledges it only holds the dump up that long.
+               line.subscribed = pc->Notify([sink, pool, path, uuid, cpath, invalidate, mac](asha::ByteView v) {
+                  if (invalidate)
+                  {
+                     g_info("Service Changed on %s, dropping its cached values", mac.c_str());
+                     invalidate->Invalidate(mac);
+                  }
+                  auto e = Event(asha::OutputEvent::Type::NOTIFY, path, cpath, uuid);
+                  e.value = v.ToVector();
+                  if (!pool)
+                  {
+                     sink->Write(e);
+                     return;
+                  }
+                  pool->Post(std::hash<std::string>()(cpath), [sink, e]() {
+                     sink->Write(e);
+                  });
+               }, asha::Characteristic::NotifyMode::Socket);
+            }
+            if (read)
+            {
+               if (skip_read)
+               {
+                  line.read = asha::OutputEvent::Read::SKIPPED;
+                  job->Append(std::move(line));
+               }
                else
                {
-                  auto value = c.Read();
-                  std::cout << HexDump(value) << " \"" << Printable(value) << "\"";
+                  append_attribute(std::move(line), pc->HasCachedValue() ? &pc->CachedValue() : nullptr, GuardedRead(pc, reads, true));
                }
             }
-            std::cout << "\n";
+            else
+            {
+               job->Append(std::move(line));
+            }
 
-            for (auto& d: c.Descriptors())
+            if (!m_plan.Wants(asha::DumpPlan::DESCRIPTORS))
+               continue;
+            for (auto gd: gc.Descriptors())
             {
-               auto value = d.Read();
-               auto it = descriptors.find(d.UUID());
+               auto it = descriptors.find(gd.UUID());
                std::string dname = it == descriptors.end() ? "unknown descriptor" : it->second;
                if (!dname.empty())
-                  std::cout << "         " << d.UUID() << " " << d.Path().substr(d.Path().rfind('/')) << " [" << dname << "] " << HexDump(value) << " \"" << Printable(value) << "\"\n";
+               {
+                  auto e = Event(asha::OutputEvent::Type::DESCRIPTOR, path, gd.Path(), gd.UUID());
+                  e.name = dname;
+                  auto pd = std::make_shared<asha::Descriptor>(gd, d.bus, m_read_policy);
+                  append_attribute(std::move(e), pd->HasCachedValue() ? &pd->CachedValue() : nullptr, GuardedRead(pd, reads, false));
+               }
             }
          }
       }
+
+      // Whether or not the plan selects it, Service Changed means that what
+      // went into the cache may be stale. bluez will go and resolve the
+      // services again, and the next add reads everything afresh. A device
+      // whose dump never touches the cache doesn't need the subscription, or
+      // the CCC write that comes with it.
+      if (uses_cache)
+      {
+         for (auto gc: d.gatt.Characteristics())
+         {
+            if (gc.UUID() != SERVICE_CHANGED || !gc.HasFlag(asha::Characteristic::INDICATE))
+               continue;
+            auto& pc = characteristics[gc.Path()];
+            // The plan may have subscribed to it already, in which case that
+            // subscription drops the cache too.
+            if (pc && pc->Notifying())
+               continue;
+            if (!pc)
+               pc = std::make_shared<asha::Characteristic>(gc, d.bus, m_read_policy);
+            pc->Notify([cache, mac](asha::ByteView) {
+               g_info("Service Changed on %s, dropping its cached values", mac.c_str());
+               cache->Invalidate(mac);
+            });
+         }
+      }
+
+      if (served)
+         g_info("Served %zu values for %s from the cache", served, mac.c_str());
+      if (from_bluez)
+         g_info("Served %zu values for %s from bluez's cache", from_bluez, mac.c_str());
+      job->Start(m_max_reads, [cache, mac]() {
+         if (cache)
+            cache->Save(mac);
+      });
    }
+
    void OnRemoveDevice(const std::string& path)
    {
+      auto added = m_added.find(path);
+      if (added != m_added.end())
+      {
+         // Keep whatever got read before it went away.
+         if (m_cache)
+            m_cache->Save(added->second.device.mac);
+         m_added.erase(added);
+      }
+      auto reads = m_reads.find(path);
+      if (reads != m_reads.end())
+         Blame(*reads->second);
+      m_jobs.erase(path);
       m_devices.erase(path);
    }
 
+   // A device went away. Whatever was being read at the time, or failed just
+   // before, might be why.
+   void Blame(DeviceReads& reads)
+   {
+      std::set<asha::Uuid> suspects;
+      for (auto& kv: reads.in_flight)
+         suspects.insert(kv.second);
+      int64_t since = asha::latency::Now() - DISCONNECT_BLAME_NS;
+      for (auto& f: reads.failed)
+         if (f.first >= since)
+            suspects.insert(f.second);
+      reads.pending.clear();
+      reads.in_flight.clear();
+      reads.failed.clear();
+      if (!m_quarantine)
+         return;
+      for (auto& uuid: suspects)
+         m_quarantine->Strike(uuid, reads.mac, "being read when the device disconnected");
+   }
+
 protected:
-   
+   // The dump output for one device. Reads are issued asynchronously, at most
+   // max_reads at a time, but events are still output in GATT order as soon
+   // as everything before them has completed.
+   class DumpJob: public std::enable_shared_from_this<DumpJob>
+   {
+   public:
+      typedef std::function<void(asha::Characteristic::ReadCallback)> Reader;
+      typedef std::function<void(std::vector<asha::OutputEvent>)> Output;
+
+      explicit DumpJob(Output output): m_output(std::move(output)) {}
+
+      void Append(asha::OutputEvent e)
+      {
+         m_lines.push_back(Line{std::move(e), true});
+      }
+
+      // A value we already have, output the same way as one that was read.
+      void AppendValue(asha::OutputEvent e, std::vector<uint8_t> value)
+      {
+         e.read = asha::OutputEvent::Read::DONE;
+         e.value = std::move(value);
+         m_lines.push_back(Line{std::move(e), true});
+      }
+
+      // e goes out once reader has the value, with the time it arrived.
+      void AppendRead(asha::OutputEvent e, Reader reader)
+      {
+         size_t idx = m_lines.size();
+         m_lines.push_back(Line{std::move(e), false});
+         m_pending.push_back([this, idx, reader]() {
+            std::weak_ptr<DumpJob> wself = shared_from_this();
+            reader([wself, idx](const std::vector<uint8_t>& value) {
+               // The device may have been removed while the read was in flight.
+               auto self = wself.lock();
+               if (self)
+                  self->OnRead(idx, value);
+            });
+         });
+      }
+
+      // done gets called once every line has been output.
+      void Start(size_t max_reads, std::function<void()> done = nullptr)
+      {
+         m_max_reads = std::max<size_t>(max_reads, 1);
+         m_done = std::move(done);
+         Flush();
+         Issue();
+      }
+
+   private:
+      struct Line
+      {
+         asha::OutputEvent event;
+         bool done;
+      };
+
+      void OnRead(size_t idx, const std::vector<uint8_t>& value)
+      {
+         auto& e = m_lines[idx].event;
+         e.time = g_get_real_time();
+         e.read = asha::OutputEvent::Read::DONE;
+         e.value = value;
+         m_lines[idx].done = true;
+         --m_in_flight;
+         Flush();
+         Issue();
+      }
+
+      void Issue()
+      {
+         while (m_in_flight < m_max_reads && !m_pending.empty())
+         {
+            auto read = std::move(m_pending.front());
+            m_pending.pop_front();
+            ++m_in_flight;
+            read();
+         }
+      }
+
+      void Flush()
+      {
+         std::vector<asha::OutputEvent> events;
+         while (m_printed < m_lines.size() && m_lines[m_printed].done)
+         {
+            events.push_back(std::move(m_lines[m_printed].event));
+            ++m_printed;
+         }
+         if (!events.empty())
+            m_output(std::move(events));
+         if (m_printed == m_lines.size() && m_done)
+         {
+            auto done = std::move(m_done);
+            m_done = nullptr;
+            done();
+         }
+      }
+
+      Output m_output;
+      std::vector<Line> m_lines;
+      std::deque<std::function<void()>> m_pending;
+      size_t m_printed = 0;
+      size_t m_in_flight = 0;
+      size_t m_max_reads = 1;
+      std::function<void()> m_done;
+   };
 
 
 private:
+   asha::OutputSink& m_sink;
+   asha::DumpPlan m_plan;
+   size_t m_max_reads;
+   asha::WorkerPool* m_pool;
    std::map<std::string, std::map<std::string, std::shared_ptr<asha::Characteristic>>> m_devices;
+   std::map<std::string, std::shared_ptr<DumpJob>> m_jobs;
+
+   // Devices we were handed, by path. generation tells a device that was
+   // removed and added again apart from the one a late read was issued for.
+   struct AddedDevice
+   {
+      asha::Bluetooth::BluezDevice device;
+      uint64_t generation = 0;
+   };
+   std::map<std::string, AddedDevice> m_added;
+   uint64_t m_generation = 0;
+   std::shared_ptr<asha::ValueCache> m_cache;
+   std::shared_ptr<asha::Quarantine> m_quarantine;
+   asha::ReadPolicy m_read_policy;
+   // By device path.
+   std::map<std::string, std::shared_ptr<DeviceReads>> m_reads;
 
    asha::Bluetooth m_b; // needs to be last
 };
 
 
-int main()
+void PrintStats(const asha::WorkerPool& pool)
+{
+   auto stats = pool.GetStats();
+   for (size_t i = 0; i < stats.size(); ++i)
+   {
+      auto& s = stats[i];
+      std::cerr << "worker " << i << ": " << s.run << " run, " << s.depth << "/" << s.capacity << " queued, "
+                << s.dropped << " dropped\n";
+   }
+}
+
+
+void Usage(const char* argv0)
+{
+   std::cerr << "Usage: " << argv0 << " [options]\n"
+                "   -b, --bus ADDR   Where to find bluez: system (default), session, or a\n"
+                "                    dbus address such as unix:path=/tmp/bus\n"
+                "   -w, --window N   Maximum number of reads in flight per device (default "
+             << DEFAULT_MAX_READS << ")\n"
+                "   -j, --workers N  Run dbus on its own thread, and print from N worker\n"
+                "                    threads (default 0: do everything on the main thread)\n"
+                "   -A, --per-adapter\n"
+                "                    Dump each adapter from its own thread and dbus\n"
+                "                    connection, into the same output\n"
+                "   -q, --queue N    Output each worker can fall behind by before it gets\n"
+                "                    dropped (default " << DEFAULT_QUEUE_SIZE << ")\n"
+                "   -r, --log-ring N Keep the last N device and signal log messages in memory\n"
+                "                    instead of printing them; kill -USR1 prints them\n"
+                "   -L, --latency    Time notifications from the signal arriving to the\n"
+                "                    callback finishing, per characteristic; kill -USR1 or\n"
+                "                    exiting prints the percentiles to stderr\n"
+                "   -m, --metrics ADDR\n"
+                "                    Serve dbus call counts and latencies and notification\n"
+                "                    counts for Prometheus, on unix:PATH, PORT (loopback)\n"
+                "                    or HOST:PORT\n"
+                "   -c, --cache DIR  Where to keep values that don't change between\n"
+                "                    connections (default " << asha::ValueCache::DefaultDirectory() << ")\n"
+                "   -C, --no-cache   Read everything from the device every time\n"
+                "   -Q, --quarantine FILE\n"
+                "                    Where to remember characteristics whose reads time\n"
+                "                    out or disconnect the device, so that they don't get\n"
+                "                    read again (default " << asha::Quarantine::DefaultFile() << ");\n"
+                "                    empty remembers them for this run only\n"
+                "   -R, --read-policy P\n"
+                "                    Where values come from: radio (default) reads every\n"
+                "                    one from the device, cached-then-radio only reads the\n"
+                "                    ones bluez hasn't got cached, and cached never reads\n"
+                "   -f, --format F   Output format: text (default), json for JSON Lines, or\n"
+                "                    cbor for a CBOR sequence\n"
+                "   -F, --flush WHEN Write output after every event, or only once a buffer's\n"
+                "                    worth has built up (default: event when stdout is a\n"
+                "                    terminal, buffer otherwise)\n"
+                "   -d, --device MAC Only dump this device; repeat for more\n"
+                "   -s, --service UUID\n"
+                "                    Only dump this service; repeat for more. A UUID can\n"
+                "                    be four hex digits for an assigned number\n"
+                "   -u, --characteristic UUID\n"
+                "                    Only dump this characteristic; repeat for more\n"
+                "   -o, --operations LIST\n"
+                "                    What to do with the characteristics dumped: read,\n"
+                "                    notify, descriptors, separated by commas (default all)\n"
+                "   -p, --plan FILE  Select from a key file with a [Select] group holding\n"
+                "                    Devices, Services, Characteristics, Operations and\n"
+                "                    SkipRead lists\n"
+                "   -h, --help       Show this message\n";
+}
+
+
+int main(int argc, char** argv)
 {
+   size_t max_reads = DEFAULT_MAX_READS;
+   std::string bus_address = asha::Bus::SYSTEM;
+   size_t log_ring = 0;
+   size_t workers = 0;
+   size_t queue_size = DEFAULT_QUEUE_SIZE;
+   std::string cache_dir = asha::ValueCache::DefaultDirectory();
+   std::string quarantine_file = asha::Quarantine::DefaultFile();
+   std::string format = "text";
+   std::string metrics_address;
+   bool per_adapter = false;
+   auto read_policy = asha::ReadPolicy::RADIO;
+   asha::DumpPlan plan;
+   for (auto& uuid: bad_read_uuids)
+      plan.SkipRead(uuid);
+   auto flush = isatty(STDOUT_FILENO) ? asha::OutputSink::FlushPolicy::EVENT : asha::OutputSink::FlushPolicy::BUFFER;
+
+   const option long_options[] = {
+      {"bus",    required_argument, nullptr, 'b'},
+      {"window", required_argument, nullptr, 'w'},
+      {"workers", required_argument, nullptr, 'j'},
+      {"per-adapter", no_argument, nullptr, 'A'},
+      {"queue", required_argument, nullptr, 'q'},
+      {"log-ring", required_argument, nullptr, 'r'},
+      {"latency", no_argument, nullptr, 'L'},
+      {"metrics", required_argument, nullptr, 'm'},
+      {"cache", required_argument, nullptr, 'c'},
+      {"no-cache", no_argument, nullptr, 'C'},
+      {"quarantine", required_argument, nullptr, 'Q'},
+      {"read-policy", required_argument, nullptr, 'R'},
+      {"format", required_argument, nullptr, 'f'},
+      {"flush", required_argument, nullptr, 'F'},
+      {"device", required_argument, nullptr, 'd'},
+      {"service", required_argument, nullptr, 's'},
+      {"characteristic", required_argument, nullptr, 'u'},
+      {"operations", required_argument, nullptr, 'o'},
+      {"plan", required_argument, nullptr, 'p'},
+      {"help",   no_argument,       nullptr, 'h'},
+      {nullptr,  0,                 nullptr, 0},
+   };
+   int opt;
+   while ((opt = getopt_long(argc, argv, "b:w:j:Aq:r:Lm:c:CQ:R:f:F:d:s:u:o:p:h", long_options, nullptr)) != -1)
+   {
+      switch (opt)
+      {
+      case 'b':
+         bus_address = optarg;
+         break;
+      case 'w':
+         max_reads = strtoul(optarg, nullptr, 10);
+         if (max_reads == 0)
+         {
+            std::cerr << "Invalid window size: " << optarg << '\n';
+            return 1;
+         }
+         break;
+      case 'j':
+         workers = strtoul(optarg, nullptr, 10);
+         break;
+      case 'A':
+         per_adapter = true;
+         break;
+      case 'q':
+         queue_size = std::max<size_t>(1, strtoul(optarg, nullptr, 10));
+         break;
+      case 'r':
+         log_ring = strtoul(optarg, nullptr, 10);
+         break;
+      case 'L':
+         asha::latency::Enable(true);
+         break;
+      case 'm':
+         metrics_address = optarg;
+         asha::metrics::Enable(true);
+         break;
+      case 'c':
+         cache_dir = optarg;
+         break;
+      case 'C':
+         cache_dir.clear();
+         break;
+      case 'Q':
+         quarantine_file = optarg;
+         break;
+      case 'R':
+         if (!asha::ParseReadPolicy(optarg, read_policy))
+         {
+            std::cerr << "Invalid read policy: " << optarg << '\n';
+            return 1;
+         }
+         break;
+      case 'f':
+         format = optarg;
+         break;
+      case 'F':
+         if (!strcmp(optarg, "event"))
+            flush = asha::OutputSink::FlushPolicy::EVENT;
+         else if (!strcmp(optarg, "buffer"))
+            flush = asha::OutputSink::FlushPolicy::BUFFER;
+         else
+         {
+            std::cerr << "Invalid flush policy: " << optarg << '\n';
+            return 1;
+         }
+         break;
+      case 'd':
+         plan.AddDevice(optarg);
+         break;
+      case 's':
+      case 'u':
+      {
+         auto uuid = asha::DumpPlan::ParseUuid(optarg);
+         if (uuid.IsNull())
+         {
+            std::cerr << "Invalid UUID: " << optarg << '\n';
+            return 1;
+         }
+         if (opt == 's')
+            plan.AddService(uuid);
+         else
+            plan.AddCharacteristic(uuid);
+         break;
+      }
+      case 'o':
+      {
+         uint32_t operations = 0;
+         if (!asha::DumpPlan::ParseOperations(optarg, operations))
+         {
+            std::cerr << "Invalid operations: " << optarg << '\n';
+            return 1;
+         }
+         plan.SetOperations(operations);
+         break;
+      }
+      case 'p':
+         if (!plan.Load(optarg))
+            return 1;
+         break;
+      case 'h':
+         Usage(argv[0]);
+         return 0;
+      default:
+         Usage(argv[0]);
+         return 1;
+      }
+   }
+
+   auto output_format = asha::OutputFormat::Create(format);
+   if (!output_format)
+   {
+      std::cerr << "Invalid output format: " << format << '\n';
+      return 1;
+   }
+
    setenv("G_MESSAGES_DEBUG", "all", false);
-   GattDump c;
+   asha::log::UseRingBuffer(log_ring);
+   // glib prints info and debug messages to stdout, which would corrupt
+   // anything other than text.
+   if (format != "text")
+      g_log_writer_default_set_use_stderr(true);
+
+   // Served from the main loop, whichever thread dbus is on.
+   std::unique_ptr<asha::MetricsServer> metrics;
+   if (!metrics_address.empty())
+   {
+      try
+      {
+         metrics.reset(new asha::MetricsServer(metrics_address));
+      }
+      catch (const std::exception& e)
+      {
+         std::cerr << e.what() << ": " << metrics_address << '\n';
+         return 1;
+      }
+   }
+
+   // Outlives everything that writes to it.
+   asha::OutputSink sink(STDOUT_FILENO, std::move(output_format), flush, OUTPUT_BUFFER_SIZE);
+
+   auto quarantine = std::make_shared<asha::Quarantine>(quarantine_file);
 
+   // Everything that talks to dbus gets created, used and destroyed on the
+   // io thread, if there is one.
+   std::unique_ptr<asha::WorkerPool> pool;
+   std::unique_ptr<asha::IoThread> io;
+   std::unique_ptr<GattDump> c;
+   // Per adapter, a dump with its own thread and connection that only sees
+   // that adapter's devices. They share the output, the pool and the
+   // quarantine; the main thread only looks out for adapters.
+   struct Shard
+   {
+      std::unique_ptr<asha::IoThread> io;
+      std::unique_ptr<GattDump> dump;
+   };
+   std::deque<Shard> shards;
+   std::unique_ptr<asha::AdapterWatch> adapters;
+   if (workers)
+      pool.reset(new asha::WorkerPool(workers, queue_size));
+   if (per_adapter)
+   {
+      // The shards watch the properties of their own adapter's objects, and
+      // this connection would only be parsing the same signals again.
+      auto adapter_bus = asha::Bus::Connect(bus_address, asha::Bus::BLUEZ, std::string(), asha::Bus::Signals::NONE);
+      adapters.reset(new asha::AdapterWatch(adapter_bus, [&](const std::string& adapter) {
+         shards.emplace_back();
+         auto& shard = shards.back();
+         shard.io.reset(new asha::IoThread);
+         try
+         {
+            shard.io->Invoke([&]() {
+               shard.dump.reset(new GattDump(sink, max_reads, asha::Bus::Connect(bus_address, asha::Bus::BLUEZ, adapter),
+                                             pool.get(), cache_dir, plan, quarantine, read_policy));
+            });
+         }
+         catch (const std::exception& e)
+         {
+            g_warning("Unable to dump %s: %s", adapter.c_str(), e.what());
+            shards.pop_back();
+         }
+      }));
+   }
+   else if (workers)
+   {
+      io.reset(new asha::IoThread);
+      io->Invoke([&]() {
+         c.reset(new GattDump(sink, max_reads, asha::Bus::Connect(bus_address), pool.get(), cache_dir, plan, quarantine, read_policy));
+      });
+   }
+   else
+   {
+      c.reset(new GattDump(sink, max_reads, asha::Bus::Connect(bus_address), nullptr, cache_dir, plan, quarantine, read_policy));
+   }
 
    std::shared_ptr<GMainLoop> loop(g_main_loop_new(nullptr, true), g_main_loop_unref);
    auto quitter = g_unix_signal_add(SIGINT, [](void* ml) {
       g_main_loop_quit((GMainLoop*)ml);
       return (int)G_SOURCE_CONTINUE;
    }, loop.get());
+   auto flusher = g_unix_signal_add(SIGUSR1, [](void* p) {
+      asha::log::FlushRingBuffer();
+      if (p)
+         PrintStats(*(asha::WorkerPool*)p);
+      if (asha::latency::Enabled())
+         asha::latency::Dump();
+      return (int)G_SOURCE_CONTINUE;
+   }, pool.get());
+   auto output_flusher = g_timeout_add_seconds(OUTPUT_FLUSH_SECONDS, [](void* s) {
+      ((asha::OutputSink*)s)->Flush();
+      return (int)G_SOURCE_CONTINUE;
+   }, &sink);
 
    g_main_loop_run(loop.get());
+   g_source_remove(output_flusher);
+   g_source_remove(flusher);
    g_source_remove(quitter);
 
-   std::cout << "Stopping...\n";
+   // stdout may not be text.
+   std::cerr << "Stopping...\n";
+   adapters.reset();
+   for (auto& shard: shards)
+   {
+      shard.io->Invoke([&]() { shard.dump.reset(); });
+      shard.io.reset();
+   }
+   shards.clear();
+   if (io)
+      io->Invoke([&]() { c.reset(); });
+   c.reset();
+   io.reset();
+   if (pool)
+   {
+      PrintStats(*pool);
+      pool.reset();
+   }
+   if (asha::latency::Enabled())
+      asha::latency::Dump();
 
    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,887 @@
+// A fake bluez, for measuring gatt_dump without any radios. It owns org.bluez
+// on whatever bus it is pointed at, and exports an ObjectManager with a
+// number of connected devices, each with one service full of
+// characteristics. Reads can be delayed, and subscribed characteristics get
+// notified at a fixed rate, either through PropertiesChanged or through an
+// AcquireNotify socket.
+//
+// Run it on a private bus rather than the system bus:
+//    dbus-daemon --session --print-address --fork
+//    mock_bluez --bus <address> --devices 10 --characteristics 50
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include <getopt.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+   constexpr char BLUEZ[] = "org.bluez";
+   constexpr char OBJECT_MANAGER_INTERFACE[] = "org.freedesktop.DBus.ObjectManager";
+   constexpr char PROPERTIES_INTERFACE[] = "org.freedesktop.DBus.Properties";
+   constexpr char DEVICE_INTERFACE[] = "org.bluez.Device1";
+   constexpr char SERVICE_INTERFACE[] = "org.bluez.GattService1";
+   constexpr char CHARACTERISTIC_INTERFACE[] = "org.bluez.GattCharacteristic1";
+   constexpr char DESCRIPTOR_INTERFACE[] = "org.bluez.GattDescriptor1";
+   constexpr char ADAPTER_INTERFACE[] = "org.bluez.Adapter1";
+   constexpr char ADAPTER_PATH[] = "/org/bluez/hci";
+   // What every descriptor reads back.
+   constexpr char DESCRIPTION[] = "Mock characteristic";
+
+   // What bluez would negotiate with a reasonably modern device.
+   constexpr uint16_t MTU = 247;
+
+   constexpr char INTROSPECTION_XML[] =
+      "<node>"
+      "  <interface name='org.freedesktop.DBus.ObjectManager'>"
+      "    <method name='GetManagedObjects'>"
+      "      <arg name='objects' type='a{oa{sa{sv}}}' direction='out'/>"
+      "    </method>"
+      "    <signal name='InterfacesAdded'>"
+      "      <arg name='object' type='o'/>"
+      "      <arg name='interfaces' type='a{sa{sv}}'/>"
+      "    </signal>"
+      "    <signal name='InterfacesRemoved'>"
+      "      <arg name='object' type='o'/>"
+      "      <arg name='interfaces' type='as'/>"
+      "    </signal>"
+      "  </interface>"
+      "  <interface name='org.bluez.Adapter1'>"
+      "    <property name='Address' type='s' access='read'/>"
+      "  </interface>"
+      "  <interface name='org.bluez.Device1'>"
+      "    <property name='Address' type='s' access='read'/>"
+      "    <property name='Name' type='s' access='read'/>"
+      "    <property name='Alias' type='s' access='read'/>"
+      "    <property name='Adapter' type='o' access='read'/>"
+      "    <property name='Connected' type='b' access='read'/>"
+      "    <property name='ServicesResolved' type='b' access='read'/>"
+      "  </interface>"
+      "  <interface name='org.bluez.GattService1'>"
+      "    <property name='UUID' type='s' access='read'/>"
+      "    <property name='Device' type='o' access='read'/>"
+      "    <property name='Primary' type='b' access='read'/>"
+      "  </interface>"
+      "  <interface name='org.bluez.GattCharacteristic1'>"
+      "    <method name='ReadValue'>"
+      "      <arg name='options' type='a{sv}' direction='in'/>"
+      "      <arg name='value' type='ay' direction='out'/>"
+      "    </method>"
+      "    <method name='WriteValue'>"
+      "      <arg name='value' type='ay' direction='in'/>"
+      "      <arg name='options' type='a{sv}' direction='in'/>"
+      "    </method>"
+      "    <method name='AcquireWrite'>"
+      "      <arg name='options' type='a{sv}' direction='in'/>"
+      "      <arg name='fd' type='h' direction='out'/>"
+      "      <arg name='mtu' type='q' direction='out'/>"
+      "    </method>"
+      "    <method name='AcquireNotify'>"
+      "      <arg name='options' type='a{sv}' direction='in'/>"
+      "      <arg name='fd' type='h' direction='out'/>"
+      "      <arg name='mtu' type='q' direction='out'/>"
+      "    </method>"
+      "    <method name='StartNotify'/>"
+      "    <method name='StopNotify'/>"
+      "    <property name='UUID' type='s' access='read'/>"
+      "    <property name='Service' type='o' access='read'/>"
+      "    <property name='Flags' type='as' access='read'/>"
+      "    <property name='NotifyAcquired' type='b' access='read'/>"
+      "    <property name='WriteAcquired' type='b' access='read'/>"
+      "    <property name='Value' type='ay' access='read'/>"
+      "  </interface>"
+      "  <interface name='org.bluez.GattDescriptor1'>"
+      "    <method name='ReadValue'>"
+      "      <arg name='options' type='a{sv}' direction='in'/>"
+      "      <arg name='value' type='ay' direction='out'/>"
+      "    </method>"
+      "    <property name='UUID' type='s' access='read'/>"
+      "    <property name='Characteristic' type='o' access='read'/>"
+      "    <property name='Value' type='ay' access='read'/>"
+      "  </interface>"
+      "</node>";
+
+   struct Options
+   {
+      std::string bus = "session";
+      unsigned adapters = 1;
+      unsigned devices = 4;
+      unsigned characteristics = 20;
+      unsigned read_latency_ms = 0;
+      // Reads of this characteristic, counting from 0 on every device, never
+      // get answered, like a device that has gone off to sulk.
+      int stall = -1;
+      // Same for StartNotify and AcquireNotify, like a device that never
+      // acknowledges the write to its CCC descriptor.
+      int stall_notify = -1;
+      // Publish a Value for everything up front, the way bluez does for
+      // whatever it has read or been notified of before.
+      bool cached_values = false;
+      // Turn AcquireNotify down, so that clients fall back to StartNotify
+      // and every notification comes as a PropertiesChanged signal.
+      bool no_acquire = false;
+      // Give every device a Generic Attribute service with Service Changed,
+      // which only gets indicated on kill -USR1. With service_changed_notify
+      // it claims to notify as well.
+      bool service_changed = false;
+      bool service_changed_notify = false;
+      double notify_rate = 10.0;
+   };
+
+
+   // Helpers for building property dictionaries.
+   class Properties
+   {
+   public:
+      Properties() { g_variant_builder_init(&m_b, G_VARIANT_TYPE("a{sv}")); }
+      Properties& Add(const char* key, GVariant* value)
+      {
+         g_variant_builder_add(&m_b, "{sv}", key, value);
+         return *this;
+      }
+      std::shared_ptr<GVariant> End()
+      {
+         return std::shared_ptr<GVariant>(g_variant_ref_sink(g_variant_builder_end(&m_b)), g_variant_unref);
+      }
+
+   private:
+      GVariantBuilder m_b;
+   };
+
+
+   GVariant* NewBytes(const void* data, size_t size)
+   {
+      return g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, data, size, sizeof(guint8));
+   }
+
+
+   class MockBluez
+   {
+   public:
+      explicit MockBluez(const Options& options);
+      ~MockBluez();
+
+      void PrintStats() const;
+      // Indicate Service Changed to everyone subscribed to it.
+      void ChangeServices();
+
+   private:
+      struct Object
+      {
+         MockBluez* mock;
+         std::string path;
+         const char* interface;
+         std::shared_ptr<GVariant> properties;
+
+         // Only used by characteristics.
+         bool notifying = false;
+         int notify_fd = -1;
+         unsigned notify_source = 0;
+         int write_fd = -1;
+         unsigned write_source = 0;
+         int64_t notify_start = 0;
+         uint64_t notify_sent = 0;
+         uint32_t sequence = 0;
+         // Service Changed, which isn't sent on every tick.
+         bool service_changed = false;
+      };
+
+      void Add(const std::string& path, const char* interface, const std::shared_ptr<GVariant>& properties);
+      void Register(Object& o);
+
+      GVariant* ManagedObjects() const;
+      void OnMethod(Object& o, const char* method, GVariant* parameters, GDBusMethodInvocation* invocation);
+      void Read(Object& o, GDBusMethodInvocation* invocation);
+      // Whether o is the characteristic that index picks out.
+      bool Stalls(const Object& o, int index) const;
+      void Acquire(Object& o, bool notify, GDBusMethodInvocation* invocation);
+      void CloseNotify(Object& o);
+      void CloseWrite(Object& o);
+
+      bool Tick();
+      void Notify(Object& o);
+
+      Options m_options;
+      std::shared_ptr<GDBusConnection> m_connection;
+      std::shared_ptr<GDBusNodeInfo> m_introspection;
+      unsigned m_name_id = 0;
+      unsigned m_tick_source = 0;
+      std::vector<unsigned> m_registrations;
+
+      // Reserved up front, so that pointers into it stay put.
+      std::vector<Object> m_objects;
+
+      uint64_t m_reads = 0;
+      uint64_t m_writes = 0;
+      uint64_t m_write_packets = 0;
+      uint64_t m_notifications = 0;
+      uint64_t m_dropped = 0;
+   };
+
+
+   MockBluez::MockBluez(const Options& options):
+      m_options(options)
+   {
+      GError* err = nullptr;
+      GDBusConnection* connection = nullptr;
+      if (options.bus == "session")
+         connection = g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &err);
+      else if (options.bus == "system")
+         connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, nullptr, &err);
+      else
+         connection = g_dbus_connection_new_for_address_sync(options.bus.c_str(),
+            (GDBusConnectionFlags)(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+            nullptr,
+            nullptr,
+            &err
+         );
+      if (err)
+      {
+         std::string message = err->message;
+         g_error_free(err);
+         throw std::runtime_error("Unable to connect to dbus: " + message);
+      }
+      m_connection.reset(connection, g_object_unref);
+
+      m_introspection.reset(g_dbus_node_info_new_for_xml(INTROSPECTION_XML, &err), g_dbus_node_info_unref);
+      if (err)
+      {
+         std::string message = err->message;
+         g_error_free(err);
+         throw std::runtime_error("Bad introspection data: " + message);
+      }
+
+      // A adapters with N devices dealt out between them, each with one
+      // service of M characteristics, each of which has a user description
+      // descriptor. Handles are numbered the way bluez does it.
+      unsigned adapters = std::max(1u, options.adapters);
+      // What a characteristic read just now would have given back.
+      int64_t started = g_get_monotonic_time();
+      m_objects.reserve(1 + adapters + options.devices * (2 + 2 * options.characteristics));
+      for (unsigned a = 0; a < adapters; ++a)
+      {
+         char address[18];
+         snprintf(address, sizeof(address), "00:00:00:00:FF:%02X", a & 0xff);
+         Add(ADAPTER_PATH + std::to_string(a), ADAPTER_INTERFACE, Properties()
+            .Add("Address", g_variant_new_string(address))
+            .End()
+         );
+      }
+      for (unsigned d = 0; d < options.devices; ++d)
+      {
+         char address[18];
+         snprintf(address, sizeof(address), "00:00:00:00:%02X:%02X", (d >> 8) & 0xff, d & 0xff);
+         std::string adapter_path = ADAPTER_PATH + std::to_string(d % adapters);
+         std::string device_path = adapter_path + "/dev_" + address;
+         for (auto& c: device_path)
+            if (c == ':') c = '_';
+         std::string name = "Mock Device " + std::to_string(d);
+
+         Add(device_path, DEVICE_INTERFACE, Properties()
+            .Add("Address", g_variant_new_string(address))
+            .Add("Name", g_variant_new_string(name.c_str()))
+            .Add("Alias", g_variant_new_string(name.c_str()))
+            .Add("Adapter", g_variant_new_object_path(adapter_path.c_str()))
+            .Add("Connected", g_variant_new_boolean(true))
+            .Add("ServicesResolved", g_variant_new_boolean(true))
+            .End()
+         );
+
+         unsigned handle = 1;
+         char buf[64];
+         snprintf(buf, sizeof(buf), "/service%04x", handle++);
+         std::string service_path = device_path + buf;
+         Add(service_path, SERVICE_INTERFACE, Properties()
+            .Add("UUID", g_variant_new_string("0000fdf0-0000-1000-8000-00805f9b34fb"))
+            .Add("Device", g_variant_new_object_path(device_path.c_str()))
+            .Add("Primary", g_variant_new_boolean(true))
+            .End()
+         );
+
+         for (unsigned c = 0; c < options.characteristics; ++c)
+         {
+            snprintf(buf, sizeof(buf), "/char%04x", handle);
+            handle += 2;
+            std::string char_path = service_path + buf;
+            char uuid[37];
+            snprintf(uuid, sizeof(uuid), "%08x-0000-1000-8000-00805f9b34fb", 0x8000 + c);
+            const char* flags[] = {"read", "write-without-response", "notify", nullptr};
+            Properties characteristic;
+            characteristic
+               .Add("UUID", g_variant_new_string(uuid))
+               .Add("Service", g_variant_new_object_path(service_path.c_str()))
+               .Add("Flags", g_variant_new_strv(flags, -1))
+               .Add("NotifyAcquired", g_variant_new_boolean(false))
+               .Add("WriteAcquired", g_variant_new_boolean(false));
+            if (options.cached_values)
+               characteristic.Add("Value", NewBytes(&started, sizeof(started)));
+            Add(char_path, CHARACTERISTIC_INTERFACE, characteristic.End());
+
+            snprintf(buf, sizeof(buf), "/desc%04x", handle++);
+            Properties descriptor;
+            descriptor
+               .Add("UUID", g_variant_new_string("00002901-0000-1000-8000-00805f9b34fb"))
+               .Add("Characteristic", g_variant_new_object_path(char_path.c_str()));
+            if (options.cached_values)
+               descriptor.Add("Value", NewBytes(DESCRIPTION, sizeof(DESCRIPTION) - 1));
+            Add(char_path + buf, DESCRIPTOR_INTERFACE, descriptor.End());
+         }
+
+         if (options.service_changed)
+         {
+            snprintf(buf, sizeof(buf), "/service%04x", handle++);
+            std::string gatt_path = device_path + buf;
+            Add(gatt_path, SERVICE_INTERFACE, Properties()
+               .Add("UUID", g_variant_new_string("00001801-0000-1000-8000-00805f9b34fb"))
+               .Add("Device", g_variant_new_object_path(device_path.c_str()))
+               .Add("Primary", g_variant_new_boolean(true))
+               .End()
+            );
+            snprintf(buf, sizeof(buf), "/char%04x", handle);
+            handle += 2;
+            const char* indicate[] = {"indicate", nullptr};
+            const char* notify[] = {"indicate", "notify", nullptr};
+            Add(gatt_path + buf, CHARACTERISTIC_INTERFACE, Properties()
+               .Add("UUID", g_variant_new_string("00002a05-0000-1000-8000-00805f9b34fb"))
+               .Add("Service", g_variant_new_object_path(gatt_path.c_str()))
+               .Add("Flags", g_variant_new_strv(options.service_changed_notify ? notify : indicate, -1))
+               .End()
+            );
+            m_objects.back().service_changed = true;
+         }
+      }
+
+      // The root object only carries the ObjectManager.
+      Object root{this, "/", OBJECT_MANAGER_INTERFACE, nullptr};
+      m_objects.push_back(root);
+
+      for (auto& o: m_objects)
+         Register(o);
+
+      struct Callback {
+         static void Acquired(GDBusConnection* c, const gchar* name, gpointer user_data)
+         {
+            // Scripts wait for this before starting the benchmark.
+            std::cout << "ready" << std::endl;
+         }
+         static void Lost(GDBusConnection* c, const gchar* name, gpointer user_data)
+         {
+            std::cerr << "Unable to own " << name << ". Is something else already on this bus?\n";
+            exit(1);
+         }
+         static gboolean Tick(gpointer user_data)
+         {
+            return ((MockBluez*)user_data)->Tick();
+         }
+      };
+      m_name_id = g_bus_own_name_on_connection(m_connection.get(), BLUEZ, G_BUS_NAME_OWNER_FLAGS_NONE, &Callback::Acquired, &Callback::Lost, this, nullptr);
+
+      if (options.notify_rate > 0)
+      {
+         unsigned interval = options.notify_rate >= 1000 ? 1 : (unsigned)(1000 / options.notify_rate);
+         m_tick_source = g_timeout_add(interval, &Callback::Tick, this);
+      }
+   }
+
+
+   MockBluez::~MockBluez()
+   {
+      if (m_tick_source)
+         g_source_remove(m_tick_source);
+      for (auto& o: m_objects)
+      {
+         CloseNotify(o);
+         CloseWrite(o);
+      }
+      for (auto id: m_registrations)
+         g_dbus_connection_unregister_object(m_connection.get(), id);
+      if (m_name_id)
+         g_bus_unown_name(m_name_id);
+   }
+
+
+   void MockBluez::PrintStats() const
+   {
+      std::cout << "reads:               " << m_reads << '\n'
+                << "writes:              " << m_writes << '\n'
+                << "write packets:       " << m_write_packets << '\n'
+                << "notifications:       " << m_notifications << '\n'
+                << "dropped:             " << m_dropped << '\n';
+   }
+
+
+   void MockBluez::Add(const std::string& path, const char* interface, const std::shared_ptr<GVariant>& properties)
+   {
+      Object o{this, path, interface, properties};
+      m_objects.push_back(o);
+   }
+
+
+   void MockBluez::Register(Object& o)
+   {
+      struct Callback {
+         static void Method(GDBusConnection* c, const gchar* sender, const gchar* path, const gchar* interface, const gchar* method, GVariant* parameters, GDBusMethodInvocation* invocation, gpointer user_data)
+         {
+            auto* o = (Object*)user_data;
+            o->mock->OnMethod(*o, method, parameters, invocation);
+         }
+         static GVariant* Property(GDBusConnection* c, const gchar* sender, const gchar* path, const gchar* interface, const gchar* name, GError** err, gpointer user_data)
+         {
+            auto* o = (Object*)user_data;
+            GVariant* value = o->properties ? g_variant_lookup_value(o->properties.get(), name, nullptr) : nullptr;
+            if (!value)
+               *err = g_error_new(G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "No such property %s", name);
+            return value;
+         }
+      };
+      static const GDBusInterfaceVTable vtable = {&Callback::Method, &Callback::Property, nullptr, {}};
+
+      GError* err = nullptr;
+      unsigned id = g_dbus_connection_register_object(m_connection.get(),
+         o.path.c_str(),
+         g_dbus_node_info_lookup_interface(m_introspection.get(), o.interface),
+         &vtable,
+         &o,
+         nullptr,
+         &err
+      );
+      if (err)
+      {
+         std::string message = err->message;
+         g_error_free(err);
+         throw std::runtime_error("Unable to register " + o.path + ": " + message);
+      }
+      m_registrations.push_back(id);
+   }
+
+
+   GVariant* MockBluez::ManagedObjects() const
+   {
+      GVariantBuilder objects;
+      g_variant_builder_init(&objects, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+      for (auto& o: m_objects)
+      {
+         if (!o.properties)
+            continue;
+         GVariantBuilder interfaces;
+         g_variant_builder_init(&interfaces, G_VARIANT_TYPE("a{sa{sv}}"));
+         g_variant_builder_add(&interfaces, "{s@a{sv}}", o.interface, o.properties.get());
+         g_variant_builder_add(&objects, "{o@a{sa{sv}}}", o.path.c_str(), g_variant_builder_end(&interfaces));
+      }
+      return g_variant_new("(@a{oa{sa{sv}}})", g_variant_builder_end(&objects));
+   }
+
+
+   void MockBluez::OnMethod(Object& o, const char* method, GVariant* parameters, GDBusMethodInvocation* invocation)
+   {
+      if (g_str_equal(method, "GetManagedObjects"))
+      {
+         g_dbus_method_invocation_return_value(invocation, ManagedObjects());
+      }
+      else if (g_str_equal(method, "ReadValue"))
+      {
+         Read(o, invocation);
+      }
+      else if (g_str_equal(method, "WriteValue"))
+      {
+         ++m_writes;
+         g_dbus_method_invocation_return_value(invocation, nullptr);
+      }
+      else if ((g_str_equal(method, "StartNotify") || g_str_equal(method, "AcquireNotify")) && Stalls(o, m_options.stall_notify))
+      {
+         // Never answered, like a stalled read.
+      }
+      else if (g_str_equal(method, "StartNotify"))
+      {
+         if (!o.notifying)
+         {
+            o.notifying = true;
+            o.notify_start = g_get_monotonic_time();
+            o.notify_sent = 0;
+         }
+         g_dbus_method_invocation_return_value(invocation, nullptr);
+      }
+      else if (g_str_equal(method, "StopNotify"))
+      {
+         o.notifying = false;
+         g_dbus_method_invocation_return_value(invocation, nullptr);
+      }
+      else if (g_str_equal(method, "AcquireNotify") && m_options.no_acquire)
+      {
+         g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.NotSupported", "AcquireNotify is turned off");
+      }
+      else if (g_str_equal(method, "AcquireNotify"))
+      {
+         Acquire(o, true, invocation);
+      }
+      else if (g_str_equal(method, "AcquireWrite"))
+      {
+         Acquire(o, false, invocation);
+      }
+      else
+      {
+         g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.NotSupported", "Not supported by the mock");
+      }
+   }
+
+
+   void MockBluez::Read(Object& o, GDBusMethodInvocation* invocation)
+   {
+      ++m_reads;
+
+      if (Stalls(o, m_options.stall))
+      {
+         // The caller gives up eventually, and the invocation leaks,
+         // which doesn't matter in a mock.
+         return;
+      }
+
+      // Descriptors read back a user description. Characteristics read back
+      // the time, so that the client can tell how stale the value is.
+      GVariant* value;
+      if (g_str_equal(o.interface, DESCRIPTOR_INTERFACE))
+      {
+         value = NewBytes(DESCRIPTION, sizeof(DESCRIPTION) - 1);
+      }
+      else
+      {
+         int64_t now = g_get_monotonic_time();
+         value = NewBytes(&now, sizeof(now));
+      }
+      GVariant* reply = g_variant_ref_sink(g_variant_new("(@ay)", value));
+
+      if (m_options.read_latency_ms == 0)
+      {
+         g_dbus_method_invocation_return_value(invocation, reply);
+         g_variant_unref(reply);
+         return;
+      }
+
+      struct Pending
+      {
+         GDBusMethodInvocation* invocation;
+         GVariant* reply;
+
+         static gboolean Reply(gpointer user_data)
+         {
+            std::unique_ptr<Pending> self((Pending*)user_data);
+            g_dbus_method_invocation_return_value(self->invocation, self->reply);
+            g_variant_unref(self->reply);
+            return G_SOURCE_REMOVE;
+         }
+      };
+      g_timeout_add(m_options.read_latency_ms, &Pending::Reply, new Pending{invocation, reply});
+   }
+
+
+   bool MockBluez::Stalls(const Object& o, int index) const
+   {
+      if (index < 0 || !g_str_equal(o.interface, CHARACTERISTIC_INTERFACE))
+         return false;
+      const gchar* uuid = nullptr;
+      char stalled[37];
+      snprintf(stalled, sizeof(stalled), "%08x-0000-1000-8000-00805f9b34fb", 0x8000 + index);
+      return g_variant_lookup(o.properties.get(), "UUID", "&s", &uuid) && g_str_equal(uuid, stalled);
+   }
+
+
+   void MockBluez::Acquire(Object& o, bool notify, GDBusMethodInvocation* invocation)
+   {
+      int& fd = notify ? o.notify_fd : o.write_fd;
+      if (fd >= 0)
+      {
+         g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.NotPermitted", notify ? "Notify acquired" : "Write acquired");
+         return;
+      }
+
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+      {
+         g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Failed", strerror(errno));
+         return;
+      }
+
+      std::shared_ptr<GUnixFDList> fd_list(g_unix_fd_list_new(), g_object_unref);
+      GError* err = nullptr;
+      int index = g_unix_fd_list_append(fd_list.get(), fds[1], &err);
+      close(fds[1]);
+      if (err)
+      {
+         g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Failed", err->message);
+         g_error_free(err);
+         close(fds[0]);
+         return;
+      }
+      fd = fds[0];
+
+      struct Callback {
+         static gboolean NotifyClosed(gint fd, GIOCondition condition, gpointer user_data)
+         {
+            auto* o = (Object*)user_data;
+            // The client closing its end is how AcquireNotify gets stopped.
+            o->notify_source = 0;
+            o->mock->CloseNotify(*o);
+            return G_SOURCE_REMOVE;
+         }
+         static gboolean Writable(gint fd, GIOCondition condition, gpointer user_data)
+         {
+            auto* o = (Object*)user_data;
+            if (condition & G_IO_IN)
+            {
+               uint8_t buffer[MTU];
+               ssize_t n;
+               while ((n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+                  ++o->mock->m_write_packets;
+               if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                  return G_SOURCE_CONTINUE;
+            }
+            o->write_source = 0;
+            o->mock->CloseWrite(*o);
+            return G_SOURCE_REMOVE;
+         }
+      };
+
+      if (notify)
+      {
+         o.notify_start = g_get_monotonic_time();
+         o.notify_sent = 0;
+         o.notify_source = g_unix_fd_add(fd, (GIOCondition)(G_IO_HUP | G_IO_ERR), &Callback::NotifyClosed, &o);
+      }
+      else
+      {
+         o.write_source = g_unix_fd_add(fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), &Callback::Writable, &o);
+      }
+
+      g_dbus_method_invocation_return_value_with_unix_fd_list(invocation, g_variant_new("(hq)", index, MTU), fd_list.get());
+   }
+
+
+   void MockBluez::CloseNotify(Object& o)
+   {
+      if (o.notify_source)
+         g_source_remove(o.notify_source);
+      o.notify_source = 0;
+      if (o.notify_fd >= 0)
+         close(o.notify_fd);
+      o.notify_fd = -1;
+   }
+
+
+   void MockBluez::CloseWrite(Object& o)
+   {
+      if (o.write_source)
+         g_source_remove(o.write_source);
+      o.write_source = 0;
+      if (o.write_fd >= 0)
+         close(o.write_fd);
+      o.write_fd = -1;
+   }
+
+
+   bool MockBluez::Tick()
+   {
+      int64_t now = g_get_monotonic_time();
+      for (auto& o: m_objects)
+      {
+         if ((!o.notifying && o.notify_fd < 0) || o.service_changed)
+            continue;
+
+         uint64_t due = (uint64_t)((now - o.notify_start) * m_options.notify_rate / 1000000);
+         // If we fell badly behind, don't try to catch up all at once.
+         if (due - o.notify_sent > 1000)
+            o.notify_sent = due - 1000;
+         while (o.notify_sent < due)
+         {
+            Notify(o);
+            ++o.notify_sent;
+         }
+      }
+      return G_SOURCE_CONTINUE;
+   }
+
+
+   void MockBluez::ChangeServices()
+   {
+      for (auto& o: m_objects)
+      {
+         if (o.service_changed && (o.notifying || o.notify_fd >= 0))
+            Notify(o);
+      }
+   }
+
+
+   void MockBluez::Notify(Object& o)
+   {
+      // The payload carries the time it was sent, so the client can measure
+      // latency, followed by a sequence number.
+      uint8_t payload[12];
+      int64_t now = g_get_monotonic_time();
+      uint32_t sequence = o.sequence++;
+      memcpy(payload, &now, sizeof(now));
+      memcpy(payload + sizeof(now), &sequence, sizeof(sequence));
+
+      if (o.notify_fd >= 0)
+      {
+         if (send(o.notify_fd, payload, sizeof(payload), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+               ++m_dropped;
+            else
+               CloseNotify(o);
+            return;
+         }
+      }
+      else
+      {
+         GVariantBuilder changed;
+         g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+         g_variant_builder_add(&changed, "{sv}", "Value", NewBytes(payload, sizeof(payload)));
+         GError* err = nullptr;
+         g_dbus_connection_emit_signal(m_connection.get(),
+            nullptr,
+            o.path.c_str(),
+            PROPERTIES_INTERFACE,
+            "PropertiesChanged",
+            g_variant_new("(sa{sv}@as)", CHARACTERISTIC_INTERFACE, &changed, g_variant_new_strv(nullptr, 0)),
+            &err
+         );
+         if (err)
+         {
+            g_warning("Error emitting PropertiesChanged for %s: %s", o.path.c_str(), err->message);
+            g_error_free(err);
+            ++m_dropped;
+            return;
+         }
+      }
+      ++m_notifications;
+   }
+
+
+   void Usage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " [options]\n"
+                   "   -b, --bus ADDR              system, session (default), or a dbus address\n"
+                   "   -a, --adapters A            Number of adapters to spread the devices over\n"
+                   "                               (default 1)\n"
+                   "   -d, --devices N             Number of connected devices (default 4)\n"
+                   "   -c, --characteristics M     Characteristics per device (default 20)\n"
+                   "   -l, --read-latency MS       Delay before answering each read (default 0)\n"
+                   "   -s, --stall N               Never answer reads of the Nth characteristic\n"
+                   "                               on each device, counting from 0\n"
+                   "   -S, --stall-notify N        Never answer StartNotify or AcquireNotify of\n"
+                   "                               the Nth characteristic on each device\n"
+                   "   -v, --cached-values         Publish a Value property on every characteristic\n"
+                   "                               and descriptor, like bluez does once it has\n"
+                   "                               read them\n"
+                   "   -n, --notify-rate HZ        Notifications per second per subscribed\n"
+                   "                               characteristic (default 10)\n"
+                   "   -N, --no-acquire            Refuse AcquireNotify, so that notifications\n"
+                   "                               are sent as PropertiesChanged signals\n"
+                   "   -g, --service-changed[=notify]\n"
+                   "                               Give every device Service Changed, which gets\n"
+                   "                               indicated on kill -USR1; =notify gives it the\n"
+                   "                               notify flag too\n"
+                   "   -h, --help                  Show this message\n";
+   }
+}
+
+
+int main(int argc, char** argv)
+{
+   Options options;
+
+   const option long_options[] = {
+      {"bus",             required_argument, nullptr, 'b'},
+      {"adapters",        required_argument, nullptr, 'a'},
+      {"devices",         required_argument, nullptr, 'd'},
+      {"characteristics", required_argument, nullptr, 'c'},
+      {"read-latency",    required_argument, nullptr, 'l'},
+      {"notify-rate",     required_argument, nullptr, 'n'},
+      {"stall",           required_argument, nullptr, 's'},
+      {"stall-notify",    required_argument, nullptr, 'S'},
+      {"cached-values",   no_argument,       nullptr, 'v'},
+      {"no-acquire",      no_argument,       nullptr, 'N'},
+      {"service-changed", optional_argument, nullptr, 'g'},
+      {"help",            no_argument,       nullptr, 'h'},
+      {nullptr,           0,                 nullptr, 0},
+   };
+   int opt;
+   while ((opt = getopt_long(argc, argv, "b:a:d:c:l:n:s:S:vNg::h", long_options, nullptr)) != -1)
+   {
+      switch (opt)
+      {
+      case 'b': options.bus = optarg; break;
+      case 'a': options.adapters = strtoul(optarg, nullptr, 10); break;
+      case 'd': options.devices = strtoul(optarg, nullptr, 10); break;
+      case 'c': options.characteristics = strtoul(optarg, nullptr, 10); break;
+      case 'l': options.read_latency_ms = strtoul(optarg, nullptr, 10); break;
+      case 'n': options.notify_rate = strtod(optarg, nullptr); break;
+      case 's': options.stall = atoi(optarg); break;
+      case 'S': options.stall_notify = atoi(optarg); break;
+      case 'v': options.cached_values = true; break;
+      case 'N': options.no_acquire = true; break;
+      case 'g':
+         options.service_changed = true;
+         if (optarg && strcmp(optarg, "notify") == 0)
+            options.service_changed_notify = true;
+         else if (optarg)
+         {
+            Usage(argv[0]);
+            return 1;
+         }
+         break;
+      case 'h':
+         Usage(argv[0]);
+         return 0;
+      default:
+         Usage(argv[0]);
+         return 1;
+      }
+   }
+
+   std::unique_ptr<MockBluez> mock;
+   try
+   {
+      mock.reset(new MockBluez(options));
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << e.what() << '\n';
+      return 1;
+   }
+
+   std::shared_ptr<GMainLoop> loop(g_main_loop_new(nullptr, true), g_main_loop_unref);
+   auto quit = [](void* ml) {
+      g_main_loop_quit((GMainLoop*)ml);
+      return (int)G_SOURCE_CONTINUE;
+   };
+   auto sigint = g_unix_signal_add(SIGINT, quit, loop.get());
+   auto sigterm = g_unix_signal_add(SIGTERM, quit, loop.get());
+   auto sigusr1 = g_unix_signal_add(SIGUSR1, [](void* m) {
+      ((MockBluez*)m)->ChangeServices();
+      return (int)G_SOURCE_CONTINUE;
+   }, mock.get());
+
+   g_main_loop_run(loop.get());
+   g_source_remove(sigint);
+   g_source_remove(sigterm);
+   g_source_remove(sigusr1);
+
+   mock->PrintStats();
+   return 0;
+}
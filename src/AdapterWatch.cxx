@@ -0,0 +1,91 @@
+#include "AdapterWatch.hh"
+#include "Bus.hh"
+
+#include <gio/gio.h>
+
+using namespace asha;
+
+namespace
+{
+   constexpr char BLUEZ_ADAPTER[] = "org.bluez.Adapter1";
+   constexpr char OBJECT_MANAGER_INTERFACE[] = "org.freedesktop.DBus.ObjectManager";
+}
+
+
+AdapterWatch::AdapterWatch(const std::shared_ptr<Bus>& bus, const AddCallback& add):
+   m_bus(bus),
+   m_add_cb(add),
+   m_self(std::make_shared<AdapterWatch*>(this))
+{
+   // Lambda doesn't work with a C callback that needs a user_data.
+   struct Callback {
+      static void Signal(GDBusConnection* c, const gchar* sender, const gchar* object_path, const gchar* iface, const gchar* signal, GVariant* parameters, gpointer user_data)
+      {
+         auto* self = (AdapterWatch*)user_data;
+         if (!g_variant_check_format_string(parameters, "(oa{sa{sv}})", false))
+            return;
+         const gchar* path = nullptr;
+         GVariant* interfaces{};
+         g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &interfaces);
+         std::shared_ptr<GVariant> pinterfaces(interfaces, g_variant_unref);
+         self->ProcessInterfaces(path, interfaces);
+      }
+   };
+
+   // Subscribe before asking, so that an adapter turning up in between isn't
+   // missed. One turning up in both just gets ignored the second time.
+   m_subscription_id = g_dbus_connection_signal_subscribe(m_bus->Connection(),
+      m_bus->Service().c_str(),
+      OBJECT_MANAGER_INTERFACE,
+      "InterfacesAdded",
+      "/",
+      nullptr,
+      G_DBUS_SIGNAL_FLAGS_NONE,
+      &Callback::Signal,
+      this,
+      nullptr
+   );
+
+   std::weak_ptr<AdapterWatch*> weak = m_self;
+   m_bus->CallAsync("/", OBJECT_MANAGER_INTERFACE, "GetManagedObjects", nullptr, [weak](const std::shared_ptr<GVariant>& result) {
+      auto self = weak.lock();
+      if (!self)
+         return;
+      if (!result || !g_variant_check_format_string(result.get(), "(a{oa{sa{sv}}})", false))
+      {
+         // Bus::CallAsync has already said why.
+         g_warning("Unable to enumerate bluez adapters");
+         return;
+      }
+      GVariantIter* objects = nullptr;
+      const gchar* path = nullptr;
+      GVariant* interfaces = nullptr;
+      g_variant_get(result.get(), "(a{oa{sa{sv}}})", &objects);
+      while (g_variant_iter_next(objects, "{&o@a{sa{sv}}}", &path, &interfaces))
+      {
+         std::shared_ptr<GVariant> pinterfaces(interfaces, g_variant_unref);
+         (*self)->ProcessInterfaces(path, interfaces);
+      }
+      g_variant_iter_free(objects);
+   });
+}
+
+
+AdapterWatch::~AdapterWatch()
+{
+   if (m_subscription_id)
+      g_dbus_connection_signal_unsubscribe(m_bus->Connection(), m_subscription_id);
+}
+
+
+void AdapterWatch::ProcessInterfaces(const std::string& path, GVariant* interfaces)
+{
+   GVariant* adapter = g_variant_lookup_value(interfaces, BLUEZ_ADAPTER, G_VARIANT_TYPE("a{sv}"));
+   if (!adapter)
+      return;
+   g_variant_unref(adapter);
+   if (!m_adapters.insert(path).second)
+      return;
+   g_info("Found adapter %s", path.c_str());
+   m_add_cb(path);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+
+struct _GVariant;
+
+namespace asha
+{
+
+class Bus;
+
+// Finds the bluez adapters, the ones there are now and any that get plugged
+// in later, for running a dump per adapter. Each adapter is reported once,
+// from the calling thread's default main context.
+class AdapterWatch final
+{
+public:
+   // Called with the adapter's object path, like /org/bluez/hci0.
+   typedef std::function<void(const std::string&)> AddCallback;
+
+   AdapterWatch(const std::shared_ptr<Bus>& bus, const AddCallback& add);
+   ~AdapterWatch();
+
+   AdapterWatch(const AdapterWatch&) = delete;
+   AdapterWatch& operator=(const AdapterWatch&) = delete;
+
+private:
+   // interfaces is a{sa{sv}}.
+   void ProcessInterfaces(const std::string& path, struct _GVariant* interfaces);
+
+   std::shared_ptr<Bus> m_bus;
+   AddCallback m_add_cb;
+   // For telling a reply that comes back after we are gone not to bother.
+   std::shared_ptr<AdapterWatch*> m_self;
+   unsigned m_subscription_id = 0;
+   std::set<std::string> m_adapters;
+};
+
+}
@@ -1,9 +1,11 @@
 #include "Bluetooth.hh"
 #include "Descriptor.hh"
 #include "GVariantDump.hh"
-//#include "GVariantDump.hh"
+#include "Latency.hh"
+#include "Log.hh"
 
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <memory>
@@ -17,117 +19,141 @@ using namespace asha;
 namespace
 {
    constexpr char BLUEZ_DEVICE[] = "org.bluez.Device1";
-   static constexpr char GATT_SERVICE_UUID[]    = "0000fdf0-0000-1000-8000-00805f9b34fb";
+   constexpr char OBJECT_MANAGER_INTERFACE[] = "org.freedesktop.DBus.ObjectManager";
+   constexpr char GATT_SERVICE_INTERFACE[] = "org.bluez.GattService1";
+   constexpr Uuid GATT_SERVICE_UUID = Uuid::FromShort(0xfdf0);
 
    uint64_t g_next_notify_id = 0;
+
+   // g_variant_lookup_value gives back null for a missing key, which
+   // g_variant_unref doesn't take.
+   std::shared_ptr<GVariant> LookupValue(GVariant* dictionary, const char* key, const GVariantType* type)
+   {
+      return std::shared_ptr<GVariant>(g_variant_lookup_value(dictionary, key, type), [](GVariant* v) {
+         if (v)
+            g_variant_unref(v);
+      });
+   }
 }
 
 
 
-Bluetooth::Bluetooth(const AddCallback& add, const RemoveCallback& remove):
+Bluetooth::Bluetooth(const AddCallback& add, const RemoveCallback& remove, const std::shared_ptr<Bus>& bus):
+   m_bus{bus ? bus : Bus::Connect()},
+   m_context(g_main_context_ref_thread_default(), g_main_context_unref),
+   m_self(std::make_shared<Bluetooth*>(this)),
+   m_start(latency::Now()),
    m_add_cb{add},
    m_remove_cb{remove}
 {
-   GError* err = nullptr;
-   m_bluez_objects.reset(g_dbus_proxy_new_for_bus_sync(
-      G_BUS_TYPE_SYSTEM,
-      G_DBUS_PROXY_FLAGS_NONE,
-      nullptr,
-      "org.bluez",
-      "/",
-      "org.freedesktop.DBus.ObjectManager",
-      nullptr,
-      &err
-   ), g_object_unref);
-
-   if (err)
-   {
-      g_error("Error getting org.bluez ObjectManager interface: %s", err->message);
-      g_error_free(err);
-      throw std::runtime_error("Unable to connect to dbus");
-   }
-
-   // Lambda doesn't work with G_CALLBACK
+   // Lambda doesn't work with a C callback that needs a user_data.
    struct Callback {
-      static void Signal(GDBusProxy* p, gchar* sender, gchar* signal, GVariant* parameters, gpointer* user_data)
+      static void Signal(GDBusConnection* c, const gchar* sender, const gchar* object_path, const gchar* iface, const gchar* signal, GVariant* parameters, gpointer user_data)
       {
          auto* self = (Bluetooth*)user_data;
          // std::stringstream ss;
          // GVariantDump(parameters, ss);
          // g_info("Signal %s::%s %s", sender, signal, ss.str().c_str());
 
-         if (g_str_equal(signal, "InterfacesAdded"))
+         if (!self->m_enumerated)
+            return;
+         if (g_str_equal(signal, "InterfacesAdded") && g_variant_check_format_string(parameters, "(oa{sa{sv}})", false))
          {
-            gchar* path = nullptr;
-            GVariantIter* it{};
-            g_variant_get(parameters, "(oa{sa{sv}})", &path, &it);
-            std::shared_ptr<char> ppath(path, g_free);
-            std::shared_ptr<GVariantIter> pit(it, g_variant_iter_free);
-            self->ProcessInterfaceAdd(path, it);
+            const gchar* path = nullptr;
+            GVariant* interfaces{};
+            g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &interfaces);
+            std::shared_ptr<GVariant> pinterfaces(interfaces, g_variant_unref);
+            self->ProcessInterfaceAdd(path, interfaces);
          }
-         else if (g_str_equal(signal, "InterfacesRemoved"))
+         else if (g_str_equal(signal, "InterfacesRemoved") && g_variant_check_format_string(parameters, "(oas)", false))
          {
-            gchar* path = nullptr;
-            GVariantIter* it{};
-            g_variant_get(parameters, "(oas)", &path, &it);
-            std::shared_ptr<char> ppath(path, g_free);
-            std::shared_ptr<GVariantIter> pit(it, g_variant_iter_free);
-            self->ProcessInterfaceRemoved(path, it);
+            const gchar* path = nullptr;
+            GVariant* interfaces{};
+            g_variant_get(parameters, "(&o@as)", &path, &interfaces);
+            std::shared_ptr<GVariant> pinterfaces(interfaces, g_variant_unref);
+            self->ProcessInterfaceRemoved(path, interfaces);
          }
          else
          {
-            std::stringstream ss;
-            GVariantDump(parameters, ss);
-            g_info("Signal %s::%s %s", sender, signal, ss.str().c_str());
+            ASHA_INFO(SIGNAL, "Signal %s::%s %s", sender, signal, GVariantDump(parameters).c_str());
          }
       }
    };
-   m_signal_id = g_signal_connect(m_bluez_objects.get(),
-      "g-signal",
-      G_CALLBACK(&Callback::Signal),
-      this
+
+   // Subscribing straight on the connection, rather than through a proxy,
+   // means nothing waits on a round trip here. arg0 is the path of the object
+   // that came or went, so a bus covering one adapter only hears about that
+   // adapter's objects.
+   std::string arg0 = m_bus->PathNamespace().empty() ? std::string() : m_bus->PathNamespace() + "/";
+   m_subscription_id = g_dbus_connection_signal_subscribe(m_bus->Connection(),
+      m_bus->Service().c_str(),
+      OBJECT_MANAGER_INTERFACE,
+      nullptr,
+      "/",
+      arg0.empty() ? nullptr : arg0.c_str(),
+      arg0.empty() ? G_DBUS_SIGNAL_FLAGS_NONE : G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_PATH,
+      &Callback::Signal,
+      this,
+      nullptr
    );
-   if (!EnumerateDevices())
-      throw std::runtime_error("Unable to enumerate devices");
+   // Keep the object cache current for every object bluez owns, not just the
+   // devices we are tracking.
+   m_cache_watch_id = m_bus->WatchAllProperties([this](const char* path, const char* interface, GVariant* changed, GVariant* invalidated) {
+      m_cache.UpdateProperties(path, interface, changed, invalidated);
+   });
+   EnumerateDevices();
 }
 
 
 Bluetooth::~Bluetooth()
 {
-   // Probably not necessary, as the signals get disconnected when
-   // m_bluez_objects gets destroyed.
-   if (m_signal_id != (uint64_t)-1)
-      g_signal_handler_disconnect(m_bluez_objects.get(), m_signal_id);
+   if (m_subscription_id)
+      g_dbus_connection_signal_unsubscribe(m_bus->Connection(), m_subscription_id);
+   if (m_enumerate_source)
+   {
+      GSource* source = g_main_context_find_source_by_id(m_context.get(), m_enumerate_source);
+      if (source)
+         g_source_destroy(source);
+   }
+   // Characteristics can hold onto the bus after we are gone, so make sure
+   // it doesn't call back into us.
+   for (auto& kv: m_device_watches)
+      m_bus->UnwatchProperties(kv.second);
+   if (m_cache_watch_id)
+      m_bus->UnwatchProperties(m_cache_watch_id);
 }
 
 
-bool Bluetooth::EnumerateDevices()
+void Bluetooth::EnumerateDevices()
 {
    // TODO: Remove any devices that currently exist. Probably none, since the
    //       only place we call this is the constructor.
    m_devices.clear();
-   m_bluez_properties.clear();
-
-   GError* err = nullptr;
-   std::shared_ptr<GVariant> result(g_dbus_proxy_call_sync(
-      m_bluez_objects.get(),
-      "GetManagedObjects",
-      nullptr,
-      G_DBUS_CALL_FLAGS_NONE,
-      -1,
-      nullptr,
-      &err
-   ), g_variant_unref);
-
-   // std::cout << result.get() << '\n';
+   for (auto& kv: m_device_watches)
+      m_bus->UnwatchProperties(kv.second);
+   m_device_watches.clear();
+
+   std::weak_ptr<Bluetooth*> weak = m_self;
+   m_bus->CallAsync("/", OBJECT_MANAGER_INTERFACE, "GetManagedObjects", nullptr, [weak](const std::shared_ptr<GVariant>& result) {
+      auto self = weak.lock();
+      if (!self)
+         return;
+      if (!result || !g_variant_check_format_string(result.get(), "(a{oa{sa{sv}}})", false))
+      {
+         // Bus::CallAsync has already said why. Devices that turn up from
+         // now on still get added.
+         g_warning("Unable to enumerate bluez devices");
+         (*self)->OnManagedObjects(nullptr);
+         return;
+      }
+      std::shared_ptr<GVariant> objects(g_variant_get_child_value(result.get(), 0), g_variant_unref);
+      (*self)->OnManagedObjects(objects.get());
+   });
+}
 
-   if (err)
-   {
-      g_error("Error making org.bluez GetManagedObjects call: %s", err->message);
-      g_error_free(err);
-      return false;
-   }
 
+void Bluetooth::OnManagedObjects(GVariant* objects)
+{
    // The result should have a signature of a{oa{sa{sv}}}. It should be full of
    // results that look like this:
    //    "/org/bluez/hci0/dev_MA_CA_DD_RE_SS_00": {
@@ -152,18 +178,76 @@ bool Bluetooth::EnumerateDevices()
    //       }
    //    },
 
-   // result is a tuple with one item. Unpack an array iterator from it.
-   GVariantIter* it_object{};
-   g_variant_get(result.get(), "(a{oa{sa{sv}}})", &it_object);
-   std::shared_ptr<GVariantIter> pit_object(it_object, g_variant_iter_free);
-   gchar* path{};
-   GVariantIter* it_interface{};
-   while (g_variant_iter_loop(it_object, "{oa{sa{sv}}}", &path, &it_interface))
-      ProcessInterfaceAdd(path, it_interface);
+   // Seed the cache with it, then go through the devices a batch at a time.
+   m_enumerated = true;
+   if (objects)
+      m_cache.Reset(objects);
+   for (auto& object: m_cache.All())
+   {
+      if (object.second.count(BLUEZ_DEVICE))
+         m_unprocessed.push_back(object.first);
+   }
 
-   return true;
+   struct Callback {
+      static gboolean Enumerate(gpointer user_data)
+      {
+         auto* self = (Bluetooth*)user_data;
+         if (self->EnumerateBatch())
+            return G_SOURCE_CONTINUE;
+         self->m_enumerate_source = 0;
+         return G_SOURCE_REMOVE;
+      }
+   };
+   if (EnumerateBatch())
+   {
+      GSource* source = g_idle_source_new();
+      g_source_set_callback(source, &Callback::Enumerate, this, nullptr);
+      m_enumerate_source = g_source_attach(source, m_context.get());
+      g_source_unref(source);
+   }
 }
 
+
+bool Bluetooth::EnumerateBatch()
+{
+   for (size_t i = 0; i < ENUMERATE_BATCH && !m_unprocessed.empty(); ++i)
+   {
+      std::string path = std::move(m_unprocessed.front());
+      m_unprocessed.pop_front();
+      // It may have gone away since the reply, or turned up again through
+      // InterfacesAdded already, which is harmless to repeat.
+      auto properties = m_cache.Find(path, BLUEZ_DEVICE);
+      if (!properties || !OnAdapter(properties.get()))
+         continue;
+      GVariantIter it;
+      g_variant_iter_init(&it, properties.get());
+      ProcessDevice(path, &it);
+   }
+   if (!m_unprocessed.empty())
+      return true;
+
+   m_settled = true;
+   size_t ready = 0;
+   for (auto& kv: m_devices)
+      ready += kv.second.connected && kv.second.resolved;
+   double settled_ms = (latency::Now() - m_start) / 1e6;
+   if (m_first_device)
+      g_info("Startup settled after %.1fms with %zu devices, %zu ready; first device after %.1fms",
+             settled_ms, m_devices.size(), ready, (m_first_device - m_start) / 1e6);
+   else
+      g_info("Startup settled after %.1fms with %zu devices, none ready", settled_ms, m_devices.size());
+   return false;
+}
+
+bool Bluetooth::OnAdapter(GVariant* properties) const
+{
+   if (m_bus->PathNamespace().empty())
+      return true;
+   const gchar* adapter{};
+   return g_variant_lookup(properties, "Adapter", "&o", &adapter) && m_bus->PathNamespace() == adapter;
+}
+
+
 void Bluetooth::ProcessDevice(const std::string& path, GVariantIter* property_dict)
 {
    gchar* key{};
@@ -173,77 +257,27 @@ void Bluetooth::ProcessDevice(const std::string& path, GVariantIter* property_di
    while (g_variant_iter_loop(property_dict, "{sv}", &key, &value))
       ProcessDeviceProperty(device, key, value);
 
-   auto& iface = m_bluez_properties[path];
-   if (!iface)
+   auto& watch_id = m_device_watches[path];
+   if (!watch_id)
    {
-      GError* err = nullptr;
-      auto* piface = g_dbus_proxy_new_for_bus_sync(
-         G_BUS_TYPE_SYSTEM,
-         G_DBUS_PROXY_FLAGS_NONE,
-         nullptr,
-         "org.bluez",
-         path.c_str(),
-         "org.freedesktop.DBus.Properties",
-         nullptr,
-         &err
-      );
-      if (err)
-      {
-         g_error("Error getting dbus org.bluez Properties interface for %s: %s", path.c_str(), err->message);
-         g_error_free(err);
-      }
-      else
-      {
-         iface.reset(piface, g_object_unref);
-         
-         // Lambda doesn't work with G_CALLBACK
-         struct Callback {
-            static void Signal(GDBusProxy* p, gchar* sender, gchar* signal, GVariant* parameters, gpointer* user_data)
-            {
-               auto* self = (Bluetooth*)user_data;
-
-               if (g_str_equal(signal, "PropertiesChanged"))
-               {
-                  GVariantIter* it{};
-                  g_variant_get(parameters, "(sa{sv}as)", nullptr, &it, nullptr);
-                  std::shared_ptr<GVariantIter> pit(it, g_variant_iter_free);
-                  std::string path = g_dbus_proxy_get_object_path(p);
-                  auto& device = self->m_devices[path];
-                  gchar* key{};
-                  GVariant* value{};
-                  while (g_variant_iter_loop(it, "{sv}", &key, &value))
-                     self->ProcessDeviceProperty(device, key, value);
-               }
-               else
-               {
-                  std::stringstream ss;
-                  GVariantDump(parameters, ss);
-                  g_info("Device Signal %s::%s %s", sender, signal, ss.str().c_str());
-               }
-            }
-         };
-         // Despite the documentation, this doesn't seem to ever fire. g-signal works though.
-         // g_signal_connect(iface.get(),
-         //    "g-properties-changed",
-         //    G_CALLBACK(&Callback::PropertiesChanged),
-         //    this
-         // );
-
-         g_signal_connect(iface.get(),
-            "g-signal",
-            G_CALLBACK(&Callback::Signal),
-            this
-         );
-      }
+      watch_id = m_bus->WatchProperties(path, [this](const char* path, const char* interface, GVariant* changed, GVariant* invalidated) {
+         if (!g_str_equal(BLUEZ_DEVICE, interface))
+            return;
+         auto& device = m_devices[path];
+         GVariantIter it;
+         g_variant_iter_init(&it, changed);
+         gchar* key{};
+         GVariant* value{};
+         while (g_variant_iter_loop(&it, "{sv}", &key, &value))
+            ProcessDeviceProperty(device, key, value);
+      });
    }
 }
 
 
 void Bluetooth::ProcessDeviceProperty(BluezDevice& device, const char* key, struct _GVariant* value)
 {
-   std::stringstream ss;
-   GVariantDump(value, ss);
-   g_info("%s %s %s", device.path.c_str(), key, ss.str().c_str());
+   ASHA_INFO(DEVICE, "%s %s %s", device.path.c_str(), key, GVariantDump(value).c_str());
 
    bool was_ready = device.resolved && device.connected;
    if (g_str_equal("Name", key))
@@ -258,6 +292,10 @@ void Bluetooth::ProcessDeviceProperty(BluezDevice& device, const char* key, stru
    {
       device.mac = g_variant_get_string(value, nullptr);
    }
+   else if (g_str_equal("Adapter", key))
+   {
+      device.adapter = g_variant_get_string(value, nullptr);
+   }
    // else if (g_str_equal("UUIDs", key))
    // {
    //    GVariantIter it{};
@@ -265,7 +303,7 @@ void Bluetooth::ProcessDeviceProperty(BluezDevice& device, const char* key, stru
    //    gchar* uuid{};
    //    while (g_variant_iter_loop(&it, "s", &uuid))
    //    {
-   //       if (g_str_equal(GATT_SERVICE_UUID, uuid))
+   //       if (GATT_SERVICE_UUID == Uuid::TryParse(uuid))
    //       {
    //          has_gatt = true;
    //       }
@@ -303,27 +341,35 @@ void Bluetooth::ProcessDeviceProperty(BluezDevice& device, const char* key, stru
 }
 
 
-void Bluetooth::ProcessInterfaceAdd(const std::string& path, struct _GVariantIter* iface_dict)
+void Bluetooth::ProcessInterfaceAdd(const std::string& path, GVariant* interfaces)
 {
-   gchar* interface{};
-   GVariantIter* it_properties{};
-   while (g_variant_iter_loop(iface_dict, "{sa{sv}}", &interface, &it_properties))
+   m_cache.AddInterfaces(path, interfaces);
+
+   GVariantIter it;
+   g_variant_iter_init(&it, interfaces);
+   const gchar* interface{};
+   GVariant* properties{};
+   while (g_variant_iter_loop(&it, "{&s@a{sv}}", &interface, &properties))
    {
-      if (g_str_equal(BLUEZ_DEVICE, interface))
+      if (g_str_equal(BLUEZ_DEVICE, interface) && OnAdapter(properties))
       {
-         ProcessDevice(path, it_properties);
+         GVariantIter it_properties;
+         g_variant_iter_init(&it_properties, properties);
+         ProcessDevice(path, &it_properties);
       }
    }
 }
 
 
-void Bluetooth::ProcessInterfaceRemoved(const std::string& path, struct _GVariantIter* iface_dict)
+void Bluetooth::ProcessInterfaceRemoved(const std::string& path, GVariant* interfaces)
 {
    auto it = m_devices.find(path);
    if (it != m_devices.end())
    {
+      GVariantIter it_interface;
+      g_variant_iter_init(&it_interface, interfaces);
       gchar* interface{};
-      while (g_variant_iter_loop(iface_dict, "s", &interface))
+      while (g_variant_iter_loop(&it_interface, "s", &interface))
       {
          if (g_str_equal(BLUEZ_DEVICE, interface))
          {
@@ -333,134 +379,96 @@ void Bluetooth::ProcessInterfaceRemoved(const std::string& path, struct _GVarian
                g_info("Removing bluetooth device %s", it->second.name.c_str());
                m_remove_cb(path);
             }
-            m_bluez_properties.erase(path);
+            auto watch = m_device_watches.find(path);
+            if (watch != m_device_watches.end())
+            {
+               m_bus->UnwatchProperties(watch->second);
+               m_device_watches.erase(watch);
+            }
             m_devices.erase(it);
+            break;
          }
       }
    }
-}
-
-
-void Bluetooth::ProcessCharacteristic(BluezDevice& device, const std::string& path, GVariantIter* property_dict)
-{
 
+   m_cache.RemoveInterfaces(path, interfaces);
 }
 
 
-void Bluetooth::PrepareAndAddDevice(BluezDevice& device)
+GattTable Bluetooth::ReadGattTable(const ObjectCache& cache, const std::string& device_path)
 {
-   assert(device.connected);
-   assert(device.resolved);
-
-   device.services.clear();
-
-   // Fill out the device characteristics before we forward it to the callback.
-   // TODO: Is there a more efficient way of doing this?
-   GError* err = nullptr;
-   std::shared_ptr<GVariant> result(g_dbus_proxy_call_sync(
-      m_bluez_objects.get(),
-      "GetManagedObjects",
-      nullptr,
-      G_DBUS_CALL_FLAGS_NONE,
-      -1,
-      nullptr,
-      &err
-   ), g_variant_unref);
-
-   if (err)
-   {
-      g_error("Error making org.bluez GetManagedObjects call: %s", err->message);
-      g_error_free(err);
-      return;
-   }
-
-   // Scan through the results for services.
-   {
-      GVariantIter* it_object{};
-      g_variant_get(result.get(), "(a{oa{sa{sv}}})", &it_object);
-      std::shared_ptr<GVariantIter> pit_object(it_object, g_variant_iter_free);
-      gchar* path{};
-      GVariantIter* it_interface{};
-      while (g_variant_iter_loop(it_object, "{oa{sa{sv}}}", &path, &it_interface))
+   // Everything we need is already in the cache, so this doesn't touch the
+   // bus, and only the properties that the table keeps get looked at.
+   GattTable::Builder gatt;
+   cache.ForEachChild(device_path, [&](const std::string& path, const ObjectCache::Interfaces& interfaces) {
+      for (auto& kv: interfaces)
       {
-         if (std::string(path).substr(0, device.path.size()) != device.path)
+         GVariant* properties = kv.second.dictionary.get();
+         const gchar* uuid{};
+         if (!g_variant_lookup(properties, "UUID", "&s", &uuid))
             continue;
-         gchar* interface{};
-         GVariantIter* it_properties{};
-         while (g_variant_iter_loop(it_interface, "{sa{sv}}", &interface, &it_properties))
+         // bluez publishes the last value it read or was notified of, for
+         // reads that don't need to go to the device.
+         GVariant* cached = kv.second.value.get();
+         ByteView bytes;
+         if (cached)
          {
-            if (g_str_equal("org.bluez.GattService1", interface))
-            {
-               gchar* key{};
-               GVariant* value{};
-               while (g_variant_iter_loop(it_properties, "{sv}", &key, &value))
-               {
-                  if (g_str_equal("UUID", key))
-                     device.services.emplace(path, BluezDevice::Service{path, g_variant_get_string(value, nullptr)});
-               }
-            }
+            gsize length = 0;
+            auto* data = (const uint8_t*)g_variant_get_fixed_array(cached, &length, sizeof(guint8));
+            bytes = ByteView(data, length);
          }
-      }
-   }
 
-   std::map<std::string, std::pair<std::string, size_t>> char_idx;
-
-   // Scan through again, filling all the services with characteristics.
-   {
-      GVariantIter* it_object{};
-      g_variant_get(result.get(), "(a{oa{sa{sv}}})", &it_object);
-      std::shared_ptr<GVariantIter> pit_object(it_object, g_variant_iter_free);
-      gchar* path{};
-      GVariantIter* it_interface{};
-      while (g_variant_iter_loop(it_object, "{oa{sa{sv}}}", &path, &it_interface))
-      {
-         if (std::string(path).substr(0, device.path.size()) != device.path)
-            continue;
-         gchar* interface{};
-         GVariantIter* it_properties{};
-         while (g_variant_iter_loop(it_interface, "{sa{sv}}", &interface, &it_properties))
+         if (kv.first == GATT_SERVICE_INTERFACE)
          {
-            if (g_str_equal(CHARACTERISTIC_INTERFACE, interface))
-            {
-               Characteristic c(path, it_properties);
-               auto& entry = device.services[c.Service()];
-               size_t idx = entry.characteristics.size();
-               entry.characteristics.emplace_back(c);
-               // remember where this is for when we add descriptors
-               char_idx[path] = std::make_pair(c.Service(), idx);
-            }
+            gatt.AddService(path, Uuid::TryParse(uuid));
          }
-      }
-   }
-
-   // Scan through again, filling all the characteristics with descriptors.
-   {
-      GVariantIter* it_object{};
-      g_variant_get(result.get(), "(a{oa{sa{sv}}})", &it_object);
-      std::shared_ptr<GVariantIter> pit_object(it_object, g_variant_iter_free);
-      gchar* path{};
-      GVariantIter* it_interface{};
-      while (g_variant_iter_loop(it_object, "{oa{sa{sv}}}", &path, &it_interface))
-      {
-         if (std::string(path).substr(0, device.path.size()) != device.path)
-            continue;
-         gchar* interface{};
-         GVariantIter* it_properties{};
-         while (g_variant_iter_loop(it_interface, "{sa{sv}}", &interface, &it_properties))
+         else if (kv.first == CHARACTERISTIC_INTERFACE)
          {
-            if (g_str_equal("org.bluez.GattDescriptor1", interface))
-            {
-               Descriptor c(path, it_properties);
-               auto it = char_idx.find(c.Characteristic());
-               if (it != char_idx.end())
-               {
-                  auto& entry = device.services[it->second.first];
-                  entry.characteristics[it->second.second].AddDescriptor(c);
-               }
-            }
+            const gchar* service{};
+            if (!g_variant_lookup(properties, "Service", "&o", &service))
+               continue;
+            uint32_t flags = 0;
+            auto value = LookupValue(properties, "Flags", G_VARIANT_TYPE_STRING_ARRAY);
+            if (value)
+               flags = Characteristic::ParseFlags(value.get());
+            // bluez only publishes NotifyAcquired and WriteAcquired for
+            // characteristics that it will hand out a socket for.
+            gboolean acquired = false;
+            bool can_acquire_notify = g_variant_lookup(properties, "NotifyAcquired", "b", &acquired);
+            bool can_acquire_write = g_variant_lookup(properties, "WriteAcquired", "b", &acquired);
+            gatt.AddCharacteristic(path, Uuid::TryParse(uuid), flags, can_acquire_notify, can_acquire_write, service,
+                                   cached ? &bytes : nullptr);
+         }
+         else if (kv.first == DESCRIPTOR_INTERFACE)
+         {
+            const gchar* characteristic{};
+            if (g_variant_lookup(properties, "Characteristic", "&o", &characteristic))
+               gatt.AddDescriptor(path, Uuid::TryParse(uuid), characteristic, cached ? &bytes : nullptr);
          }
       }
-   }
+   });
+   return gatt.Finish();
+}
+
+
+void Bluetooth::PrepareAndAddDevice(BluezDevice& device)
+{
+   assert(device.connected);
+   assert(device.resolved);
 
-   m_add_cb(device);
+   BluezDevice added;
+   added.path = device.path;
+   added.name = device.name;
+   added.alias = device.alias;
+   added.mac = device.mac;
+   added.adapter = device.adapter;
+   added.connected = device.connected;
+   added.resolved = device.resolved;
+   // Fill out the device's GATT table before we forward it to the callback.
+   added.gatt = ReadGattTable(m_cache, device.path);
+   added.bus = m_bus;
+
+   if (!m_first_device)
+      m_first_device = latency::Now();
+   m_add_cb(std::move(added));
 }
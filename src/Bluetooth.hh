@@ -1,22 +1,31 @@
 #pragma once
 
+#include "Bus.hh"
 #include "Characteristic.hh"
+#include "Descriptor.hh"
+#include "GattTable.hh"
+#include "ObjectCache.hh"
 
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <string>
 #include <map>
 
-struct _GDBusProxy;
+struct _GMainContext;
 struct _GVariantIter;
 
 namespace asha
 {
 
 // Abstraction of bluez managed objects interface.
-// TODO: We could theoretically watch the properties-changed signal to see
-//       when devices are attached and removed.
+//
+// Construction doesn't wait on the bus: devices get enumerated from the main
+// loop once GetManagedObjects replies, a batch at a time, so that signals
+// keep getting handled even with a long list of bonded devices. How long
+// it took to the first device being added, and to having been through all
+// of them, gets logged.
 class Bluetooth final
 {
 public:
@@ -26,44 +35,83 @@ public:
       std::string name;
       std::string alias;
       std::string mac;
+      // Object path of the adapter the device is on.
+      std::string adapter;
 
       bool connected = false;
       bool resolved = false;
 
-      struct Service
-      {
-         std::string path;
-         std::string uuid;
-         std::vector<Characteristic> characteristics;
-      };
-      std::map<std::string, Service> services;
+      // Only filled in on the device handed to AddCallback, which gets to
+      // keep it; Bluetooth doesn't hold onto a copy.
+      GattTable gatt;
+      // What to make Characteristics and Descriptors from gatt with.
+      std::shared_ptr<Bus> bus;
    };
 
-   typedef std::function<void(const BluezDevice&)> AddCallback;
+   // The device is handed over by move, so that keeping it doesn't cost a
+   // copy. Handles into gatt point at the table itself, so take them after
+   // moving it to wherever it is going to stay.
+   typedef std::function<void(BluezDevice&&)> AddCallback;
    typedef std::function<void(const std::string&)> RemoveCallback;
-   Bluetooth(const AddCallback& add, const RemoveCallback& remove);
+   // Uses bus if given, otherwise connects to bluez on the system bus. The
+   // callbacks run from the calling thread's default main context. When the
+   // bus only covers one adapter (see Bus::Connect), only devices on that
+   // adapter get added.
+   Bluetooth(const AddCallback& add, const RemoveCallback& remove, const std::shared_ptr<Bus>& bus = nullptr);
    ~Bluetooth();
 
+   Bluetooth(const Bluetooth&) = delete;
+   Bluetooth& operator=(const Bluetooth&) = delete;
+
+   // Whether every device bluez knew about at startup has been looked at,
+   // and any that were ready have been added.
+   bool Settled() const { return m_settled; }
+
+   // Devices processed per main loop iteration during enumeration.
+   static constexpr size_t ENUMERATE_BATCH = 16;
+
+   // The GATT table of the device at device_path, in one pass over what
+   // cache has underneath it. This is most of the work of adding a device.
+   static GattTable ReadGattTable(const ObjectCache& cache, const std::string& device_path);
+
 private:
-   bool EnumerateDevices();
+   void EnumerateDevices();
+   void OnManagedObjects(struct _GVariant* objects);
+   // Returns false once there is nothing left to enumerate.
+   bool EnumerateBatch();
+   // Whether a device with these properties (a{sv}) is on our adapter.
+   bool OnAdapter(struct _GVariant* properties) const;
    void ProcessDevice(const std::string& path, struct _GVariantIter* property_dict);
    void ProcessDeviceProperty(BluezDevice& device, const char* key, struct _GVariant* value);
-   void ProcessInterfaceAdd(const std::string& path, struct _GVariantIter* iface_dict);
-   void ProcessInterfaceRemoved(const std::string& path, struct _GVariantIter* iface_dict);
+   void ProcessInterfaceAdd(const std::string& path, struct _GVariant* interfaces);
+   void ProcessInterfaceRemoved(const std::string& path, struct _GVariant* interfaces);
 
    void PrepareAndAddDevice(BluezDevice& device);
-   void ProcessCharacteristic(BluezDevice& device, const std::string& path, struct _GVariantIter* property_dict);
 
    void OnInterfaceAdded();
 
-   std::shared_ptr<_GDBusProxy> m_bluez_objects;
-   std::shared_ptr<_GDBusProxy> m_bluez_object_properties;
-   std::map<std::string, std::shared_ptr<_GDBusProxy>> m_bluez_properties;
+   std::shared_ptr<Bus> m_bus;
+   std::shared_ptr<_GMainContext> m_context;
+   // Replies can come after we are gone, so they only get a weak reference.
+   std::shared_ptr<Bluetooth*> m_self;
+   std::map<std::string, uint64_t> m_device_watches;
 
    std::map<std::string, BluezDevice> m_devices;
+   ObjectCache m_cache;
+
+   unsigned m_subscription_id = 0;
+   uint64_t m_cache_watch_id = 0;
+
+   // Devices from GetManagedObjects still to be looked at. Until the reply
+   // arrives, InterfacesAdded and InterfacesRemoved get ignored, since the
+   // reply already reflects them.
+   bool m_enumerated = false;
+   std::deque<std::string> m_unprocessed;
+   unsigned m_enumerate_source = 0;
 
-   uint64_t m_signal_id = -1;
-   uint64_t m_properties_changed_id = -1;
+   bool m_settled = false;
+   int64_t m_start = 0;
+   int64_t m_first_device = 0;
 
    AddCallback m_add_cb;
    RemoveCallback m_remove_cb;
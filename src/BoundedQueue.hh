@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace asha
+{
+
+// Fixed size queue for handing things from any number of producer threads to
+// one consumer thread. Nothing ever blocks or allocates after construction: a
+// push onto a full queue fails (and is counted as a drop), and a pop from an
+// empty one fails.
+//
+// Every cell carries a sequence number that says whose turn it is, so
+// producers only contend on the head index, and never with the consumer.
+template <typename T>
+class BoundedQueue final
+{
+public:
+   // capacity gets rounded up to a power of two.
+   explicit BoundedQueue(size_t capacity)
+   {
+      size_t size = 2;
+      while (size < capacity)
+         size *= 2;
+      m_cells.reset(new Cell[size]);
+      m_mask = size - 1;
+      for (size_t i = 0; i < size; ++i)
+         m_cells[i].seq.store(i, std::memory_order_relaxed);
+   }
+
+   BoundedQueue(const BoundedQueue&) = delete;
+   BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+   // Safe from any thread.
+   bool TryPush(T&& value)
+   {
+      Cell* cell;
+      size_t pos = m_head.load(std::memory_order_relaxed);
+      for (;;)
+      {
+         cell = &m_cells[pos & m_mask];
+         size_t seq = cell->seq.load(std::memory_order_acquire);
+         intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+         if (diff == 0)
+         {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+               break;
+         }
+         else if (diff < 0)
+         {
+            // The consumer hasn't freed this cell from the last lap yet.
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+         }
+         else
+         {
+            pos = m_head.load(std::memory_order_relaxed);
+         }
+      }
+
+      cell->value = std::move(value);
+      cell->seq.store(pos + 1, std::memory_order_release);
+      m_pushed.fetch_add(1, std::memory_order_relaxed);
+      return true;
+   }
+
+   // Only from the consumer thread.
+   bool TryPop(T& value)
+   {
+      size_t pos = m_tail.load(std::memory_order_relaxed);
+      Cell& cell = m_cells[pos & m_mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+         return false;
+
+      value = std::move(cell.value);
+      // Don't hold on to whatever the value owns until the next lap.
+      cell.value = T();
+      cell.seq.store(pos + m_mask + 1, std::memory_order_release);
+      m_tail.store(pos + 1, std::memory_order_release);
+      return true;
+   }
+
+   size_t Capacity() const { return m_mask + 1; }
+
+   // Both of these are only a snapshot when other threads are busy with the
+   // queue.
+   size_t Depth() const
+   {
+      size_t tail = m_tail.load(std::memory_order_acquire);
+      size_t head = m_head.load(std::memory_order_acquire);
+      return head > tail ? head - tail : 0;
+   }
+   bool Empty() const { return Depth() == 0; }
+
+   uint64_t Pushed() const { return m_pushed.load(std::memory_order_relaxed); }
+   uint64_t Dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+   struct Cell
+   {
+      std::atomic<size_t> seq;
+      T value;
+   };
+
+   std::unique_ptr<Cell[]> m_cells;
+   size_t m_mask = 0;
+
+   // Producers and the consumer each get their own cache line.
+   char m_pad0[64];
+   std::atomic<size_t> m_head{0};
+   char m_pad1[64];
+   std::atomic<size_t> m_tail{0};
+   char m_pad2[64];
+
+   std::atomic<uint64_t> m_pushed{0};
+   std::atomic<uint64_t> m_dropped{0};
+};
+
+}
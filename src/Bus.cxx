@@ -0,0 +1,476 @@
+#include "Bus.hh"
+#include "BoundedQueue.hh"
+#include "Latency.hh"
+#include "Metrics.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+using namespace asha;
+
+constexpr char Bus::SYSTEM[];
+constexpr char Bus::SESSION[];
+constexpr char Bus::BLUEZ[];
+constexpr int Bus::ACQUIRE_TIMEOUT_MS;
+constexpr int Bus::CALL_TIMEOUT_MS;
+
+namespace
+{
+   // PropertiesChanged carries the interface name as arg0. All of the bluez
+   // interfaces live under this prefix, regardless of the service name.
+   constexpr char BLUEZ_INTERFACES[] = "org.bluez";
+   constexpr char PROPERTIES_INTERFACE[] = "org.freedesktop.DBus.Properties";
+   constexpr char PROPERTIES_CHANGED[] = "PropertiesChanged";
+
+   // Signals can get this far ahead of the main loop before their arrival
+   // times start getting lost.
+   constexpr size_t MAX_ARRIVALS = 4096;
+
+   uint64_t PathHash(const char* path)
+   {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (; *path; ++path)
+      {
+         hash ^= (uint8_t)*path;
+         hash *= 0x100000001b3ull;
+      }
+      return hash;
+   }
+}
+
+
+struct Bus::Arrivals
+{
+   struct Arrival
+   {
+      uint64_t path_hash = 0;
+      int64_t time = 0;
+   };
+   BoundedQueue<Arrival> queue{MAX_ARRIVALS};
+};
+
+
+std::shared_ptr<Bus> Bus::Connect(const std::string& address, const std::string& service, const std::string& path_namespace, Signals signals)
+{
+   GError* err = nullptr;
+   GDBusConnection* connection = nullptr;
+   if (path_namespace.empty() && address == SYSTEM)
+      connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, nullptr, &err);
+   else if (path_namespace.empty() && address == SESSION)
+      connection = g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &err);
+   else
+   {
+      // A connection of our own, which for the well known buses means
+      // looking up where they are first.
+      std::shared_ptr<gchar> resolved;
+      if (address == SYSTEM || address == SESSION)
+         resolved.reset(g_dbus_address_get_for_bus_sync(address == SYSTEM ? G_BUS_TYPE_SYSTEM : G_BUS_TYPE_SESSION, nullptr, &err), g_free);
+      else
+         resolved.reset(g_strdup(address.c_str()), g_free);
+      if (resolved)
+         connection = g_dbus_connection_new_for_address_sync(resolved.get(),
+            (GDBusConnectionFlags)(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+            nullptr,
+            nullptr,
+            &err
+         );
+   }
+
+   if (err)
+   {
+      g_warning("Error connecting to dbus at %s: %s", address.c_str(), err->message);
+      g_error_free(err);
+      throw std::runtime_error("Unable to connect to dbus");
+   }
+
+   std::shared_ptr<Bus> bus = std::make_shared<Bus>(connection, service, path_namespace, signals);
+   g_object_unref(connection);
+   return bus;
+}
+
+
+Bus::Bus(GDBusConnection* connection, const std::string& service, const std::string& path_namespace, Signals signals):
+   m_connection((GDBusConnection*)g_object_ref(connection), g_object_unref),
+   m_service(service),
+   m_path_namespace(path_namespace)
+{
+   // Lambda doesn't work with a C callback that needs a user_data.
+   struct Callback {
+      // Runs on the GDBus worker thread, for every message, as soon as it
+      // has been read off the socket.
+      static GDBusMessage* Filter(GDBusConnection* c, GDBusMessage* message, gboolean incoming, gpointer user_data)
+      {
+         if (!incoming || g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_SIGNAL ||
+             g_strcmp0(g_dbus_message_get_member(message), PROPERTIES_CHANGED) != 0)
+            return message;
+         const gchar* interface = g_dbus_message_get_arg0(message);
+         const gchar* path = g_dbus_message_get_path(message);
+         if (!interface || !path || !g_str_has_prefix(interface, BLUEZ_INTERFACES))
+            return message;
+         auto* arrivals = (Arrivals*)user_data;
+         arrivals->queue.TryPush(Arrivals::Arrival{PathHash(path), latency::Now()});
+         return message;
+      }
+
+      static void FreeArrivals(gpointer user_data)
+      {
+         delete (Arrivals*)user_data;
+      }
+
+      static void PropertiesChanged(GDBusConnection* c, const gchar* sender, const gchar* path, const gchar* iface, const gchar* signal, GVariant* parameters, gpointer user_data)
+      {
+         auto* self = (Bus*)user_data;
+         if (!g_variant_check_format_string(parameters, "(sa{sv}as)", false))
+         {
+            g_warning("Incorrect type signature for %s on %s: %s", PROPERTIES_CHANGED, path, g_variant_get_type_string(parameters));
+            return;
+         }
+         const gchar* interface{};
+         GVariant* changed{};
+         GVariant* invalidated{};
+         g_variant_get(parameters, "(&s@a{sv}@as)", &interface, &changed, &invalidated);
+         // Every notification comes through here, so avoid allocating
+         // shared_ptr control blocks just to drop these references.
+         self->m_signal_arrived = self->m_arrivals ? self->TakeArrival(path) : 0;
+         self->DispatchPropertiesChanged(path, interface, changed, invalidated);
+         self->m_signal_arrived = 0;
+         g_variant_unref(changed);
+         g_variant_unref(invalidated);
+      }
+   };
+
+   if (signals == Signals::NONE)
+      return;
+
+   // arg0 of PropertiesChanged is the interface name, so this matches
+   // org.bluez.Device1, org.bluez.GattCharacteristic1 and friends, and lets
+   // the daemon drop everything else before it gets to us.
+   //
+   // GDBus can't put a path_namespace into the match rule it would make, so
+   // with one, the rule gets added here instead.
+   int flags = G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE;
+   if (!m_path_namespace.empty())
+   {
+      flags |= G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE;
+      AddMatch(std::string("type='signal',sender='") + m_service + "',interface='" + PROPERTIES_INTERFACE +
+               "',member='" + PROPERTIES_CHANGED + "',path_namespace='" + m_path_namespace +
+               "',arg0namespace='" + BLUEZ_INTERFACES + "'");
+   }
+   m_subscription_id = g_dbus_connection_signal_subscribe(m_connection.get(),
+      m_service.c_str(),
+      PROPERTIES_INTERFACE,
+      PROPERTIES_CHANGED,
+      nullptr,
+      BLUEZ_INTERFACES,
+      (GDBusSignalFlags)flags,
+      &Callback::PropertiesChanged,
+      this,
+      nullptr
+   );
+
+   if (latency::Enabled())
+   {
+      m_arrivals = new Arrivals;
+      m_filter_id = g_dbus_connection_add_filter(m_connection.get(), &Callback::Filter, m_arrivals, &Callback::FreeArrivals);
+   }
+}
+
+
+Bus::~Bus()
+{
+   // The filter may still be running on the worker thread, which is why it
+   // frees the arrivals itself once it is done.
+   if (m_filter_id)
+      g_dbus_connection_remove_filter(m_connection.get(), m_filter_id);
+   if (m_subscription_id)
+      g_dbus_connection_signal_unsubscribe(m_connection.get(), m_subscription_id);
+   // The connection is ours alone, and closing it drops the match rule too.
+   if (!m_path_namespace.empty())
+      g_dbus_connection_close(m_connection.get(), nullptr, nullptr, nullptr);
+}
+
+
+void Bus::AddMatch(const std::string& rule)
+{
+   // Nothing to wait for. If the daemon doesn't like the rule, the only
+   // harm is that the signals never arrive, and it will have said why.
+   g_dbus_connection_call(m_connection.get(),
+      "org.freedesktop.DBus",
+      "/org/freedesktop/DBus",
+      "org.freedesktop.DBus",
+      "AddMatch",
+      g_variant_new("(s)", rule.c_str()),
+      nullptr,
+      G_DBUS_CALL_FLAGS_NONE,
+      -1,
+      nullptr,
+      nullptr,
+      nullptr
+   );
+}
+
+
+std::shared_ptr<_GVariant> Bus::Call(const std::string& path, const char* interface, const char* method, const std::shared_ptr<_GVariant>& args, int timeout_ms) noexcept
+{
+   metrics::CallTimer timer(interface, method);
+   GError* e = nullptr;
+   // Cannot directly capture result into a shared_ptr because the shared_ptr
+   // will happily delete a null pointer, which g_variant_unref does not like.
+   GVariant* result = g_dbus_connection_call_sync(m_connection.get(),
+      m_service.c_str(),
+      path.c_str(),
+      interface,
+      method,
+      args.get(),
+      nullptr,
+      G_DBUS_CALL_FLAGS_NONE,
+      timeout_ms,
+      nullptr,
+      &e
+   );
+   timer.Finish(!e && result);
+   if (e)
+   {
+      g_info("Error calling %s: %s", method, e->message);
+      g_error_free(e);
+      return nullptr;
+   }
+   if (!result)
+   {
+      g_warning("Null result when calling %s", method);
+      return nullptr;
+   }
+   return std::shared_ptr<GVariant>(result, g_variant_unref);
+}
+
+
+void Bus::CallAsync(const std::string& path, const char* interface, const char* method, const std::shared_ptr<_GVariant>& args, CallCallback cb) noexcept
+{
+   CallAsync(path, interface, method, args, -1, [cb](const std::shared_ptr<GVariant>& result, CallStatus) {
+      cb(result);
+   });
+}
+
+
+void Bus::CallAsync(const std::string& path, const char* interface, const char* method, const std::shared_ptr<_GVariant>& args, int timeout_ms, StatusCallback cb) noexcept
+{
+   struct Pending
+   {
+      std::string method;
+      StatusCallback cb;
+      metrics::CallTimer timer;
+
+      static void Finish(GObject* source, GAsyncResult* res, gpointer user_data)
+      {
+         std::unique_ptr<Pending> self((Pending*)user_data);
+         GError* e = nullptr;
+         GVariant* result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &e);
+         self->timer.Finish(!e && result);
+         if (e)
+         {
+            g_info("Error calling %s: %s", self->method.c_str(), e->message);
+            // GDBus gives up with G_IO_ERROR_TIMED_OUT, and the bus daemon
+            // with NoReply.
+            bool timed_out = g_error_matches(e, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) ||
+                             g_error_matches(e, G_DBUS_ERROR, G_DBUS_ERROR_NO_REPLY) ||
+                             g_error_matches(e, G_DBUS_ERROR, G_DBUS_ERROR_TIMED_OUT);
+            g_error_free(e);
+            self->cb(nullptr, timed_out ? CallStatus::TIMED_OUT : CallStatus::FAILED);
+         }
+         else if (result)
+         {
+            self->cb(std::shared_ptr<GVariant>(result, g_variant_unref), CallStatus::OK);
+         }
+         else
+         {
+            g_warning("Null result when calling %s", self->method.c_str());
+            self->cb(nullptr, CallStatus::FAILED);
+         }
+      }
+   };
+
+   g_dbus_connection_call(m_connection.get(),
+      m_service.c_str(),
+      path.c_str(),
+      interface,
+      method,
+      args.get(),
+      nullptr,
+      G_DBUS_CALL_FLAGS_NONE,
+      timeout_ms,
+      nullptr,
+      &Pending::Finish,
+      new Pending{method, std::move(cb), metrics::CallTimer(interface, method)}
+   );
+}
+
+
+int Bus::Acquire(const std::string& path, const char* interface, const char* method, uint16_t& mtu) noexcept
+{
+   // There aren't any options that we care about.
+   GVariantBuilder b = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a{sv}"));
+   GVariant* args = g_variant_new("(a{sv})", &b);
+
+   metrics::CallTimer timer(interface, method);
+   GError* e = nullptr;
+   GUnixFDList* fds = nullptr;
+   GVariant* result = g_dbus_connection_call_with_unix_fd_list_sync(m_connection.get(),
+      m_service.c_str(),
+      path.c_str(),
+      interface,
+      method,
+      args,
+      G_VARIANT_TYPE("(hq)"),
+      G_DBUS_CALL_FLAGS_NONE,
+      ACQUIRE_TIMEOUT_MS,
+      nullptr,
+      &fds,
+      nullptr,
+      &e
+   );
+   timer.Finish(!e);
+   if (e)
+   {
+      g_info("Error calling %s: %s", method, e->message);
+      g_error_free(e);
+      return -1;
+   }
+   std::shared_ptr<GVariant> presult(result, g_variant_unref);
+   std::shared_ptr<GUnixFDList> pfds(fds, g_object_unref);
+
+   gint32 handle = -1;
+   guint16 acquired_mtu = 0;
+   g_variant_get(result, "(hq)", &handle, &acquired_mtu);
+
+   // g_unix_fd_list_get hands back a dup, which is ours to close.
+   int fd = fds ? g_unix_fd_list_get(fds, handle, &e) : -1;
+   if (e)
+   {
+      g_warning("Bad socket returned from %s: %s", method, e->message);
+      g_error_free(e);
+      return -1;
+   }
+   mtu = acquired_mtu;
+   return fd;
+}
+
+
+uint64_t Bus::WatchProperties(const std::string& path, PropertiesHandler fn)
+{
+   uint64_t id = m_next_id++;
+   m_by_path[path].push_back(Watch{id, std::move(fn)});
+   m_paths[id] = path;
+   return id;
+}
+
+
+uint64_t Bus::WatchAllProperties(PropertiesHandler fn)
+{
+   uint64_t id = m_next_id++;
+   m_all.push_back(Watch{id, std::move(fn)});
+   return id;
+}
+
+
+void Bus::UnwatchProperties(uint64_t id)
+{
+   // m_all is filed under the empty path, which no real object can have.
+   std::string path;
+   auto it = m_paths.find(id);
+   if (it != m_paths.end())
+   {
+      path = std::move(it->second);
+      m_paths.erase(it);
+   }
+
+   Watches* watches = Find(path);
+   if (!watches)
+      return;
+   for (auto& w: *watches)
+   {
+      if (w.id == id)
+      {
+         // The handler might be the one running right now, so it can't be
+         // destroyed until the dispatch finishes.
+         w.id = 0;
+         break;
+      }
+   }
+
+   m_dirty.push_back(std::move(path));
+   if (m_dispatch_depth == 0)
+      Sweep();
+}
+
+
+void Bus::DispatchPropertiesChanged(const char* path, const char* interface, GVariant* changed, GVariant* invalidated)
+{
+   ++m_dispatch_depth;
+
+   // Index rather than iterate, since handlers are allowed to add watches.
+   // Nothing gets erased while m_dispatch_depth is set.
+   for (size_t i = 0; i < m_all.size(); ++i)
+   {
+      if (m_all[i].id)
+         m_all[i].fn(path, interface, changed, invalidated);
+   }
+
+   m_lookup.assign(path);
+   auto it = m_by_path.find(m_lookup);
+   if (it != m_by_path.end())
+   {
+      // References into an unordered_map survive a rehash.
+      Watches& watches = it->second;
+      for (size_t i = 0; i < watches.size(); ++i)
+      {
+         if (watches[i].id)
+            watches[i].fn(path, interface, changed, invalidated);
+      }
+   }
+
+   if (--m_dispatch_depth == 0 && !m_dirty.empty())
+      Sweep();
+}
+
+
+int64_t Bus::TakeArrival(const char* path)
+{
+   // Signals get dispatched in the order they arrived, so this is normally
+   // the first one. Anything before it never got dispatched to us.
+   uint64_t hash = PathHash(path);
+   Arrivals::Arrival arrival;
+   while (m_arrivals->queue.TryPop(arrival))
+   {
+      if (arrival.path_hash == hash)
+         return arrival.time;
+   }
+   return 0;
+}
+
+
+Bus::Watches* Bus::Find(const std::string& path)
+{
+   if (path.empty())
+      return &m_all;
+   auto it = m_by_path.find(path);
+   return it == m_by_path.end() ? nullptr : &it->second;
+}
+
+
+void Bus::Sweep()
+{
+   auto dead = [](const Watch& w) { return w.id == 0; };
+   for (auto& path: m_dirty)
+   {
+      Watches* watches = Find(path);
+      if (!watches)
+         continue;
+      watches->erase(std::remove_if(watches->begin(), watches->end(), dead), watches->end());
+      if (watches->empty() && !path.empty())
+         m_by_path.erase(path);
+   }
+   m_dirty.clear();
+}
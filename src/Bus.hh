@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct _GDBusConnection;
+struct _GVariant;
+
+namespace asha
+{
+
+// Shared connection to bluez. Rather than every device and characteristic
+// owning a proxy (each adding its own match rules), this makes a single
+// PropertiesChanged subscription for everything under org.bluez, and routes
+// the signals by object path.
+class Bus final
+{
+public:
+   // Called with the object path, interface name, changed properties (a{sv})
+   // and invalidated properties (as).
+   typedef std::function<void(const char*, const char*, struct _GVariant*, struct _GVariant*)> PropertiesHandler;
+   // Called with the reply, or null if the call failed.
+   typedef std::function<void(const std::shared_ptr<_GVariant>&)> CallCallback;
+   // How a call went, for callers that treat a timeout differently from
+   // any other failure.
+   enum class CallStatus
+   {
+      OK,
+      FAILED,
+      TIMED_OUT,
+   };
+   typedef std::function<void(const std::shared_ptr<_GVariant>&, CallStatus)> StatusCallback;
+   // Whether the bus subscribes to PropertiesChanged. Without it, the
+   // property watches never fire, but signals that nothing is going to look
+   // at don't get parsed either.
+   enum class Signals
+   {
+      PROPERTIES,
+      NONE,
+   };
+
+   static constexpr char SYSTEM[] = "system";
+   static constexpr char SESSION[] = "session";
+   static constexpr char BLUEZ[] = "org.bluez";
+   // How long Acquire waits for bluez, which has to write the CCC
+   // descriptor before it can answer AcquireNotify. It blocks the thread, so
+   // a device that has stopped answering shouldn't hold it for bluez's
+   // 25 seconds.
+   static constexpr int ACQUIRE_TIMEOUT_MS = 3000;
+   // How long Call waits for bluez, for the same reason. Everything it gets
+   // used for (ReadValue, WriteValue, StartNotify, StopNotify) goes to the
+   // device, and StartNotify has the same CCC write to make as Acquire.
+   static constexpr int CALL_TIMEOUT_MS = 3000;
+
+   // Connect to bluez. address is SYSTEM (where the real bluez lives),
+   // SESSION, or a dbus address like unix:path=/tmp/bus, which is useful for
+   // talking to a mock. Throws if the connection can't be made.
+   //
+   // With a path_namespace, such as an adapter's /org/bluez/hci1, the bus
+   // gets a connection of its own rather than the process wide one, and the
+   // daemon only sends it PropertiesChanged for objects under that path.
+   // That is what lets several of them run side by side on their own
+   // threads without each one seeing all of the others' traffic.
+   static std::shared_ptr<Bus> Connect(const std::string& address = SYSTEM, const std::string& service = BLUEZ,
+                                       const std::string& path_namespace = std::string(), Signals signals = Signals::PROPERTIES);
+
+   Bus(struct _GDBusConnection* connection, const std::string& service = BLUEZ, const std::string& path_namespace = std::string(),
+       Signals signals = Signals::PROPERTIES);
+   ~Bus();
+
+   Bus(const Bus&) = delete;
+   Bus& operator=(const Bus&) = delete;
+
+   struct _GDBusConnection* Connection() const { return m_connection.get(); }
+   // The well known name bluez owns on this bus.
+   const std::string& Service() const { return m_service; }
+   // Empty unless the bus only covers part of the object tree.
+   const std::string& PathNamespace() const { return m_path_namespace; }
+
+   // Call a bluez method directly on the connection. No proxy gets created,
+   // so there is no GetAll round trip and no extra match rules. Blocks for
+   // at most timeout_ms; -1 is bluez's 25 second default.
+   std::shared_ptr<_GVariant> Call(const std::string& path, const char* interface, const char* method, const std::shared_ptr<_GVariant>& args = nullptr,
+                                   int timeout_ms = CALL_TIMEOUT_MS) noexcept;
+   // Same as Call, but doesn't block. The callback runs from the main loop,
+   // and only the callback is kept alive while the call is pending.
+   void CallAsync(const std::string& path, const char* interface, const char* method, const std::shared_ptr<_GVariant>& args, CallCallback cb) noexcept;
+   // Same again, but gives up after timeout_ms rather than bluez's 25
+   // second default (-1), and says whether the call timed out.
+   void CallAsync(const std::string& path, const char* interface, const char* method, const std::shared_ptr<_GVariant>& args, int timeout_ms, StatusCallback cb) noexcept;
+
+   // Call one of the bluez Acquire methods (AcquireNotify, AcquireWrite),
+   // which reply with a socket and the MTU. Returns the socket, or -1 if the
+   // call failed or took longer than ACQUIRE_TIMEOUT_MS, in which case the
+   // caller should fall back to the regular method calls.
+   int Acquire(const std::string& path, const char* interface, const char* method, uint16_t& mtu) noexcept;
+
+   // Watch for property changes on a single object. Returns an id for
+   // UnwatchProperties.
+   uint64_t WatchProperties(const std::string& path, PropertiesHandler fn);
+   // Watch for property changes on every object. These handlers run before
+   // the per-path ones.
+   uint64_t WatchAllProperties(PropertiesHandler fn);
+   // Safe to call from inside a handler, including the one being removed.
+   void UnwatchProperties(uint64_t id);
+
+   // While a PropertiesChanged handler runs, when its signal came off the
+   // socket, in latency::Now() time. 0 unless latency recording was on when
+   // the bus was made.
+   int64_t SignalArrived() const { return m_signal_arrived; }
+
+private:
+   void DispatchPropertiesChanged(const char* path, const char* interface, struct _GVariant* changed, struct _GVariant* invalidated);
+   void Sweep();
+   int64_t TakeArrival(const char* path);
+   void AddMatch(const std::string& rule);
+
+   struct Watch
+   {
+      uint64_t id;
+      PropertiesHandler fn;
+   };
+   // A deque so that adding a watch from inside a handler doesn't move the
+   // handler that is currently running.
+   typedef std::deque<Watch> Watches;
+   Watches* Find(const std::string& path);
+
+   std::shared_ptr<_GDBusConnection> m_connection;
+   std::string m_service;
+   std::string m_path_namespace;
+   unsigned m_subscription_id = 0;
+
+   // Arrival times, stamped by a filter on the GDBus worker thread and
+   // matched up with signals as they get dispatched. The filter owns them.
+   struct Arrivals;
+   Arrivals* m_arrivals = nullptr;
+   unsigned m_filter_id = 0;
+   int64_t m_signal_arrived = 0;
+
+   Watches m_all;
+   std::unordered_map<std::string, Watches> m_by_path;
+   // For looking signals' paths up in m_by_path, which can't take a C
+   // string, without allocating for each one.
+   std::string m_lookup;
+   std::unordered_map<uint64_t, std::string> m_paths;
+
+   uint64_t m_next_id = 1;
+   // Removals during dispatch only clear the id, and the paths they were on
+   // get swept up afterwards.
+   unsigned m_dispatch_depth = 0;
+   std::vector<std::string> m_dirty;
+};
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace asha
+{
+
+// Non-owning view of some bytes, so that values can be handed out straight
+// from the underlying GVariant or socket buffer without copying them. Only
+// valid for the duration of the call it was passed to; use ToVector() to keep
+// a copy.
+class ByteView final
+{
+public:
+   ByteView() {}
+   ByteView(const uint8_t* data, size_t size): m_data(data), m_size(size) {}
+   // Explicit, so that callbacks taking a ByteView and callbacks taking a
+   // vector can be told apart when overloading.
+   explicit ByteView(const std::vector<uint8_t>& v): m_data(v.data()), m_size(v.size()) {}
+
+   const uint8_t* data() const { return m_data; }
+   size_t size() const { return m_size; }
+   bool empty() const { return m_size == 0; }
+
+   const uint8_t* begin() const { return m_data; }
+   const uint8_t* end() const { return m_data + m_size; }
+   uint8_t operator[](size_t i) const { return m_data[i]; }
+
+   std::vector<uint8_t> ToVector() const { return std::vector<uint8_t>(begin(), end()); }
+
+private:
+   const uint8_t* m_data = nullptr;
+   size_t m_size = 0;
+};
+
+}
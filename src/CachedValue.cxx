@@ -0,0 +1,129 @@
+#include "CachedValue.hh"
+
+#include <gio/gio.h>
+
+using namespace asha;
+
+namespace
+{
+   constexpr char VALUE[] = "Value";
+}
+
+
+bool asha::ParseReadPolicy(const std::string& s, ReadPolicy& policy)
+{
+   if (s == "cached")
+      policy = ReadPolicy::CACHED;
+   else if (s == "cached-then-radio")
+      policy = ReadPolicy::CACHED_THEN_RADIO;
+   else if (s == "radio")
+      policy = ReadPolicy::RADIO;
+   else
+      return false;
+   return true;
+}
+
+
+CachedValue::CachedValue(const std::shared_ptr<Bus>& bus, const std::string& path, const char* interface, const ByteView* value):
+   m_bus(bus),
+   m_path(path),
+   m_interface(interface)
+{
+   if (value)
+   {
+      m_valid = true;
+      m_value = value->ToVector();
+   }
+   if (m_bus)
+   {
+      m_watch_id = m_bus->WatchProperties(m_path, [this](const char* path, const char* interface, GVariant* changed, GVariant* invalidated) {
+         if (g_str_equal(interface, m_interface))
+            OnPropertiesChanged(changed, invalidated);
+      });
+   }
+}
+
+
+CachedValue::~CachedValue()
+{
+   if (m_watch_id)
+      m_bus->UnwatchProperties(m_watch_id);
+}
+
+
+std::unique_ptr<CachedValue> CachedValue::Clone() const
+{
+   ByteView value(m_value);
+   return std::unique_ptr<CachedValue>(new CachedValue(m_bus, m_path, m_interface, m_valid ? &value : nullptr));
+}
+
+
+bool CachedValue::Read(ReadPolicy policy, std::vector<uint8_t>& value) const
+{
+   if (policy == ReadPolicy::RADIO || (policy == ReadPolicy::CACHED_THEN_RADIO && !m_valid))
+      return false;
+   value = m_valid ? m_value : std::vector<uint8_t>();
+   return true;
+}
+
+
+bool CachedValue::ReadAsync(ReadPolicy policy, StatusCallback cb) const
+{
+   std::vector<uint8_t> value;
+   if (!Read(policy, value))
+      return false;
+
+   struct Answer
+   {
+      StatusCallback cb;
+      std::vector<uint8_t> value;
+      Bus::CallStatus status;
+   };
+   // Lambda doesn't work with a C callback that needs a user_data.
+   struct Callback {
+      static gboolean Run(gpointer user_data)
+      {
+         auto* answer = (Answer*)user_data;
+         answer->cb(answer->value, answer->status);
+         return G_SOURCE_REMOVE;
+      }
+      static void Free(gpointer user_data)
+      {
+         delete (Answer*)user_data;
+      }
+   };
+   auto status = m_valid ? Bus::CallStatus::OK : Bus::CallStatus::FAILED;
+   GSource* source = g_idle_source_new();
+   g_source_set_callback(source, &Callback::Run, new Answer{std::move(cb), std::move(value), status}, &Callback::Free);
+   g_source_attach(source, g_main_context_get_thread_default());
+   g_source_unref(source);
+   return true;
+}
+
+
+void CachedValue::OnPropertiesChanged(GVariant* changed, GVariant* invalidated)
+{
+   GVariant* value = g_variant_lookup_value(changed, VALUE, G_VARIANT_TYPE_BYTESTRING);
+   if (value)
+   {
+      gsize length = 0;
+      auto* data = (const uint8_t*)g_variant_get_fixed_array(value, &length, sizeof(guint8));
+      m_value.assign(data, data + length);
+      m_valid = true;
+      g_variant_unref(value);
+   }
+
+   if (!invalidated)
+      return;
+   GVariantIter it;
+   g_variant_iter_init(&it, invalidated);
+   const gchar* name{};
+   while (g_variant_iter_next(&it, "&s", &name))
+   {
+      if (g_str_equal(name, VALUE))
+      {
+         m_valid = false;
+         m_value.clear();
+      }
+   }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Bus.hh"
+#include "ByteView.hh"
+
+namespace asha
+{
+
+// Where reads get their values from.
+enum class ReadPolicy
+{
+   // Only ever from the Value bluez has cached. Anything it hasn't got
+   // fails without going near the device.
+   CACHED,
+   // From the cache when bluez has a value, from the device when it hasn't.
+   CACHED_THEN_RADIO,
+   // Always ReadValue, which goes to the device.
+   RADIO,
+};
+
+// "cached", "cached-then-radio" or "radio". Returns false on anything else.
+bool ParseReadPolicy(const std::string& s, ReadPolicy& policy);
+
+
+// The Value property bluez keeps for a characteristic or descriptor, which
+// it fills in whenever it reads the attribute or gets notified of it, and
+// publishes in GetManagedObjects and PropertiesChanged. It starts out with
+// whatever the GATT table had, and follows PropertiesChanged from there.
+class CachedValue final
+{
+public:
+   typedef std::function<void(const std::vector<uint8_t>&, Bus::CallStatus)> StatusCallback;
+
+   // value is null when bluez hasn't got one yet. interface is the bluez
+   // interface of the object at path, which has to outlive us.
+   CachedValue(const std::shared_ptr<Bus>& bus, const std::string& path, const char* interface, const ByteView* value);
+   ~CachedValue();
+
+   CachedValue(const CachedValue&) = delete;
+   CachedValue& operator=(const CachedValue&) = delete;
+
+   // A second one, watching the same object.
+   std::unique_ptr<CachedValue> Clone() const;
+
+   bool Valid() const { return m_valid; }
+   const std::vector<uint8_t>& Value() const { return m_value; }
+
+   // Answer a read without a round trip, if policy says the cache can.
+   // Returns false if the read has to go to the device, and otherwise sets
+   // value, which is left empty if the cache had nothing.
+   bool Read(ReadPolicy policy, std::vector<uint8_t>& value) const;
+   // Same, but the answer goes to cb from the calling thread's main loop
+   // rather than before this returns, the way a ReadValue reply would.
+   bool ReadAsync(ReadPolicy policy, StatusCallback cb) const;
+
+private:
+   void OnPropertiesChanged(struct _GVariant* changed, struct _GVariant* invalidated);
+
+   std::shared_ptr<Bus> m_bus;
+   std::string m_path;
+   const char* m_interface;
+   uint64_t m_watch_id = 0;
+   bool m_valid = false;
+   std::vector<uint8_t> m_value;
+};
+
+}
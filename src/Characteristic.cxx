@@ -1,6 +1,10 @@
 #include "Characteristic.hh"
+#include "GattTable.hh"
 #include "GVariantDump.hh"
+#include "Latency.hh"
+#include "Metrics.hh"
 
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
@@ -16,30 +20,54 @@ namespace
    constexpr char WRITE_VALUE[] = "WriteValue";
    constexpr char START_NOTIFY[] = "StartNotify";
    constexpr char STOP_NOTIFY[] = "StopNotify";
+   constexpr char ACQUIRE_NOTIFY[] = "AcquireNotify";
+   constexpr char ACQUIRE_WRITE[] = "AcquireWrite";
+
+   // Sorted by name, which is the order FlagNames() gives them back in.
+   const struct
+   {
+      const char* name;
+      Characteristic::Flag flag;
+   } FLAG_NAMES[] = {
+      {"authenticated-signed-writes",    Characteristic::AUTHENTICATED_SIGNED_WRITES},
+      {"authorize",                      Characteristic::AUTHORIZE},
+      {"broadcast",                      Characteristic::BROADCAST},
+      {"encrypt-authenticated-indicate", Characteristic::ENCRYPT_AUTHENTICATED_INDICATE},
+      {"encrypt-authenticated-notify",   Characteristic::ENCRYPT_AUTHENTICATED_NOTIFY},
+      {"encrypt-authenticated-read",     Characteristic::ENCRYPT_AUTHENTICATED_READ},
+      {"encrypt-authenticated-write",    Characteristic::ENCRYPT_AUTHENTICATED_WRITE},
+      {"encrypt-indicate",               Characteristic::ENCRYPT_INDICATE},
+      {"encrypt-notify",                 Characteristic::ENCRYPT_NOTIFY},
+      {"encrypt-read",                   Characteristic::ENCRYPT_READ},
+      {"encrypt-write",                  Characteristic::ENCRYPT_WRITE},
+      {"extended-properties",            Characteristic::EXTENDED_PROPERTIES},
+      {"indicate",                       Characteristic::INDICATE},
+      {"notify",                         Characteristic::NOTIFY},
+      {"read",                           Characteristic::READ},
+      {"reliable-write",                 Characteristic::RELIABLE_WRITE},
+      {"secure-indicate",                Characteristic::SECURE_INDICATE},
+      {"secure-notify",                  Characteristic::SECURE_NOTIFY},
+      {"secure-read",                    Characteristic::SECURE_READ},
+      {"secure-write",                   Characteristic::SECURE_WRITE},
+      {"writable-auxiliaries",           Characteristic::WRITABLE_AUXILIARIES},
+      {"write",                          Characteristic::WRITE},
+      {"write-without-response",         Characteristic::WRITE_WITHOUT_RESPONSE},
+   };
 }
 
 
-Characteristic::Characteristic(const std::string& path, struct _GVariantIter* properties):
-   m_path(path)
+Characteristic::Characteristic(const GattCharacteristic& c, const std::shared_ptr<Bus>& bus, ReadPolicy policy):
+   m_bus(bus),
+   m_uuid(c.UUID()),
+   m_flags(c.Flags()),
+   m_path(c.Path()),
+   m_can_acquire_notify(c.CanAcquireNotify()),
+   m_can_acquire_write(c.CanAcquireWrite())
 {
-   gchar* key{};
-   GVariant* value{};
-   while (g_variant_iter_loop(properties, "{sv}", &key, &value))
-   {
-      if (g_str_equal("UUID", key))
-         m_uuid = g_variant_get_string(value, nullptr);
-      else if (g_str_equal("Flags", key))
-      {
-         gsize n = g_variant_n_children(value);
-         for (size_t i = 0; i < n; ++i)
-         {
-            std::shared_ptr<GVariant> v(g_variant_get_child_value(value, i), g_variant_unref);
-            m_flags.insert(g_variant_get_string(v.get(), nullptr));
-         }
-      }
-      else if (g_str_equal("Service", key))
-         m_service_path = g_variant_get_string(value, nullptr);
-   }
+   if (policy == ReadPolicy::RADIO)
+      return;
+   ByteView value = c.Value();
+   m_cached.reset(new asha::CachedValue(m_bus, m_path, CHARACTERISTIC_INTERFACE, c.HasValue() ? &value : nullptr));
 }
 
 Characteristic::~Characteristic()
@@ -47,19 +75,115 @@ Characteristic::~Characteristic()
    StopNotify();
 }
 
-Characteristic& Characteristic::operator=(const Characteristic& o)
+Characteristic& Characteristic::operator=(Characteristic&& o)
 {
+   if (this == &o)
+      return *this;
    StopNotify();
-   m_char.reset();
+   m_bus = std::move(o.m_bus);
    m_uuid = o.m_uuid;
-   m_path = o.m_path;
    m_flags = o.m_flags;
-   m_service_path = o.m_service_path;
+   m_path = std::move(o.m_path);
+   m_can_acquire_notify = o.m_can_acquire_notify;
+   m_can_acquire_write = o.m_can_acquire_write;
+   m_write_socket = std::move(o.m_write_socket);
+   m_cached = std::move(o.m_cached);
+   m_notify = std::move(o.m_notify);
    return *this;
 }
 
+Characteristic Characteristic::Clone() const
+{
+   Characteristic c;
+   c.m_bus = m_bus;
+   c.m_uuid = m_uuid;
+   c.m_flags = m_flags;
+   c.m_path = m_path;
+   c.m_can_acquire_notify = m_can_acquire_notify;
+   c.m_can_acquire_write = m_can_acquire_write;
+   if (m_cached)
+      c.m_cached = m_cached->Clone();
+   return c;
+}
+
+
+std::vector<const char*> Characteristic::FlagNames(uint32_t flags)
+{
+   std::vector<const char*> ret;
+   for (auto& f: FLAG_NAMES)
+      if (flags & f.flag)
+         ret.push_back(f.name);
+   return ret;
+}
+
+
+uint32_t Characteristic::ParseFlags(GVariant* flags)
+{
+   uint32_t ret = 0;
+   GVariantIter it;
+   g_variant_iter_init(&it, flags);
+   const gchar* flag{};
+   while (g_variant_iter_next(&it, "&s", &flag))
+   {
+      for (auto& f: FLAG_NAMES)
+      {
+         if (strcmp(f.name, flag) == 0)
+         {
+            ret |= f.flag;
+            break;
+         }
+      }
+   }
+   return ret;
+}
+
+
+std::vector<uint8_t> Characteristic::Read(ReadPolicy policy)
+{
+   std::vector<uint8_t> value;
+   auto* cached = Cached(policy);
+   if (cached && cached->Read(policy, value))
+      return value;
+   return ReadResult(m_path, Call(READ_VALUE, ReadArgs()));
+}
+
+void Characteristic::ReadAsync(ReadCallback cb, ReadPolicy policy)
+{
+   auto* cached = Cached(policy);
+   if (cached && cached->ReadAsync(policy, [cb](const std::vector<uint8_t>& value, Bus::CallStatus) { cb(value); }))
+      return;
+   std::string path = m_path;
+   CallAsync(READ_VALUE, ReadArgs(), [path, cb](const std::shared_ptr<GVariant>& result) {
+      cb(ReadResult(path, result));
+   });
+}
+
+void Characteristic::ReadAsync(int timeout_ms, ReadStatusCallback cb, ReadPolicy policy)
+{
+   auto* cached = Cached(policy);
+   if (cached && cached->ReadAsync(policy, cb))
+      return;
+   if (!m_bus)
+   {
+      cb(std::vector<uint8_t>(), Bus::CallStatus::FAILED);
+      return;
+   }
+   std::string path = m_path;
+   m_bus->CallAsync(m_path, CHARACTERISTIC_INTERFACE, READ_VALUE, ReadArgs(), timeout_ms, [path, cb](const std::shared_ptr<GVariant>& result, Bus::CallStatus status) {
+      cb(ReadResult(path, result), status);
+   });
+}
+
+asha::CachedValue* Characteristic::Cached(ReadPolicy policy)
+{
+   if (policy == ReadPolicy::RADIO)
+      return nullptr;
+   if (!m_cached)
+      m_cached.reset(new asha::CachedValue(m_bus, m_path, CHARACTERISTIC_INTERFACE, nullptr));
+   return m_cached.get();
+}
 
-std::vector<uint8_t> Characteristic::Read()
+std::shared_ptr<_GVariant> Characteristic::ReadArgs()
 {
    // Args needs to be a tuple containing dict options. (dbus dicts are arrays
    // of key/value pairs).
@@ -75,15 +199,17 @@ std::vector<uint8_t> Characteristic::Read()
    // reference", and be prepared to get very, very angry.
    g_variant_ref_sink(args.get());
 
-   GError* e = nullptr;
-   auto result = Call(READ_VALUE, args);
+   return args;
+}
 
+std::vector<uint8_t> Characteristic::ReadResult(const std::string& path, const std::shared_ptr<_GVariant>& result)
+{
    if (!result)
       return {};
 
    if (!g_variant_check_format_string(result.get(), "(ay)", false))
    {
-      g_warning("Incorrect type signature when reading %s: %s", m_path.c_str(), g_variant_get_type_string(result.get()));
+      g_warning("Incorrect type signature when reading %s: %s", path.c_str(), g_variant_get_type_string(result.get()));
       return {};
    }
 
@@ -91,15 +217,7 @@ std::vector<uint8_t> Characteristic::Read()
    std::shared_ptr<GVariant> ay(g_variant_get_child_value(result.get(), 0), g_variant_unref);
    guint8* data = (guint8*)g_variant_get_fixed_array(ay.get(), &length, sizeof(guint8));
 
-
-   std::vector<uint8_t> ret(data, data + length);
-
-   ay.reset();
-   result.reset();
-   args.reset();
-
-
-   return ret;
+   return std::vector<uint8_t>(data, data + length);
 }
 
 bool Characteristic::Write(const std::vector<uint8_t>& bytes)
@@ -135,6 +253,18 @@ bool Characteristic::Write(const std::vector<uint8_t>& bytes)
 
 bool Characteristic::Command(const std::vector<uint8_t>& bytes)
 {
+   if (m_write_socket)
+   {
+      if (m_write_socket->Write(ByteView(bytes)))
+         return true;
+      if (!m_write_socket->Closed())
+         return false;
+      // bluez closes the socket on reconnect. Go back to dbus calls until
+      // somebody acquires a new one.
+      g_info("Write socket closed for %s", m_path.c_str());
+      m_write_socket.reset();
+   }
+
    // Args is a tuple containing a byte aray and the dict options.
    GVariantBuilder b = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a{sv}"));
    g_variant_builder_add(&b, "{sv}", "offset", g_variant_new_uint16(0));
@@ -164,8 +294,35 @@ bool Characteristic::Command(const std::vector<uint8_t>& bytes)
    return true;
 }
 
-bool Characteristic::Notify(std::function<void(const std::vector<uint8_t>&)> fn)
+bool Characteristic::Notify(NotifyCallback fn)
 {
+   return Notify(NotifyViewCallback([fn](ByteView v) { fn(v.ToVector()); }));
+}
+
+
+bool Characteristic::Notify(NotifyViewCallback fn, NotifyMode mode)
+{
+   if (!m_bus)
+      return false;
+   // A second subscription replaces the first, rather than leaving its watch
+   // behind to call the new callback as well.
+   StopNotify();
+   m_notify = std::make_shared<Subscription>();
+   Subscription* notify = m_notify.get();
+   if (latency::Enabled())
+      notify->latency = latency::ForPath(m_path);
+   if (metrics::Enabled())
+      notify->counters = metrics::ForCharacteristic(m_path);
+
+   if (mode == NotifyMode::Socket && m_can_acquire_notify)
+   {
+      notify->callback = std::move(fn);
+      if (AcquireNotify())
+         return true;
+      fn = std::move(notify->callback);
+      g_info("AcquireNotify unavailable for %s, falling back to StartNotify", m_path.c_str());
+   }
+
    // No args for the dbus call.
 
    GError* e = nullptr;
@@ -180,127 +337,133 @@ bool Characteristic::Notify(std::function<void(const std::vector<uint8_t>&)> fn)
       return false;
    }
 
-   // lambda doesn't work here for some reason.
-   struct Call
-   {
-      static void Back(GDBusProxy* self, GVariant* changed_properties, char** invalidated_properties, gpointer user_data)
+   notify->callback = std::move(fn);
+   // The handler belongs to the bus, so it can't outlive it.
+   Bus* bus = m_bus.get();
+   std::weak_ptr<Subscription> weak = m_notify;
+   notify->watch_id = m_bus->WatchProperties(m_path, [weak, bus](const char* path, const char* interface, GVariant* changed_properties, GVariant* invalidated) {
+      if (!g_str_equal(CHARACTERISTIC_INTERFACE, interface))
+         return;
+      // The callback is allowed to stop the subscription, so hold onto it
+      // until the callback has returned.
+      auto notify = weak.lock();
+      if (!notify)
+         return;
+
+      GVariant* value = g_variant_lookup_value(changed_properties, "Value", G_VARIANT_TYPE_BYTESTRING);
+      if (!value)
       {
-         std::stringstream ss;
-         ss << changed_properties;
-         auto* characteristic = (Characteristic*)user_data;
-         // g_info("Property %s notified: %s", characteristic->m_uuid.c_str(), ss.str().c_str());
-         
-         if (!g_variant_check_format_string(changed_properties, "a{sv}", false))
-         {
-            g_warning("Incorrect type signature when changed property %s: %s", characteristic->m_path.c_str(), g_variant_get_type_string(changed_properties));
-            return;
-         }
+         // I don't think this is an error, but it isn't what we are
+         // watching for.
+         return;
+      }
 
-         GVariant* value = g_variant_lookup_value(changed_properties, "Value", G_VARIANT_TYPE_BYTESTRING);
-         if (!value)
-         {
-            // I don't think this is an error, but it isn't what we are
-            // watching for.
-            return;
-         }
-         std::shared_ptr<GVariant> pvalue(value, g_variant_unref);
+      // This is the hot path, so the reference gets dropped by hand rather
+      // than paying for a shared_ptr control block on every notification.
+      gsize length = 0;
+      const guint8* data = (const guint8*)g_variant_get_fixed_array(value, &length, sizeof(guint8));
+      NotifyLatency* recorder = notify->latency;
+      if (notify->counters)
+         notify->counters->Record(length);
+      int64_t entered = recorder ? latency::Now() : 0;
+      notify->callback(ByteView(data, length));
+      if (recorder)
+         recorder->Record(bus->SignalArrived(), entered, latency::Now());
+      g_variant_unref(value);
+   });
+   return true;
+}
 
-         if (!g_variant_check_format_string(value, "ay", false))
-         {
-            g_warning("Changed Value is not a byte array for %s: %s", characteristic->m_path.c_str(), g_variant_get_type_string(value));
-            return;
-         }
 
-         gsize length = 0;
-         const guint8* data = (const guint8*)g_variant_get_fixed_array(value, &length, sizeof(guint8));
+bool Characteristic::AcquireNotify()
+{
+   uint16_t mtu = 0;
+   int fd = m_bus->Acquire(m_path, CHARACTERISTIC_INTERFACE, ACQUIRE_NOTIFY, mtu);
+   if (fd < 0)
+      return false;
 
-         std::vector<uint8_t> ret(data, data + length);
-         characteristic->m_notify_callback(std::vector<uint8_t>(data, data + length));
+   Subscription* notify = m_notify.get();
+   std::weak_ptr<Subscription> weak = m_notify;
+   std::string path = m_path;
+   notify->socket = std::make_shared<GattSocket>(fd, mtu);
+   notify->socket->StartReading(
+      [weak](ByteView v) {
+         // Held, like the signal handler does, in case the callback stops
+         // the subscription.
+         auto notify = weak.lock();
+         if (!notify)
+            return;
+         // No signal to have waited behind, so only the callback gets timed.
+         NotifyLatency* recorder = notify->latency;
+         if (notify->counters)
+            notify->counters->Record(v.size());
+         int64_t entered = recorder ? latency::Now() : 0;
+         notify->callback(v);
+         if (recorder)
+            recorder->Record(0, entered, latency::Now());
+      },
+      [weak, path]() {
+         // bluez closes the socket when the device goes away. There is
+         // nothing to stop at that point.
+         g_info("Notification socket closed for %s", path.c_str());
+         auto notify = weak.lock();
+         if (notify)
+            notify->socket.reset();
       }
-   };
-
-   m_notify_callback = fn;
-   m_notify_handler_id = g_signal_connect(m_char.get(),
-      "g-properties-changed",
-      G_CALLBACK(&Call::Back),
-      this
    );
    return true;
 }
 
 
+bool Characteristic::AcquireWrite()
+{
+   if (m_write_socket && !m_write_socket->Closed())
+      return true;
+   if (!m_bus || !m_can_acquire_write)
+      return false;
+
+   uint16_t mtu = 0;
+   int fd = m_bus->Acquire(m_path, CHARACTERISTIC_INTERFACE, ACQUIRE_WRITE, mtu);
+   if (fd < 0)
+      return false;
+
+   m_write_socket = std::make_shared<GattSocket>(fd, mtu);
+   return true;
+}
+
+
 void Characteristic::StopNotify()
 {
+   if (!m_notify)
+      return;
+
+   // Closing the socket is how AcquireNotify subscriptions get stopped.
+   m_notify->socket.reset();
+
    // Unregister for any notifications.
-   if (m_char && m_notify_handler_id != -1)
+   if (m_bus && m_notify->watch_id)
    {
       Call(STOP_NOTIFY);
-      g_signal_handler_disconnect(m_char.get(), m_notify_handler_id);
+      m_bus->UnwatchProperties(m_notify->watch_id);
    }
+   m_notify.reset();
 }
 
 
-void Characteristic::CreateProxyIfNotAlreadyCreated() noexcept
+std::shared_ptr<_GVariant> Characteristic::Call(const char* fname, const std::shared_ptr<_GVariant>& args) noexcept
 {
-   // What a great function name!
-   if (m_char) return;
-
-   GError* err = nullptr;
-   m_char.reset(g_dbus_proxy_new_for_bus_sync(
-      G_BUS_TYPE_SYSTEM,
-      G_DBUS_PROXY_FLAGS_NONE,
-      nullptr,
-      "org.bluez",
-      m_path.c_str(),
-      CHARACTERISTIC_INTERFACE,
-      nullptr,
-      &err
-   ), g_object_unref);
-
-   if (err)
-   {
-      g_error("Error getting dbus %s proxy: %s", CHARACTERISTIC_INTERFACE, err->message);
-      g_error_free(err);
-      m_char.reset();
-      return;
-   }
+   if (!m_bus)
+      return nullptr;
+   return m_bus->Call(m_path, CHARACTERISTIC_INTERFACE, fname, args);
 }
 
 
-std::shared_ptr<_GVariant> Characteristic::Call(const char* fname, const std::shared_ptr<_GVariant>& args) noexcept
+void Characteristic::CallAsync(const char* fname, const std::shared_ptr<_GVariant>& args, CallCallback cb) noexcept
 {
-   CreateProxyIfNotAlreadyCreated();
-
-   if (m_char)
+   if (!m_bus)
    {
-      GError* e = nullptr;
-      // Cannot directly capture result into a shared_ptr because the shared_ptr
-      // will happily delete a null pointer, which g_variant_unref does not like.
-      GVariant* result = g_dbus_proxy_call_sync(m_char.get(),
-         fname,
-         args.get(),
-         G_DBUS_CALL_FLAGS_NONE,
-         -1,
-         nullptr,
-         &e
-      );
-      if (e)
-      {
-         g_info("Error calling %s: %s", fname, e->message);
-         g_error_free(e);
-         return nullptr;
-      }
-      if (result)
-      {
-         // Convert from floating reference to a full reference.
-         // g_variant_ref_sink(result);
-         return std::shared_ptr<GVariant>(result, g_variant_unref);
-      }
-      else
-      {
-         g_warning("Null result when calling %s", fname);
-      }
+      cb(nullptr);
+      return;
    }
-
-   return nullptr;
+   m_bus->CallAsync(m_path, CHARACTERISTIC_INTERFACE, fname, args, std::move(cb));
 }
@@ -5,17 +5,22 @@
 #include <memory>
 #include <string>
 #include <vector>
-#include <set>
 
-#include "Descriptor.hh"
+#include "Bus.hh"
+#include "ByteView.hh"
+#include "CachedValue.hh"
+#include "GattSocket.hh"
+#include "Uuid.hh"
 
-struct _GDBusProxy;
-struct _GVariantIter;
 struct _GVariant;
 
 namespace asha
 {
 
+class GattCharacteristic;
+class NotifyCounters;
+class NotifyLatency;
+
 static constexpr char CHARACTERISTIC_INTERFACE[] = "org.bluez.GattCharacteristic1";
 
 
@@ -23,50 +28,151 @@ static constexpr char CHARACTERISTIC_INTERFACE[] = "org.bluez.GattCharacteristic
 class Characteristic final
 {
 public:
+   typedef std::function<void(const std::vector<uint8_t>&)> ReadCallback;
+   typedef std::function<void(const std::vector<uint8_t>&, Bus::CallStatus)> ReadStatusCallback;
+   typedef std::function<void(const std::vector<uint8_t>&)> NotifyCallback;
+   typedef std::function<void(ByteView)> NotifyViewCallback;
+
+   // The Flags property, one bit per flag that bluez knows about.
+   enum Flag : uint32_t
+   {
+      BROADCAST                      = 1u << 0,
+      READ                           = 1u << 1,
+      WRITE_WITHOUT_RESPONSE         = 1u << 2,
+      WRITE                          = 1u << 3,
+      NOTIFY                         = 1u << 4,
+      INDICATE                       = 1u << 5,
+      AUTHENTICATED_SIGNED_WRITES    = 1u << 6,
+      EXTENDED_PROPERTIES            = 1u << 7,
+      RELIABLE_WRITE                 = 1u << 8,
+      WRITABLE_AUXILIARIES           = 1u << 9,
+      ENCRYPT_READ                   = 1u << 10,
+      ENCRYPT_WRITE                  = 1u << 11,
+      ENCRYPT_NOTIFY                 = 1u << 12,
+      ENCRYPT_INDICATE               = 1u << 13,
+      ENCRYPT_AUTHENTICATED_READ     = 1u << 14,
+      ENCRYPT_AUTHENTICATED_WRITE    = 1u << 15,
+      ENCRYPT_AUTHENTICATED_NOTIFY   = 1u << 16,
+      ENCRYPT_AUTHENTICATED_INDICATE = 1u << 17,
+      SECURE_READ                    = 1u << 18,
+      SECURE_WRITE                   = 1u << 19,
+      SECURE_NOTIFY                  = 1u << 20,
+      SECURE_INDICATE                = 1u << 21,
+      AUTHORIZE                      = 1u << 22,
+   };
+
+   enum class NotifyMode
+   {
+      // StartNotify, with values delivered through PropertiesChanged.
+      Signal,
+      // AcquireNotify, reading values straight from a socket. Falls back to
+      // Signal if bluez or the characteristic doesn't support it.
+      Socket,
+   };
+
    Characteristic() {}
-   Characteristic(const std::string& path, struct _GVariantIter* properties);
+   // policy is what reads are going to use. Anything but RADIO follows the
+   // Value bluez has cached, which costs a watch on the bus of its own.
+   Characteristic(const GattCharacteristic& c, const std::shared_ptr<Bus>& bus, ReadPolicy policy = ReadPolicy::RADIO);
    ~Characteristic();
 
-   Characteristic& operator=(const Characteristic& o);
+   // Subscriptions and sockets can only have one owner, so these move but
+   // don't copy. Use Clone() for a second, unsubscribed, object.
+   Characteristic(Characteristic&& o) = default;
+   Characteristic& operator=(Characteristic&& o);
+   Characteristic(const Characteristic&) = delete;
+   Characteristic& operator=(const Characteristic&) = delete;
 
-   const std::string& Path() const { return m_path; }
-   const std::string& UUID() const { return m_uuid; }
-   const std::set<std::string>& Flags() const { return m_flags; }
-   const std::string& Service() const { return m_service_path; }
-   std::vector<Descriptor>& Descriptors() { return m_descriptors; }
+   Characteristic Clone() const;
 
-   // Read the given Gatt characteristic.
-   std::vector<uint8_t> Read();
+   const std::string& Path() const { return m_path; }
+   const Uuid& UUID() const { return m_uuid; }
+   uint32_t Flags() const { return m_flags; }
+   bool HasFlag(Flag f) const { return (m_flags & f) != 0; }
+   // The bluez names of the flags that are set, in alphabetical order.
+   std::vector<const char*> FlagNames() const { return FlagNames(m_flags); }
+   static std::vector<const char*> FlagNames(uint32_t flags);
+   // Turn the Flags property (as) into Flag bits. Any flag newer than this
+   // code gets left out.
+   static uint32_t ParseFlags(struct _GVariant* flags);
+
+   // Read the given Gatt characteristic, from the device or from the value
+   // bluez has cached for it, as policy allows.
+   std::vector<uint8_t> Read(ReadPolicy policy = ReadPolicy::RADIO);
+   // Read the given Gatt characteristic without blocking. The callback gets
+   // called from the main loop with the value, or an empty vector on error.
+   void ReadAsync(ReadCallback cb, ReadPolicy policy = ReadPolicy::RADIO);
+   // Same, but gives up after timeout_ms, and says how the read went.
+   void ReadAsync(int timeout_ms, ReadStatusCallback cb, ReadPolicy policy = ReadPolicy::RADIO);
+   // Whether bluez has a value cached, which reads that allow it get
+   // without a round trip.
+   bool HasCachedValue() const { return m_cached && m_cached->Valid(); }
+   const std::vector<uint8_t>& CachedValue() const { return m_cached->Value(); }
    // Write to the given Gatt characteristic.
    bool Write(const std::vector<uint8_t>& bytes);
    // Command the given Gatt characteristic.
    bool Command(const std::vector<uint8_t>& bytes);
+   // Send Commands through a socket from AcquireWrite rather than a dbus call
+   // each. Returns false if bluez won't hand one out, in which case Command
+   // keeps using WriteValue. With the socket, Command doesn't block, and
+   // returns false when the socket is backed up.
+   bool AcquireWrite();
    // When the given Gatt characteristic is notified, call the given function.
-   bool Notify(std::function<void(const std::vector<uint8_t>&)> fn);
+   bool Notify(NotifyCallback fn);
+   // Same as above, but the callback gets a view straight into the signal
+   // data, so the value doesn't get copied into a vector of its own.
+   // Calling either one again stops the subscription there was first.
+   bool Notify(NotifyViewCallback fn, NotifyMode mode = NotifyMode::Signal);
    void StopNotify();
+   // Whether a Notify succeeded, and nothing has stopped it since.
+   bool Notifying() const { return m_notify && (m_notify->watch_id || m_notify->socket); }
 
-   void AddDescriptor(const Descriptor& d) { m_descriptors.push_back(d); }
-
-   operator bool() const { return !m_uuid.empty(); }
+   operator bool() const { return !m_uuid.IsNull(); }
 
 protected:
-   void CreateProxyIfNotAlreadyCreated() noexcept;
+   bool AcquireNotify();
 
+   typedef Bus::CallCallback CallCallback;
    std::shared_ptr<_GVariant> Call(const char* fname, const std::shared_ptr<_GVariant>& args = nullptr) noexcept;
+   void CallAsync(const char* fname, const std::shared_ptr<_GVariant>& args, CallCallback cb) noexcept;
+
+   static std::shared_ptr<_GVariant> ReadArgs();
+   static std::vector<uint8_t> ReadResult(const std::string& path, const std::shared_ptr<_GVariant>& result);
+   // Null for RADIO. Otherwise the cached value, which gets made now, empty,
+   // if the constructor wasn't told that reads would want it.
+   asha::CachedValue* Cached(ReadPolicy policy);
 
 private:
-   std::shared_ptr<_GDBusProxy> m_char;
+   std::shared_ptr<Bus> m_bus;
    
-   std::string m_uuid;
+   Uuid m_uuid;
+   uint32_t m_flags = 0;
    std::string m_path;
-   std::string m_service_path;
-
-   std::set<std::string> m_flags;
-
-   std::vector<Descriptor> m_descriptors;
 
-   unsigned long m_notify_handler_id = -1;
-   std::function<void(const std::vector<uint8_t>&)> m_notify_callback;
+   // bluez only publishes NotifyAcquired and WriteAcquired for
+   // characteristics that it will hand out a socket for.
+   bool m_can_acquire_notify = false;
+   bool m_can_acquire_write = false;
+   std::shared_ptr<GattSocket> m_write_socket;
+   // On the heap, since it watches the bus on its own behalf. Null unless
+   // reads may use bluez's cached Value.
+   std::unique_ptr<asha::CachedValue> m_cached;
+
+   // Everything the notification callbacks need, kept on the heap so that
+   // they don't hold onto this object, which may get moved.
+   struct Subscription
+   {
+      NotifyViewCallback callback;
+      uint64_t watch_id = 0;
+      std::shared_ptr<GattSocket> socket;
+      // Null unless latency recording or metrics are on. Never freed, so
+      // they are still good if the callback stops the subscription.
+      NotifyLatency* latency = nullptr;
+      NotifyCounters* counters = nullptr;
+   };
+   // Shared, so that a handler can hold onto it while the callback runs,
+   // even if the callback stops the subscription.
+   std::shared_ptr<Subscription> m_notify;
 };
 
 }
\ No newline at end of file
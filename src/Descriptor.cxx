@@ -1,4 +1,5 @@
 #include "Descriptor.hh"
+#include "GattTable.hh"
 #include "GVariantDump.hh"
 
 #include <iostream>
@@ -13,37 +14,79 @@
 using namespace asha;
 
 
-Descriptor::Descriptor(const std::string& path, GVariantIter* properties):
-   m_path(path)
+Descriptor::Descriptor(const GattDescriptor& d, const std::shared_ptr<Bus>& bus, ReadPolicy policy):
+   m_bus(bus),
+   m_uuid(d.UUID()),
+   m_path(d.Path())
 {
-   gchar* key{};
-   GVariant* value{};
-   while (g_variant_iter_loop(properties, "{sv}", &key, &value))
-   {
-      if (g_str_equal("UUID", key))
-         m_uuid = g_variant_get_string(value, nullptr);
-      else if (g_str_equal("Characteristic", key))
-         m_char_path = g_variant_get_string(value, nullptr);
-      // else if (g_str_equal("Value", key))
-      //    g_info("Descriptor::Value is %s", GVariantDump(value).c_str());
-   }
+   if (policy == ReadPolicy::RADIO)
+      return;
+   ByteView value = d.Value();
+   m_cached.reset(new asha::CachedValue(m_bus, m_path, DESCRIPTOR_INTERFACE, d.HasValue() ? &value : nullptr));
 }
 
 Descriptor::~Descriptor()
 {
 }
 
-Descriptor& Descriptor::operator=(const Descriptor& o)
+Descriptor Descriptor::Clone() const
+{
+   Descriptor d;
+   d.m_bus = m_bus;
+   d.m_uuid = m_uuid;
+   d.m_path = m_path;
+   if (m_cached)
+      d.m_cached = m_cached->Clone();
+   return d;
+}
+
+
+std::vector<uint8_t> Descriptor::Read(ReadPolicy policy)
+{
+   std::vector<uint8_t> value;
+   auto* cached = Cached(policy);
+   if (cached && cached->Read(policy, value))
+      return value;
+   return ReadResult(m_path, Call("ReadValue", ReadArgs()));
+}
+
+void Descriptor::ReadAsync(ReadCallback cb, ReadPolicy policy)
+{
+   auto* cached = Cached(policy);
+   if (cached && cached->ReadAsync(policy, [cb](const std::vector<uint8_t>& value, Bus::CallStatus) { cb(value); }))
+      return;
+   std::string path = m_path;
+   CallAsync("ReadValue", ReadArgs(), [path, cb](const std::shared_ptr<GVariant>& result) {
+      cb(ReadResult(path, result));
+   });
+}
+
+void Descriptor::ReadAsync(int timeout_ms, ReadStatusCallback cb, ReadPolicy policy)
 {
-   m_desc.reset();
-   m_uuid = o.m_uuid;
-   m_path = o.m_path;
-   m_char_path = o.m_char_path;
-   return *this;
+   auto* cached = Cached(policy);
+   if (cached && cached->ReadAsync(policy, cb))
+      return;
+   if (!m_bus)
+   {
+      cb(std::vector<uint8_t>(), Bus::CallStatus::FAILED);
+      return;
+   }
+   std::string path = m_path;
+   m_bus->CallAsync(m_path, DESCRIPTOR_INTERFACE, "ReadValue", ReadArgs(), timeout_ms, [path, cb](const std::shared_ptr<GVariant>& result, Bus::CallStatus status) {
+      cb(ReadResult(path, result), status);
+   });
 }
 
+asha::CachedValue* Descriptor::Cached(ReadPolicy policy)
+{
+   if (policy == ReadPolicy::RADIO)
+      return nullptr;
+   if (!m_cached)
+      m_cached.reset(new asha::CachedValue(m_bus, m_path, DESCRIPTOR_INTERFACE, nullptr));
+   return m_cached.get();
+}
 
-std::vector<uint8_t> Descriptor::Read()
+std::shared_ptr<_GVariant> Descriptor::ReadArgs()
 {
    // Args needs to be a tuple containing dict options. (dbus dicts are arrays
    // of key/value pairs).
@@ -59,15 +102,17 @@ std::vector<uint8_t> Descriptor::Read()
    // reference", and be prepared to get very, very angry.
    g_variant_ref_sink(args.get());
 
-   GError* e = nullptr;
-   auto result = Call("ReadValue", args);
+   return args;
+}
 
+std::vector<uint8_t> Descriptor::ReadResult(const std::string& path, const std::shared_ptr<_GVariant>& result)
+{
    if (!result)
       return {};
 
    if (!g_variant_check_format_string(result.get(), "(ay)", false))
    {
-      g_warning("Incorrect type signature when reading %s: %s", m_path.c_str(), g_variant_get_type_string(result.get()));
+      g_warning("Incorrect type signature when reading %s: %s", path.c_str(), g_variant_get_type_string(result.get()));
       return {};
    }
 
@@ -75,15 +120,7 @@ std::vector<uint8_t> Descriptor::Read()
    std::shared_ptr<GVariant> ay(g_variant_get_child_value(result.get(), 0), g_variant_unref);
    guint8* data = (guint8*)g_variant_get_fixed_array(ay.get(), &length, sizeof(guint8));
 
-
-   std::vector<uint8_t> ret(data, data + length);
-
-   ay.reset();
-   result.reset();
-   args.reset();
-
-
-   return ret;
+   return std::vector<uint8_t>(data, data + length);
 }
 
 bool Descriptor::Write(const std::vector<uint8_t>& bytes)
@@ -117,67 +154,20 @@ bool Descriptor::Write(const std::vector<uint8_t>& bytes)
 }
 
 
-void Descriptor::CreateProxyIfNotAlreadyCreated() noexcept
+std::shared_ptr<_GVariant> Descriptor::Call(const char* fname, const std::shared_ptr<_GVariant>& args) noexcept
 {
-   // What a great function name!
-   if (m_desc) return;
-
-   GError* err = nullptr;
-   m_desc.reset(g_dbus_proxy_new_for_bus_sync(
-      G_BUS_TYPE_SYSTEM,
-      G_DBUS_PROXY_FLAGS_NONE,
-      nullptr,
-      "org.bluez",
-      m_path.c_str(),
-      "org.bluez.GattDescriptor1",
-      nullptr,
-      &err
-   ), g_object_unref);
-
-   if (err)
-   {
-      g_error("Error getting dbus %s proxy: %s", "org.bluez.GattDescriptor1", err->message);
-      g_error_free(err);
-      m_desc.reset();
-      return;
-   }
+   if (!m_bus)
+      return nullptr;
+   return m_bus->Call(m_path, DESCRIPTOR_INTERFACE, fname, args);
 }
 
 
-std::shared_ptr<_GVariant> Descriptor::Call(const char* fname, const std::shared_ptr<_GVariant>& args) noexcept
+void Descriptor::CallAsync(const char* fname, const std::shared_ptr<_GVariant>& args, CallCallback cb) noexcept
 {
-   CreateProxyIfNotAlreadyCreated();
-
-   if (m_desc)
+   if (!m_bus)
    {
-      GError* e = nullptr;
-      // Cannot directly capture result into a shared_ptr because the shared_ptr
-      // will happily delete a null pointer, which g_variant_unref does not like.
-      GVariant* result = g_dbus_proxy_call_sync(m_desc.get(),
-         fname,
-         args.get(),
-         G_DBUS_CALL_FLAGS_NONE,
-         -1,
-         nullptr,
-         &e
-      );
-      if (e)
-      {
-         g_info("Error calling %s: %s", fname, e->message);
-         g_error_free(e);
-         return nullptr;
-      }
-      if (result)
-      {
-         // Convert from floating reference to a full reference.
-         // g_variant_ref_sink(result);
-         return std::shared_ptr<GVariant>(result, g_variant_unref);
-      }
-      else
-      {
-         g_warning("Null result when calling %s", fname);
-      }
+      cb(nullptr);
+      return;
    }
-
-   return nullptr;
+   m_bus->CallAsync(m_path, DESCRIPTOR_INTERFACE, fname, args, std::move(cb));
 }
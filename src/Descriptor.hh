@@ -7,45 +7,77 @@
 #include <vector>
 #include <set>
 
-struct _GDBusProxy;
-struct _GVariantIter;
+#include "Bus.hh"
+#include "CachedValue.hh"
+#include "Uuid.hh"
+
 struct _GVariant;
 
 namespace asha
 {
 
+class GattDescriptor;
+
+static constexpr char DESCRIPTOR_INTERFACE[] = "org.bluez.GattDescriptor1";
+
+
 // Abstraction of gatt descriptor using dbus
 class Descriptor final
 {
 public:
+   typedef std::function<void(const std::vector<uint8_t>&)> ReadCallback;
+   typedef std::function<void(const std::vector<uint8_t>&, Bus::CallStatus)> ReadStatusCallback;
+
    Descriptor() {}
-   Descriptor(const std::string& path, struct _GVariantIter* properties);
+   // policy is what reads are going to use. Anything but RADIO follows the
+   // Value bluez has cached, which costs a watch on the bus of its own.
+   Descriptor(const GattDescriptor& d, const std::shared_ptr<Bus>& bus, ReadPolicy policy = ReadPolicy::RADIO);
    ~Descriptor();
 
-   Descriptor& operator=(const Descriptor& o);
+   // Moves but doesn't copy, like Characteristic. Use Clone() for a second
+   // object.
+   Descriptor(Descriptor&& o) = default;
+   Descriptor& operator=(Descriptor&& o) = default;
+   Descriptor(const Descriptor&) = delete;
+   Descriptor& operator=(const Descriptor&) = delete;
+
+   Descriptor Clone() const;
 
    const std::string& Path() const { return m_path; }
-   const std::string& UUID() const { return m_uuid; }
-   const std::string& Characteristic() const { return m_char_path; }
+   const Uuid& UUID() const { return m_uuid; }
 
-   // Read the given descriptor.
-   std::vector<uint8_t> Read();
+   // Read the given descriptor, from the device or from the value bluez has
+   // cached for it, as policy allows.
+   std::vector<uint8_t> Read(ReadPolicy policy = ReadPolicy::RADIO);
+   // Read the given descriptor without blocking. The callback gets called from
+   // the main loop with the value, or an empty vector on error.
+   void ReadAsync(ReadCallback cb, ReadPolicy policy = ReadPolicy::RADIO);
+   // Same, but gives up after timeout_ms, and says how the read went.
+   void ReadAsync(int timeout_ms, ReadStatusCallback cb, ReadPolicy policy = ReadPolicy::RADIO);
+   bool HasCachedValue() const { return m_cached && m_cached->Valid(); }
+   const std::vector<uint8_t>& CachedValue() const { return m_cached->Value(); }
    // Write to the given descriptor.
    bool Write(const std::vector<uint8_t>& bytes);
    
-   operator bool() const { return !m_uuid.empty(); }
+   operator bool() const { return !m_uuid.IsNull(); }
 
 protected:
-   void CreateProxyIfNotAlreadyCreated() noexcept;
-
+   typedef Bus::CallCallback CallCallback;
    std::shared_ptr<_GVariant> Call(const char* fname, const std::shared_ptr<_GVariant>& args = nullptr) noexcept;
+   void CallAsync(const char* fname, const std::shared_ptr<_GVariant>& args, CallCallback cb) noexcept;
+
+   static std::shared_ptr<_GVariant> ReadArgs();
+   static std::vector<uint8_t> ReadResult(const std::string& path, const std::shared_ptr<_GVariant>& result);
+   // Null for RADIO. Otherwise the cached value, which gets made now, empty,
+   // if the constructor wasn't told that reads would want it.
+   asha::CachedValue* Cached(ReadPolicy policy);
 
 private:
-   std::shared_ptr<_GDBusProxy> m_desc;
+   std::shared_ptr<Bus> m_bus;
    
-   std::string m_uuid;
+   Uuid m_uuid;
    std::string m_path;
-   std::string m_char_path;
+   std::unique_ptr<asha::CachedValue> m_cached;
 };
 
 }
\ No newline at end of file
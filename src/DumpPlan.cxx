@@ -0,0 +1,133 @@
+#include "DumpPlan.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+using namespace asha;
+
+namespace
+{
+   constexpr char GROUP[] = "Select";
+
+   std::string Upper(std::string s)
+   {
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return (char)toupper(c); });
+      return s;
+   }
+
+   // The list under key, or nothing if there isn't one.
+   std::vector<std::string> GetList(GKeyFile* file, const char* key)
+   {
+      std::vector<std::string> ret;
+      gsize length = 0;
+      std::shared_ptr<gchar*> list(g_key_file_get_string_list(file, GROUP, key, &length, nullptr), g_strfreev);
+      for (gsize i = 0; list && i < length; ++i)
+         ret.push_back(list.get()[i]);
+      return ret;
+   }
+}
+
+
+void DumpPlan::AddDevice(const std::string& mac)
+{
+   m_devices.insert(Upper(mac));
+}
+
+
+bool DumpPlan::Load(const std::string& file)
+{
+   std::shared_ptr<GKeyFile> keys(g_key_file_new(), g_key_file_free);
+   GError* err = nullptr;
+   if (!g_key_file_load_from_file(keys.get(), file.c_str(), G_KEY_FILE_NONE, &err))
+   {
+      g_warning("Unable to load %s: %s", file.c_str(), err->message);
+      g_error_free(err);
+      return false;
+   }
+   if (!g_key_file_has_group(keys.get(), GROUP))
+   {
+      g_warning("%s has no [%s] group", file.c_str(), GROUP);
+      return false;
+   }
+
+   for (auto& mac: GetList(keys.get(), "Devices"))
+      AddDevice(mac);
+
+   // Every UUID in the file has to make sense, rather than quietly selecting
+   // more than was asked for.
+   auto add_uuids = [&](const char* key, std::set<Uuid>& to) {
+      for (auto& s: GetList(keys.get(), key))
+      {
+         Uuid uuid = ParseUuid(s);
+         if (uuid.IsNull())
+         {
+            g_warning("%s: bad UUID in %s: %s", file.c_str(), key, s.c_str());
+            return false;
+         }
+         to.insert(uuid);
+      }
+      return true;
+   };
+   if (!add_uuids("Services", m_services) || !add_uuids("Characteristics", m_characteristics) || !add_uuids("SkipRead", m_skip_read))
+      return false;
+
+   if (g_key_file_has_key(keys.get(), GROUP, "Operations", nullptr))
+   {
+      uint32_t operations = 0;
+      for (auto& s: GetList(keys.get(), "Operations"))
+      {
+         uint32_t op = 0;
+         if (!ParseOperations(s, op))
+         {
+            g_warning("%s: bad operation: %s", file.c_str(), s.c_str());
+            return false;
+         }
+         operations |= op;
+      }
+      m_operations = operations;
+   }
+   return true;
+}
+
+
+Uuid DumpPlan::ParseUuid(const std::string& s)
+{
+   if (s.size() == 4 && std::all_of(s.begin(), s.end(), [](unsigned char c) { return isxdigit(c); }))
+      return Uuid::FromShort((uint16_t)strtoul(s.c_str(), nullptr, 16));
+   return Uuid::TryParse(s);
+}
+
+
+bool DumpPlan::ParseOperations(const std::string& s, uint32_t& operations)
+{
+   operations = 0;
+   size_t start = 0;
+   while (start <= s.size())
+   {
+      size_t end = s.find_first_of(",;", start);
+      if (end == std::string::npos)
+         end = s.size();
+      std::string name = s.substr(start, end - start);
+      if (name == "read")
+         operations |= READ;
+      else if (name == "notify")
+         operations |= NOTIFY;
+      else if (name == "descriptors")
+         operations |= DESCRIPTORS;
+      else if (!name.empty())
+         return false;
+      start = end + 1;
+   }
+   return true;
+}
+
+
+bool DumpPlan::WantsDevice(const std::string& mac) const
+{
+   return m_devices.empty() || m_devices.count(Upper(mac));
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Uuid.hh"
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+namespace asha
+{
+
+// What to dump: which devices, services and characteristics, and what to do
+// with each characteristic. Everything gets decided from the GATT table alone,
+// before any object is made or call issued, so that whatever isn't selected
+// costs nothing on the bus.
+//
+// Each kind of filter selects everything until something is added to it.
+class DumpPlan final
+{
+public:
+   enum Operation: uint32_t
+   {
+      READ = 1 << 0,          // Read characteristic values.
+      NOTIFY = 1 << 1,        // Subscribe to notifications.
+      DESCRIPTORS = 1 << 2,   // Read descriptors.
+      ALL = READ | NOTIFY | DESCRIPTORS,
+   };
+
+   void AddDevice(const std::string& mac);
+   void AddService(const Uuid& uuid) { m_services.insert(uuid); }
+   void AddCharacteristic(const Uuid& uuid) { m_characteristics.insert(uuid); }
+   // Never read characteristics with this UUID, whatever else is selected.
+   // Some devices disconnect when certain values are read.
+   void SkipRead(const Uuid& uuid) { m_skip_read.insert(uuid); }
+   void SetOperations(uint32_t operations) { m_operations = operations; }
+
+   // Adds whatever the [Select] group of a key file asks for:
+   //
+   //    [Select]
+   //    Devices=00:11:22:33:44:55;66:77:88:99:AA:BB
+   //    Services=fdf0
+   //    Characteristics=2a19;00008000-0000-1000-8000-00805f9b34fb
+   //    Operations=read;notify
+   //    SkipRead=2bdcaebe-8746-45df-a841-96b840980fb8
+   //
+   // Returns false, having logged why, if the file can't be used.
+   bool Load(const std::string& file);
+
+   // A full UUID, or four hex digits for a Bluetooth SIG assigned number.
+   // Gives back a null Uuid on anything else.
+   static Uuid ParseUuid(const std::string& s);
+   // "read", "notify" and "descriptors", separated by commas or semicolons.
+   // Returns false on anything else.
+   static bool ParseOperations(const std::string& s, uint32_t& operations);
+
+   bool WantsDevice(const std::string& mac) const;
+   bool WantsService(const Uuid& uuid) const { return m_services.empty() || m_services.count(uuid); }
+   bool WantsCharacteristic(const Uuid& uuid) const { return m_characteristics.empty() || m_characteristics.count(uuid); }
+   // What to do with the characteristics that are selected.
+   bool Wants(Operation operation) const { return (m_operations & operation) != 0; }
+   bool WantsRead(const Uuid& characteristic) const { return Wants(READ) && !m_skip_read.count(characteristic); }
+
+private:
+   std::set<std::string> m_devices;   // Upper case.
+   std::set<Uuid> m_services;
+   std::set<Uuid> m_characteristics;
+   std::set<Uuid> m_skip_read;
+   uint32_t m_operations = ALL;
+};
+
+}
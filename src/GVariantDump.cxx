@@ -3,162 +3,291 @@
 #include <glib-2.0/glib.h>
 
 #include <cassert>
-#include <iomanip>
+#include <cstdint>
 #include <ostream>
-#include <memory>
+#include <sstream>
+#include <vector>
 
-
-void GVariantDump(GVariant* v, std::ostream& out, const std::string& whitespace)
+namespace
 {
-   constexpr char tab[] = "  ";
-   const char* type = g_variant_get_type_string(v);
-   assert(type);
+   constexpr char HEX[] = "0123456789abcdef";
 
-   switch(type[0])
+   // Writes the indent for the given depth, two spaces per level on top of
+   // whatever the caller started with.
+   class Indent
    {
-   //case G_VARIANT_CLASS_MAYBE: // TODO
-   case G_VARIANT_CLASS_ARRAY:
-      if (type[1] == '{') // Dictionary
+   public:
+      Indent(std::ostream& out, const std::string& base): m_out(out), m_base(base) {}
+
+      void Write(size_t depth)
       {
-         gsize n = g_variant_n_children(v);
-         if (n == 0)
-         {
-            out << "{}";
-         }
-         else
-         {
-            out << "{";
-            for (size_t i = 0; i < n; ++i)
-            {
-               std::shared_ptr<GVariant> kv(g_variant_get_child_value(v, i), g_variant_unref);
-               std::shared_ptr<GVariant> k(g_variant_get_child_value(kv.get(), 0), g_variant_unref);
-               std::shared_ptr<GVariant> v(g_variant_get_child_value(kv.get(), 1), g_variant_unref);
-               if (i != 0) out << ',';
-               out << '\n' << whitespace + tab;
-               GVariantDump(k.get(), out, whitespace + tab);
-               out << ": ";
-               GVariantDump(v.get(), out, whitespace + tab);
-            }
-
-            out << '\n' << whitespace << "}";
-         }
+         m_out << m_base;
+         if (m_spaces.size() < depth * 2)
+            m_spaces.resize(depth * 2, ' ');
+         m_out.write(m_spaces.data(), depth * 2);
       }
-      else if (type[1] == 'y') // Byte array
+
+   private:
+      std::ostream& m_out;
+      const std::string& m_base;
+      std::string m_spaces;
+   };
+
+
+   void DumpByte(uint8_t b, std::ostream& out)
+   {
+      char text[4] = {'0', 'x', HEX[b >> 4], HEX[b & 0xf]};
+      out.write(text, sizeof(text));
+   }
+
+
+   // Prints a basic (non container) value. Returns false if it isn't one.
+   bool DumpBasic(GVariant* v, std::ostream& out)
+   {
+      switch (g_variant_classify(v))
       {
-         gsize n = g_variant_n_children(v);
-         if (n == 0)
-         {
-            out << "[]";
-         }
-         else
-         {
-            out << "[";
-            for (size_t i = 0; i < n; ++i)
-            {
-               std::shared_ptr<GVariant> e(g_variant_get_child_value(v, i), g_variant_unref);
-               if (i != 0) out << ", ";
-               GVariantDump(e.get(), out, whitespace + tab);
-            }
-            out << ']';
-         }
-      }
-      else // Other
+      case G_VARIANT_CLASS_BOOLEAN:
+         out << (g_variant_get_boolean(v) ? "true" : "false");
+         return true;
+      case G_VARIANT_CLASS_OBJECT_PATH:
+      case G_VARIANT_CLASS_SIGNATURE:
+      case G_VARIANT_CLASS_STRING:
       {
-         gsize n = g_variant_n_children(v);
-         if (n == 0)
-         {
-            out << "[]";
-         }
-         else
-         {
-            out << "[";
-            for (size_t i = 0; i < n; ++i)
-            {
-               std::shared_ptr<GVariant> e(g_variant_get_child_value(v, i), g_variant_unref);
-               if (i != 0) out << ", ";
-               out << '\n' << whitespace + tab;
-               GVariantDump(e.get(), out, whitespace + tab);
-            }
-            out << '\n' << whitespace << ']';
-         }
+         gsize length = 0;
+         const char* str = g_variant_get_string(v, &length);
+         out.put('"');
+         out.write(str, length);
+         out.put('"');
+         return true;
+      }
+      case G_VARIANT_CLASS_BYTE:
+         DumpByte(g_variant_get_byte(v), out);
+         return true;
+      case G_VARIANT_CLASS_UINT16:
+         out << g_variant_get_uint16(v);
+         return true;
+      case G_VARIANT_CLASS_INT16:
+         out << g_variant_get_int16(v);
+         return true;
+      case G_VARIANT_CLASS_UINT32:
+         out << g_variant_get_uint32(v);
+         return true;
+      case G_VARIANT_CLASS_INT32:
+         out << g_variant_get_int32(v);
+         return true;
+      case G_VARIANT_CLASS_HANDLE:
+         out << g_variant_get_handle(v);
+         return true;
+      case G_VARIANT_CLASS_UINT64:
+         out << g_variant_get_uint64(v);
+         return true;
+      case G_VARIANT_CLASS_INT64:
+         out << g_variant_get_int64(v);
+         return true;
+      case G_VARIANT_CLASS_DOUBLE:
+         out << g_variant_get_double(v);
+         return true;
+      default:
+         return false;
       }
-      break;
-   case G_VARIANT_CLASS_TUPLE:
+   }
+
+
+   // Arrays of fixed size numbers, straight from the serialized data instead
+   // of pulling a GVariant out for every element.
+   template <typename T, typename Print>
+   void DumpFixed(GVariant* v, Indent& indent, size_t depth, std::ostream& out, Print print)
    {
-      size_t n = g_variant_n_children(v);
-      out << '(';
-      for (size_t i = 0; i < n; ++i)
+      gsize n = 0;
+      const T* e = (const T*)g_variant_get_fixed_array(v, &n, sizeof(T));
+      out << '[';
+      for (gsize i = 0; i < n; ++i)
       {
          if (i != 0) out << ", ";
-         std::shared_ptr<GVariant> e(g_variant_get_child_value(v, i), g_variant_unref);
-         GVariantDump(e.get(), out, whitespace);
+         out << '\n';
+         indent.Write(depth + 1);
+         print(e[i]);
       }
-
-      out << ')';
-      break;
+      out << '\n';
+      indent.Write(depth);
+      out << ']';
    }
-   case G_VARIANT_CLASS_DICT_ENTRY:
+
+
+   // Returns false if v isn't an array of fixed size numbers.
+   bool DumpFixedArray(GVariant* v, Indent& indent, size_t depth, std::ostream& out)
    {
-      std::shared_ptr<GVariant> key(g_variant_get_child_value(v, 0), g_variant_unref);
-      std::shared_ptr<GVariant> val(g_variant_get_child_value(v, 1), g_variant_unref);
-      
-      out << '{';
-      GVariantDump(key.get(), out, whitespace);
-      out << ", ";
-      GVariantDump(val.get(), out, whitespace);
-      out << '}';
-      break;
+      auto number = [&](auto e) { out << e; };
+      switch (g_variant_get_type_string(v)[1])
+      {
+      case 'y':
+      {
+         // Bytes are the common case (values, manufacturer data), and all go
+         // on one line.
+         gsize n = 0;
+         const uint8_t* e = (const uint8_t*)g_variant_get_fixed_array(v, &n, 1);
+         out << '[';
+         for (gsize i = 0; i < n; ++i)
+         {
+            if (i != 0) out << ", ";
+            DumpByte(e[i], out);
+         }
+         out << ']';
+         return true;
+      }
+      case 'b':
+         DumpFixed<uint8_t>(v, indent, depth, out, [&](uint8_t e) { out << (e ? "true" : "false"); });
+         return true;
+      case 'q': DumpFixed<uint16_t>(v, indent, depth, out, number); return true;
+      case 'n': DumpFixed<int16_t>(v, indent, depth, out, number); return true;
+      case 'u': DumpFixed<uint32_t>(v, indent, depth, out, number); return true;
+      case 'i':
+      case 'h': DumpFixed<int32_t>(v, indent, depth, out, number); return true;
+      case 't': DumpFixed<uint64_t>(v, indent, depth, out, number); return true;
+      case 'x': DumpFixed<int64_t>(v, indent, depth, out, number); return true;
+      case 'd': DumpFixed<double>(v, indent, depth, out, number); return true;
+      default:
+         return false;
+      }
    }
-   case G_VARIANT_CLASS_VARIANT:
+
+
+   // A container that is partway through being printed.
+   struct Frame
    {
-      std::shared_ptr<GVariant> var(g_variant_get_variant(v), g_variant_unref);
-      out << '<';
-      // out << g_variant_get_type_string(var.get()) << ' ';
-      GVariantDump(var.get(), out, whitespace);
-      out << '>';
-      break;
+      enum Kind { DICT, LIST, TUPLE, DICT_ENTRY, DICT_ITEM, VARIANT };
+
+      GVariant* value;     // Holds a ref, which the iterator needs.
+      GVariantIter iter;
+      Kind kind;
+      size_t depth;
+      size_t index;
+   };
+
+
+   // Prints v if it can be done in one go, or prints its opening and pushes
+   // it on the stack so that its children get done in turn.
+   void Open(GVariant* v, Frame::Kind parent, size_t depth, Indent& indent, std::vector<Frame>& stack, std::ostream& out)
+   {
+      if (DumpBasic(v, out))
+         return;
+
+      Frame::Kind kind;
+      switch (g_variant_classify(v))
+      {
+      case G_VARIANT_CLASS_ARRAY:
+      {
+         const char* type = g_variant_get_type_string(v);
+         bool dict = type[1] == '{';
+         if (g_variant_n_children(v) == 0)
+         {
+            out << (dict ? "{}" : "[]");
+            return;
+         }
+         if (!dict && DumpFixedArray(v, indent, depth, out))
+            return;
+         kind = dict ? Frame::DICT : Frame::LIST;
+         out << (dict ? '{' : '[');
+         break;
+      }
+      case G_VARIANT_CLASS_TUPLE:
+         kind = Frame::TUPLE;
+         out << '(';
+         break;
+      case G_VARIANT_CLASS_DICT_ENTRY:
+         // Entries directly in a dictionary are "key: value", without braces.
+         kind = parent == Frame::DICT ? Frame::DICT_ITEM : Frame::DICT_ENTRY;
+         if (kind == Frame::DICT_ENTRY)
+            out << '{';
+         break;
+      case G_VARIANT_CLASS_VARIANT:
+         kind = Frame::VARIANT;
+         out << '<';
+         break;
+      default:
+         // TODO: maybe types
+         out << "???";
+         return;
+      }
+
+      stack.push_back(Frame{g_variant_ref(v), GVariantIter(), kind, depth, 0});
+      g_variant_iter_init(&stack.back().iter, v);
    }
-   case G_VARIANT_CLASS_BOOLEAN:
-      out << (g_variant_get_boolean(v) ? "true" : "false");
-      break;
-   case G_VARIANT_CLASS_OBJECT_PATH:
-   case G_VARIANT_CLASS_SIGNATURE:
-   case G_VARIANT_CLASS_STRING:
-      out << '"' << g_variant_get_string(v, nullptr) << '"';
-      break;
-   case G_VARIANT_CLASS_BYTE:
+
+
+   void Close(const Frame& f, Indent& indent, std::ostream& out)
    {
-      std::ios_base::fmtflags old_flags(out.flags());
-      out << "0x" << std::setw(2)  << std::setfill('0') << std::hex << (unsigned)g_variant_get_byte(v);
-      out.flags(old_flags);
-      break;
+      switch (f.kind)
+      {
+      case Frame::DICT:
+         out << '\n';
+         indent.Write(f.depth);
+         out << '}';
+         break;
+      case Frame::LIST:
+         out << '\n';
+         indent.Write(f.depth);
+         out << ']';
+         break;
+      case Frame::TUPLE:      out << ')'; break;
+      case Frame::DICT_ENTRY: out << '}'; break;
+      case Frame::DICT_ITEM:  break;
+      case Frame::VARIANT:    out << '>'; break;
+      }
    }
-   case G_VARIANT_CLASS_UINT16:
-      out << g_variant_get_uint16(v);
-      break;
-   case G_VARIANT_CLASS_INT16:
-      out << g_variant_get_int16(v);
-      break;
-   case G_VARIANT_CLASS_UINT32:
-      out << g_variant_get_uint32(v);
-      break;
-   case G_VARIANT_CLASS_INT32:
-      out << g_variant_get_int32(v);
-      break;
-   case G_VARIANT_CLASS_HANDLE:
-      out << g_variant_get_handle(v);
-      break;
-   case G_VARIANT_CLASS_UINT64:
-      out << g_variant_get_uint64(v);
-      break;
-   case G_VARIANT_CLASS_INT64:
-      out << g_variant_get_int64(v);
-      break;
-   case G_VARIANT_CLASS_DOUBLE:
-      out << g_variant_get_double(v);
-      break;
-   default:
-      out << "???";
+}
+
+
+// Walks the value with an explicit stack rather than recursing, so that the
+// only allocations are the stack itself and the refs that GVariantIter hands
+// out for each child.
+void GVariantDump(GVariant* v, std::ostream& out, const std::string& whitespace)
+{
+   assert(g_variant_get_type_string(v));
+
+   Indent indent(out, whitespace);
+   std::vector<Frame> stack;
+   stack.reserve(16);
+
+   Open(v, Frame::VARIANT, 0, indent, stack, out);
+   while (!stack.empty())
+   {
+      Frame& f = stack.back();
+      GVariant* child = g_variant_iter_next_value(&f.iter);
+      if (!child)
+      {
+         Close(f, indent, out);
+         g_variant_unref(f.value);
+         stack.pop_back();
+         continue;
+      }
+
+      size_t depth = f.depth;
+      switch (f.kind)
+      {
+      case Frame::DICT:
+      case Frame::LIST:
+         // One child per line, indented one more than the brackets.
+         if (f.index != 0) out << (f.kind == Frame::DICT ? "," : ", ");
+         out << '\n';
+         ++depth;
+         indent.Write(depth);
+         break;
+      case Frame::TUPLE:
+      case Frame::DICT_ENTRY:
+         if (f.index != 0) out << ", ";
+         break;
+      case Frame::DICT_ITEM:
+         if (f.index != 0) out << ": ";
+         break;
+      case Frame::VARIANT:
+         break;
+      }
+      ++f.index;
+
+      // f is gone after this if a frame gets pushed.
+      Open(child, f.kind, depth, indent, stack, out);
+      g_variant_unref(child);
    }
 }
 
@@ -167,4 +296,4 @@ std::string GVariantDump(GVariant* v)
    std::stringstream ss;
    GVariantDump(v, ss);
    return ss.str();
-}
\ No newline at end of file
+}
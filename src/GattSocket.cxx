@@ -0,0 +1,196 @@
+#include "GattSocket.hh"
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace asha;
+
+namespace
+{
+   // The minimum ATT MTU, for if bluez doesn't tell us.
+   constexpr uint16_t DEFAULT_MTU = 23;
+
+   // g_unix_fd_add() and g_source_remove() only know about the global
+   // default context, which may not be the one running this thread.
+   unsigned AddWatch(GMainContext* context, int fd, GIOCondition condition, GUnixFDSourceFunc fn, gpointer user_data)
+   {
+      GSource* source = g_unix_fd_source_new(fd, condition);
+      g_source_set_callback(source, (GSourceFunc)fn, user_data, nullptr);
+      unsigned id = g_source_attach(source, context);
+      g_source_unref(source);
+      return id;
+   }
+
+   void RemoveWatch(GMainContext* context, unsigned& id)
+   {
+      GSource* source = g_main_context_find_source_by_id(context, id);
+      if (source)
+         g_source_destroy(source);
+      id = 0;
+   }
+}
+
+
+GattSocket::GattSocket(int fd, uint16_t mtu):
+   m_fd(fd),
+   m_mtu(mtu ? mtu : DEFAULT_MTU),
+   m_context(g_main_context_ref_thread_default(), g_main_context_unref),
+   m_reader(std::make_shared<Reader>())
+{
+   m_reader->buffer.resize(m_mtu);
+   int flags = fcntl(m_fd, F_GETFL);
+   if (flags != -1)
+      fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+GattSocket::~GattSocket()
+{
+   if (m_read_source)
+      RemoveWatch(m_context.get(), m_read_source);
+   if (m_write_source)
+      RemoveWatch(m_context.get(), m_write_source);
+   close(m_fd);
+}
+
+
+void GattSocket::StartReading(PacketCallback fn, ClosedCallback closed)
+{
+   m_reader->on_packet = std::move(fn);
+   m_on_closed = std::move(closed);
+   if (m_read_source)
+      return;
+
+   // Lambda doesn't work with a C callback that needs a user_data.
+   struct Callback {
+      static gboolean Readable(gint fd, GIOCondition condition, gpointer user_data)
+      {
+         auto* self = (GattSocket*)user_data;
+         if (condition & G_IO_IN)
+         {
+            // One packet per wakeup. The callback is allowed to destroy us,
+            // so it runs from a reference of its own, and nothing here
+            // touches self after calling it.
+            auto reader = self->m_reader;
+            ssize_t n = recv(fd, reader->buffer.data(), reader->buffer.size(), MSG_DONTWAIT);
+            if (n > 0)
+            {
+               reader->on_packet(ByteView(reader->buffer.data(), n));
+               return G_SOURCE_CONTINUE;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+               return G_SOURCE_CONTINUE;
+         }
+
+         // Hangup, error, or end of stream. bluez closes the socket when the
+         // device disconnects or somebody else stops the notifications.
+         self->m_read_source = 0;
+         self->m_closed = true;
+         auto closed = std::move(self->m_on_closed);
+         if (closed)
+            closed();
+         return G_SOURCE_REMOVE;
+      }
+   };
+
+   m_read_source = AddWatch(m_context.get(), m_fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), &Callback::Readable, this);
+}
+
+
+bool GattSocket::Write(ByteView bytes)
+{
+   if (m_closed)
+      return false;
+
+   size_t packets = bytes.empty() ? 1 : (bytes.size() + m_mtu - 1) / m_mtu;
+   if (m_write_queue.size() + packets > MAX_QUEUED_PACKETS)
+      return false;
+
+   size_t offset = 0;
+   do
+   {
+      size_t n = std::min<size_t>(m_mtu, bytes.size() - offset);
+      const uint8_t* packet = bytes.data() + offset;
+      offset += n;
+
+      // Keep packets in order: once anything is queued, everything after it
+      // has to wait its turn.
+      if (m_write_queue.empty())
+      {
+         ssize_t sent = send(m_fd, packet, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+         if (sent >= 0)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+         {
+            g_info("Error writing to gatt socket: %s", strerror(errno));
+            Close();
+            return false;
+         }
+      }
+      m_write_queue.emplace_back(packet, packet + n);
+   } while (offset < bytes.size());
+
+   if (!m_write_queue.empty() && !m_write_source)
+   {
+      // Lambda doesn't work with a C callback that needs a user_data.
+      struct Callback {
+         static gboolean Writable(gint fd, GIOCondition condition, gpointer user_data)
+         {
+            auto* self = (GattSocket*)user_data;
+            if (!(condition & G_IO_OUT) || !self->Flush())
+            {
+               self->m_write_source = 0;
+               self->Close();
+               return G_SOURCE_REMOVE;
+            }
+            if (self->m_write_queue.empty())
+            {
+               self->m_write_source = 0;
+               return G_SOURCE_REMOVE;
+            }
+            return G_SOURCE_CONTINUE;
+         }
+      };
+      m_write_source = AddWatch(m_context.get(), m_fd, (GIOCondition)(G_IO_OUT | G_IO_HUP | G_IO_ERR), &Callback::Writable, this);
+   }
+   return true;
+}
+
+
+bool GattSocket::Flush()
+{
+   while (!m_write_queue.empty())
+   {
+      auto& packet = m_write_queue.front();
+      ssize_t sent = send(m_fd, packet.data(), packet.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent < 0)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return true;
+         g_info("Error writing to gatt socket: %s", strerror(errno));
+         return false;
+      }
+      m_write_queue.pop_front();
+   }
+   return true;
+}
+
+
+void GattSocket::Close()
+{
+   // Leave the fd itself alone until we are destroyed, so that nobody else
+   // can reuse the number while we still hold it.
+   m_closed = true;
+   m_write_queue.clear();
+   if (m_write_source)
+      RemoveWatch(m_context.get(), m_write_source);
+}
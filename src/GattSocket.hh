@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ByteView.hh"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+struct _GMainContext;
+
+namespace asha
+{
+
+// A socket handed out by bluez AcquireNotify or AcquireWrite. bluez uses
+// SOCK_SEQPACKET, so every read or write is exactly one ATT packet, and none
+// of it goes through dbus.
+class GattSocket final
+{
+public:
+   typedef std::function<void(ByteView)> PacketCallback;
+   typedef std::function<void()> ClosedCallback;
+
+   // Takes ownership of fd. The socket is watched from the calling thread's
+   // default main context.
+   GattSocket(int fd, uint16_t mtu);
+   ~GattSocket();
+
+   GattSocket(const GattSocket&) = delete;
+   GattSocket& operator=(const GattSocket&) = delete;
+
+   int Fd() const { return m_fd; }
+   uint16_t Mtu() const { return m_mtu; }
+
+   // Watch the socket from the main loop, calling fn for every packet. closed
+   // gets called once if the other end hangs up. It is fine for either of
+   // them to destroy this object.
+   void StartReading(PacketCallback fn, ClosedCallback closed);
+
+   // Send bytes, split into MTU sized packets. Whatever the socket can't take
+   // right now gets queued and written from the main loop as it drains.
+   // Returns false if the socket is closed, or if the queue is full, in which
+   // case nothing was written and the caller should back off.
+   bool Write(ByteView bytes);
+   // Number of packets waiting for the socket to drain.
+   size_t Queued() const { return m_write_queue.size(); }
+   bool Closed() const { return m_closed; }
+
+   // How many packets can be waiting before Write starts refusing them.
+   static constexpr size_t MAX_QUEUED_PACKETS = 256;
+
+private:
+   // Returns false if the socket was closed.
+   bool Flush();
+   void Close();
+
+   int m_fd;
+   uint16_t m_mtu;
+   std::shared_ptr<_GMainContext> m_context;
+
+   // The packet callback and the buffer it gets a view into. Shared, so
+   // that both outlive us if the callback destroys us.
+   struct Reader
+   {
+      PacketCallback on_packet;
+      std::vector<uint8_t> buffer;
+   };
+   std::shared_ptr<Reader> m_reader;
+   unsigned m_read_source = 0;
+   ClosedCallback m_on_closed;
+
+   std::deque<std::vector<uint8_t>> m_write_queue;
+   unsigned m_write_source = 0;
+   bool m_closed = false;
+};
+
+}
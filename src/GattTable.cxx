@@ -0,0 +1,178 @@
+#include "GattTable.hh"
+
+#include <algorithm>
+
+using namespace asha;
+
+namespace
+{
+   constexpr uint32_t NONE = (uint32_t)-1;
+
+   template <typename T>
+   bool ByPath(const T& a, const T& b)
+   {
+      return a.path < b.path;
+   }
+}
+
+
+void GattTable::Builder::AddService(const std::string& path, const Uuid& uuid)
+{
+   m_services.push_back(Object{path, std::string(), uuid, 0});
+}
+
+
+void GattTable::Builder::AddCharacteristic(const std::string& path, const Uuid& uuid, uint32_t flags,
+                                           bool can_acquire_notify, bool can_acquire_write, const std::string& service,
+                                           const ByteView* value)
+{
+   flags &= ~(CAN_ACQUIRE_NOTIFY | CAN_ACQUIRE_WRITE);
+   if (can_acquire_notify)
+      flags |= CAN_ACQUIRE_NOTIFY;
+   if (can_acquire_write)
+      flags |= CAN_ACQUIRE_WRITE;
+   m_characteristics.push_back(Object{path, service, uuid, flags});
+   if (value)
+   {
+      m_characteristics.back().has_value = true;
+      m_characteristics.back().value = value->ToVector();
+   }
+}
+
+
+void GattTable::Builder::AddDescriptor(const std::string& path, const Uuid& uuid, const std::string& characteristic,
+                                       const ByteView* value)
+{
+   m_descriptors.push_back(Object{path, characteristic, uuid, 0});
+   if (value)
+   {
+      m_descriptors.back().has_value = true;
+      m_descriptors.back().value = value->ToVector();
+   }
+}
+
+
+GattTable GattTable::Builder::Finish()
+{
+   // bluez names objects after their handles using fixed width hex digits, so
+   // sorting by path puts everything in GATT order.
+   std::sort(m_services.begin(), m_services.end(), ByPath<Object>);
+   std::sort(m_characteristics.begin(), m_characteristics.end(), ByPath<Object>);
+   std::sort(m_descriptors.begin(), m_descriptors.end(), ByPath<Object>);
+
+   // Index of the object in parents with the given path, or NONE.
+   auto find = [](const std::vector<Object>& parents, const std::string& path) {
+      auto it = std::lower_bound(parents.begin(), parents.end(), path, [](const Object& o, const std::string& p) {
+         return o.path < p;
+      });
+      return it != parents.end() && it->path == path ? (uint32_t)(it - parents.begin()) : NONE;
+   };
+
+   // Children normally sit under their parent's path, which makes them
+   // contiguous already, but go by the parent link bluez gives to be sure.
+   // Each child list keeps (parent, index into the builder's vector).
+   typedef std::pair<uint32_t, uint32_t> Link;
+   std::vector<Link> characteristics;
+   for (uint32_t i = 0; i < m_characteristics.size(); ++i)
+   {
+      uint32_t parent = find(m_services, m_characteristics[i].parent);
+      if (parent != NONE)
+         characteristics.emplace_back(parent, i);
+   }
+   std::stable_sort(characteristics.begin(), characteristics.end());
+
+   // Characteristics get renumbered by the sort, so look descriptors' parents
+   // up by builder index and translate.
+   std::vector<uint32_t> renumbered(m_characteristics.size(), NONE);
+   for (uint32_t i = 0; i < characteristics.size(); ++i)
+      renumbered[characteristics[i].second] = i;
+   std::vector<Link> descriptors;
+   for (uint32_t i = 0; i < m_descriptors.size(); ++i)
+   {
+      uint32_t parent = find(m_characteristics, m_descriptors[i].parent);
+      if (parent != NONE && renumbered[parent] != NONE)
+         descriptors.emplace_back(renumbered[parent], i);
+   }
+   std::stable_sort(descriptors.begin(), descriptors.end());
+
+   GattTable table;
+   size_t strings = 0;
+   size_t values = 0;
+   for (auto& s: m_services)
+      strings += s.path.size() + 1;
+   for (auto& c: characteristics)
+   {
+      strings += m_characteristics[c.second].path.size() + 1;
+      values += m_characteristics[c.second].value.size();
+   }
+   for (auto& d: descriptors)
+   {
+      strings += m_descriptors[d.second].path.size() + 1;
+      values += m_descriptors[d.second].value.size();
+   }
+   table.m_strings.reserve(strings);
+   table.m_values.reserve(values);
+   table.m_services.reserve(m_services.size());
+   table.m_characteristics.reserve(characteristics.size());
+   table.m_descriptors.reserve(descriptors.size());
+
+   for (auto& s: m_services)
+      table.m_services.push_back(ServiceEntry{s.uuid, table.Intern(s.path), 0, 0});
+   for (auto& link: characteristics)
+   {
+      auto& c = m_characteristics[link.second];
+      uint32_t index = (uint32_t)table.m_characteristics.size();
+      table.m_characteristics.push_back(CharacteristicEntry{c.uuid, table.Intern(c.path), c.flags, link.first, 0, 0,
+                                                            table.InternValue(c.has_value, c.value), (uint32_t)c.value.size()});
+      auto& service = table.m_services[link.first];
+      if (service.first_characteristic == service.end_characteristic)
+         service.first_characteristic = index;
+      service.end_characteristic = index + 1;
+   }
+   for (auto& link: descriptors)
+   {
+      auto& d = m_descriptors[link.second];
+      uint32_t index = (uint32_t)table.m_descriptors.size();
+      table.m_descriptors.push_back(DescriptorEntry{d.uuid, table.Intern(d.path), link.first,
+                                                    table.InternValue(d.has_value, d.value), (uint32_t)d.value.size()});
+      auto& characteristic = table.m_characteristics[link.first];
+      if (characteristic.first_descriptor == characteristic.end_descriptor)
+         characteristic.first_descriptor = index;
+      characteristic.end_descriptor = index + 1;
+   }
+
+   m_services.clear();
+   m_characteristics.clear();
+   m_descriptors.clear();
+   return table;
+}
+
+
+size_t GattTable::MemoryUsage() const
+{
+   return sizeof(*this)
+      + m_services.capacity() * sizeof(ServiceEntry)
+      + m_characteristics.capacity() * sizeof(CharacteristicEntry)
+      + m_descriptors.capacity() * sizeof(DescriptorEntry)
+      + m_strings.capacity()
+      + m_values.capacity();
+}
+
+
+uint32_t GattTable::Intern(const std::string& s)
+{
+   uint32_t offset = (uint32_t)m_strings.size();
+   m_strings.insert(m_strings.end(), s.begin(), s.end());
+   m_strings.push_back('\0');
+   return offset;
+}
+
+
+uint32_t GattTable::InternValue(bool has_value, const std::vector<uint8_t>& value)
+{
+   if (!has_value)
+      return NO_VALUE;
+   uint32_t offset = (uint32_t)m_values.size();
+   m_values.insert(m_values.end(), value.begin(), value.end());
+   return offset;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ByteView.hh"
+#include "Uuid.hh"
+
+namespace asha
+{
+
+class GattTable;
+class GattService;
+class GattCharacteristic;
+class GattDescriptor;
+
+
+// A run of consecutive entries in a GattTable, for range-for.
+template <typename Handle>
+class GattRange final
+{
+public:
+   class iterator
+   {
+   public:
+      iterator(const GattTable* table, uint32_t index): m_table(table), m_index(index) {}
+      Handle operator*() const { return Handle(m_table, m_index); }
+      iterator& operator++() { ++m_index; return *this; }
+      bool operator==(const iterator& o) const { return m_index == o.m_index; }
+      bool operator!=(const iterator& o) const { return m_index != o.m_index; }
+
+   private:
+      const GattTable* m_table;
+      uint32_t m_index;
+   };
+
+   GattRange(const GattTable* table, uint32_t begin, uint32_t end): m_table(table), m_begin(begin), m_end(end) {}
+
+   iterator begin() const { return iterator(m_table, m_begin); }
+   iterator end() const { return iterator(m_table, m_end); }
+   size_t size() const { return m_end - m_begin; }
+   bool empty() const { return m_begin == m_end; }
+   Handle operator[](size_t i) const { return Handle(m_table, m_begin + (uint32_t)i); }
+
+private:
+   const GattTable* m_table;
+   uint32_t m_begin;
+   uint32_t m_end;
+};
+
+
+// Handles into a GattTable. They are a pointer and an index, so pass them
+// around by value, but they are only good for as long as the table is.
+class GattService final
+{
+public:
+   GattService(const GattTable* table, uint32_t index): m_table(table), m_index(index) {}
+
+   const char* Path() const;
+   const Uuid& UUID() const;
+   GattRange<GattCharacteristic> Characteristics() const;
+
+private:
+   const GattTable* m_table;
+   uint32_t m_index;
+};
+
+
+class GattCharacteristic final
+{
+public:
+   GattCharacteristic(const GattTable* table, uint32_t index): m_table(table), m_index(index) {}
+
+   const char* Path() const;
+   const Uuid& UUID() const;
+   // Characteristic::Flag bits.
+   uint32_t Flags() const;
+   bool HasFlag(uint32_t flag) const { return (Flags() & flag) != 0; }
+   bool CanAcquireNotify() const;
+   bool CanAcquireWrite() const;
+   // The Value bluez had cached when the table was built, if it had one.
+   bool HasValue() const;
+   ByteView Value() const;
+   GattService Service() const;
+   GattRange<GattDescriptor> Descriptors() const;
+
+private:
+   const GattTable* m_table;
+   uint32_t m_index;
+};
+
+
+class GattDescriptor final
+{
+public:
+   GattDescriptor(const GattTable* table, uint32_t index): m_table(table), m_index(index) {}
+
+   const char* Path() const;
+   const Uuid& UUID() const;
+   bool HasValue() const;
+   ByteView Value() const;
+   GattCharacteristic Characteristic() const;
+
+private:
+   const GattTable* m_table;
+   uint32_t m_index;
+};
+
+
+// The services, characteristics and descriptors of one device, in GATT order.
+// Everything lives in three flat arrays linked by index, and every object
+// path is kept once, in a single string arena, rather than once per object
+// and again in each of its children.
+class GattTable final
+{
+public:
+   // Collects the objects in whatever order they turn up in, then sorts and
+   // links them. Children whose parent never turns up get left out. value is
+   // bluez's cached Value property, or null if it hasn't got one.
+   class Builder final
+   {
+   public:
+      void AddService(const std::string& path, const Uuid& uuid);
+      void AddCharacteristic(const std::string& path, const Uuid& uuid, uint32_t flags,
+                             bool can_acquire_notify, bool can_acquire_write, const std::string& service,
+                             const ByteView* value = nullptr);
+      void AddDescriptor(const std::string& path, const Uuid& uuid, const std::string& characteristic,
+                         const ByteView* value = nullptr);
+
+      GattTable Finish();
+
+   private:
+      struct Object
+      {
+         std::string path;
+         std::string parent;
+         Uuid uuid;
+         uint32_t flags;
+         bool has_value = false;
+         std::vector<uint8_t> value;
+      };
+
+      std::vector<Object> m_services;
+      std::vector<Object> m_characteristics;
+      std::vector<Object> m_descriptors;
+   };
+
+   GattTable() {}
+
+   GattRange<GattService> Services() const { return GattRange<GattService>(this, 0, (uint32_t)m_services.size()); }
+   GattRange<GattCharacteristic> Characteristics() const { return GattRange<GattCharacteristic>(this, 0, (uint32_t)m_characteristics.size()); }
+   bool Empty() const { return m_services.empty(); }
+
+   // Bytes owned by the table, for keeping an eye on how big devices get.
+   size_t MemoryUsage() const;
+
+private:
+   friend class GattService;
+   friend class GattCharacteristic;
+   friend class GattDescriptor;
+
+   // Characteristic flags that aren't GATT properties.
+   static constexpr uint32_t CAN_ACQUIRE_NOTIFY = 1u << 30;
+   static constexpr uint32_t CAN_ACQUIRE_WRITE = 1u << 31;
+   // Value offset of an attribute that bluez had no value for.
+   static constexpr uint32_t NO_VALUE = (uint32_t)-1;
+
+   struct ServiceEntry
+   {
+      Uuid uuid;
+      uint32_t path;
+      uint32_t first_characteristic;
+      uint32_t end_characteristic;
+   };
+
+   struct CharacteristicEntry
+   {
+      Uuid uuid;
+      uint32_t path;
+      uint32_t flags;
+      uint32_t service;
+      uint32_t first_descriptor;
+      uint32_t end_descriptor;
+      uint32_t value;
+      uint32_t value_size;
+   };
+
+   struct DescriptorEntry
+   {
+      Uuid uuid;
+      uint32_t path;
+      uint32_t characteristic;
+      uint32_t value;
+      uint32_t value_size;
+   };
+
+   // Appends a nul terminated copy of s to the arena, returning its offset.
+   uint32_t Intern(const std::string& s);
+   const char* String(uint32_t offset) const { return m_strings.data() + offset; }
+   // Same for values, which get an arena of their own. Returns NO_VALUE
+   // if there isn't one.
+   uint32_t InternValue(bool has_value, const std::vector<uint8_t>& value);
+   ByteView Bytes(uint32_t offset, uint32_t size) const
+   {
+      return offset == NO_VALUE ? ByteView() : ByteView(m_values.data() + offset, size);
+   }
+
+   std::vector<ServiceEntry> m_services;
+   std::vector<CharacteristicEntry> m_characteristics;
+   std::vector<DescriptorEntry> m_descriptors;
+   std::vector<char> m_strings;
+   std::vector<uint8_t> m_values;
+};
+
+
+inline const char* GattService::Path() const { return m_table->String(m_table->m_services[m_index].path); }
+inline const Uuid& GattService::UUID() const { return m_table->m_services[m_index].uuid; }
+inline GattRange<GattCharacteristic> GattService::Characteristics() const
+{
+   auto& s = m_table->m_services[m_index];
+   return GattRange<GattCharacteristic>(m_table, s.first_characteristic, s.end_characteristic);
+}
+
+inline const char* GattCharacteristic::Path() const { return m_table->String(m_table->m_characteristics[m_index].path); }
+inline const Uuid& GattCharacteristic::UUID() const { return m_table->m_characteristics[m_index].uuid; }
+inline uint32_t GattCharacteristic::Flags() const
+{
+   return m_table->m_characteristics[m_index].flags & ~(GattTable::CAN_ACQUIRE_NOTIFY | GattTable::CAN_ACQUIRE_WRITE);
+}
+inline bool GattCharacteristic::CanAcquireNotify() const { return m_table->m_characteristics[m_index].flags & GattTable::CAN_ACQUIRE_NOTIFY; }
+inline bool GattCharacteristic::CanAcquireWrite() const { return m_table->m_characteristics[m_index].flags & GattTable::CAN_ACQUIRE_WRITE; }
+inline bool GattCharacteristic::HasValue() const { return m_table->m_characteristics[m_index].value != GattTable::NO_VALUE; }
+inline ByteView GattCharacteristic::Value() const
+{
+   auto& c = m_table->m_characteristics[m_index];
+   return m_table->Bytes(c.value, c.value_size);
+}
+inline GattService GattCharacteristic::Service() const { return GattService(m_table, m_table->m_characteristics[m_index].service); }
+inline GattRange<GattDescriptor> GattCharacteristic::Descriptors() const
+{
+   auto& c = m_table->m_characteristics[m_index];
+   return GattRange<GattDescriptor>(m_table, c.first_descriptor, c.end_descriptor);
+}
+
+inline const char* GattDescriptor::Path() const { return m_table->String(m_table->m_descriptors[m_index].path); }
+inline const Uuid& GattDescriptor::UUID() const { return m_table->m_descriptors[m_index].uuid; }
+inline bool GattDescriptor::HasValue() const { return m_table->m_descriptors[m_index].value != GattTable::NO_VALUE; }
+inline ByteView GattDescriptor::Value() const
+{
+   auto& d = m_table->m_descriptors[m_index];
+   return m_table->Bytes(d.value, d.value_size);
+}
+inline GattCharacteristic GattDescriptor::Characteristic() const { return GattCharacteristic(m_table, m_table->m_descriptors[m_index].characteristic); }
+
+}
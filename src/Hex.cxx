@@ -0,0 +1,191 @@
+#include "Hex.hh"
+
+#include <cstring>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+using namespace asha;
+
+namespace
+{
+   constexpr char DIGITS[] = "0123456789abcdef";
+
+   // Every byte value, already formatted as two hex digits.
+   struct HexTable
+   {
+      constexpr HexTable(): pairs()
+      {
+         for (int i = 0; i < 256; ++i)
+         {
+            pairs[i * 2] = DIGITS[i >> 4];
+            pairs[i * 2 + 1] = DIGITS[i & 0xf];
+         }
+      }
+      char pairs[512];
+   };
+   constexpr HexTable HEX;
+
+   // Every byte value, already escaped. Each entry is padded out to four
+   // chars so that it can be copied without looking at the length first.
+   struct EscapeTable
+   {
+      constexpr EscapeTable(): len(), text()
+      {
+         for (int i = 0; i < 256; ++i)
+         {
+            char* s = text[i];
+            switch (i)
+            {
+            case '\0': s[0] = '\\'; s[1] = '0'; len[i] = 2; break;
+            case '\a': s[0] = '\\'; s[1] = 'a'; len[i] = 2; break;
+            case '\b': s[0] = '\\'; s[1] = 'b'; len[i] = 2; break;
+            case '\t': s[0] = '\\'; s[1] = 't'; len[i] = 2; break;
+            case '\n': s[0] = '\\'; s[1] = 'n'; len[i] = 2; break;
+            case '\v': s[0] = '\\'; s[1] = 'v'; len[i] = 2; break;
+            case '\f': s[0] = '\\'; s[1] = 'f'; len[i] = 2; break;
+            case '\r': s[0] = '\\'; s[1] = 'r'; len[i] = 2; break;
+            default:
+               if (i >= 32 && i < 127)
+               {
+                  s[0] = (char)i;
+                  len[i] = 1;
+               }
+               else
+               {
+                  s[0] = '\\';
+                  s[1] = (char)('0' + ((i >> 6) & 7));
+                  s[2] = (char)('0' + ((i >> 3) & 7));
+                  s[3] = (char)('0' + (i & 7));
+                  len[i] = 4;
+               }
+            }
+         }
+      }
+      uint8_t len[256];
+      char text[256][4];
+   };
+   constexpr EscapeTable ESCAPES;
+
+#ifdef __SSSE3__
+   // Nibbles (0-15 in each byte) to lowercase hex digits.
+   inline __m128i ToHex(__m128i nibbles)
+   {
+      // '0' + n, plus the gap between '9' and 'a' for anything over 9.
+      __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+      return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+   }
+
+   // Format 16 bytes as "hh " sixteen times, which is exactly 48 chars, or
+   // three registers.
+   inline void HexDump16(const uint8_t* in, char* out)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)in);
+      __m128i mask = _mm_set1_epi8(0xf);
+      __m128i hi = ToHex(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+      __m128i lo = ToHex(_mm_and_si128(v, mask));
+
+      // Digit pairs for bytes 0-7 and 8-15.
+      __m128i a = _mm_unpacklo_epi8(hi, lo);
+      __m128i b = _mm_unpackhi_epi8(hi, lo);
+
+      // Spread the pairs out to make room for the spaces. -1 zeros the byte,
+      // which is where the spaces get or'd in.
+      const __m128i a0 = _mm_setr_epi8( 0,  1, -1,  2,  3, -1,  4,  5, -1,  6,  7, -1,  8,  9, -1, 10);
+      const __m128i a1 = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,  0,  1, -1,  2,  3, -1,  4,  5);
+      const __m128i b2 = _mm_setr_epi8(-1,  6,  7, -1,  8,  9, -1, 10, 11, -1, 12, 13, -1, 14, 15, -1);
+      const __m128i s0 = _mm_setr_epi8( 0,  0, 32,  0,  0, 32,  0,  0, 32,  0,  0, 32,  0,  0, 32,  0);
+      const __m128i s1 = _mm_setr_epi8( 0, 32,  0,  0, 32,  0,  0, 32,  0,  0, 32,  0,  0, 32,  0,  0);
+      const __m128i s2 = _mm_setr_epi8(32,  0,  0, 32,  0,  0, 32,  0,  0, 32,  0,  0, 32,  0,  0, 32);
+
+      __m128i out0 = _mm_or_si128(_mm_shuffle_epi8(a, a0), s0);
+      __m128i out1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a1), _mm_shuffle_epi8(b, b1)), s1);
+      __m128i out2 = _mm_or_si128(_mm_shuffle_epi8(b, b2), s2);
+
+      _mm_storeu_si128((__m128i*)out, out0);
+      _mm_storeu_si128((__m128i*)(out + 16), out1);
+      _mm_storeu_si128((__m128i*)(out + 32), out2);
+   }
+#endif
+
+   // Writes "hh " for every byte, trailing space included.
+   inline char* HexDumpTail(const uint8_t* in, size_t size, char* out)
+   {
+      for (size_t i = 0; i < size; ++i)
+      {
+         memcpy(out, &HEX.pairs[in[i] * 2], 2);
+         out[2] = ' ';
+         out += 3;
+      }
+      return out;
+   }
+}
+
+
+size_t asha::HexDumpScalar(ByteView bytes, char* out)
+{
+   if (bytes.empty())
+      return 0;
+   HexDumpTail(bytes.data(), bytes.size(), out);
+   return bytes.size() * 3 - 1;
+}
+
+
+size_t asha::HexDump(ByteView bytes, char* out)
+{
+   if (bytes.empty())
+      return 0;
+
+   const uint8_t* in = bytes.data();
+   size_t remaining = bytes.size();
+   char* p = out;
+#ifdef __SSSE3__
+   for (; remaining >= 16; remaining -= 16, in += 16, p += 48)
+      HexDump16(in, p);
+#endif
+   HexDumpTail(in, remaining, p);
+   return bytes.size() * 3 - 1;
+}
+
+
+std::string asha::HexDump(ByteView bytes)
+{
+   std::string ret(HexDumpSize(bytes.size()), '\0');
+   ret.resize(HexDump(bytes, &ret[0]));
+   return ret;
+}
+
+
+std::string asha::HexString(ByteView bytes)
+{
+   std::string ret(bytes.size() * 2, '\0');
+   char* p = &ret[0];
+   for (uint8_t c: bytes)
+   {
+      memcpy(p, HEX.pairs + c * 2, 2);
+      p += 2;
+   }
+   return ret;
+}
+
+
+size_t asha::Printable(ByteView bytes, char* out)
+{
+   char* p = out;
+   for (uint8_t c: bytes)
+   {
+      memcpy(p, ESCAPES.text[c], 4);
+      p += ESCAPES.len[c];
+   }
+   return p - out;
+}
+
+
+std::string asha::Printable(ByteView bytes)
+{
+   std::string ret(PrintableSize(bytes.size()), '\0');
+   ret.resize(Printable(bytes, &ret[0]));
+   return ret;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ByteView.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace asha
+{
+
+// Formatters for characteristic values. Both come in two flavors: one that
+// writes into a buffer the caller provides (sized with the matching *Size()
+// function) and returns how many chars it used, and one that returns a
+// string, which is allocated exactly once.
+
+// Room needed for HexDump() of size bytes. This is one more than it actually
+// writes, because the fast path always finishes with a trailing space.
+inline size_t HexDumpSize(size_t size) { return size * 3; }
+
+// Lowercase hex, with a space between bytes: "0a 1b 2c".
+size_t HexDump(ByteView bytes, char* out);
+std::string HexDump(ByteView bytes);
+inline std::string HexDump(const std::vector<uint8_t>& bytes) { return HexDump(ByteView(bytes)); }
+
+// Lowercase hex with nothing between bytes: "0a1b2c". Used for keys and for
+// machine readable output.
+std::string HexString(ByteView bytes);
+
+// Room needed for Printable() of size bytes.
+inline size_t PrintableSize(size_t size) { return size * 4; }
+
+// The bytes as a C string literal: printable ascii as is, the usual escapes
+// for control characters, and three digit octal for everything else.
+size_t Printable(ByteView bytes, char* out);
+std::string Printable(ByteView bytes);
+inline std::string Printable(const std::vector<uint8_t>& bytes) { return Printable(ByteView(bytes)); }
+
+// The plain table driven HexDump(), without the SIMD path. Only here so that
+// the two can be compared.
+size_t HexDumpScalar(ByteView bytes, char* out);
+
+}
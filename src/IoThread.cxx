@@ -0,0 +1,82 @@
+#include "IoThread.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <exception>
+#include <future>
+
+using namespace asha;
+
+
+IoThread::IoThread():
+   m_context(g_main_context_new(), g_main_context_unref),
+   m_loop(g_main_loop_new(m_context.get(), false), g_main_loop_unref)
+{
+   m_thread = std::thread([this]() {
+      g_main_context_push_thread_default(m_context.get());
+      g_main_loop_run(m_loop.get());
+      g_main_context_pop_thread_default(m_context.get());
+   });
+}
+
+
+IoThread::~IoThread()
+{
+   // Quit from inside the loop, in case it hasn't started running yet.
+   Invoke([this]() { g_main_loop_quit(m_loop.get()); });
+   m_thread.join();
+}
+
+
+void IoThread::Invoke(const std::function<void()>& fn)
+{
+   if (m_thread.get_id() == std::this_thread::get_id())
+   {
+      fn();
+      return;
+   }
+
+   struct Call
+   {
+      explicit Call(const std::function<void()>& f): fn(f) {}
+      const std::function<void()>& fn;
+      std::promise<void> done;
+   };
+   // Shared with the source, so that the promise is still around for as long
+   // as set_value() is busy with it, even after we've woken up.
+   auto call = std::make_shared<Call>(fn);
+   auto done = call->done.get_future();
+
+   // Lambda doesn't work with a C callback that needs a user_data.
+   struct Callback {
+      static gboolean Run(gpointer user_data)
+      {
+         auto& call = *(std::shared_ptr<Call>*)user_data;
+         try
+         {
+            call->fn();
+            call->done.set_value();
+         }
+         catch (...)
+         {
+            call->done.set_exception(std::current_exception());
+         }
+         return G_SOURCE_REMOVE;
+      }
+
+      static void Free(gpointer user_data)
+      {
+         delete (std::shared_ptr<Call>*)user_data;
+      }
+   };
+
+   // Not g_main_context_invoke(), which would run fn right here if the loop
+   // hasn't grabbed the context yet.
+   GSource* source = g_idle_source_new();
+   g_source_set_priority(source, G_PRIORITY_DEFAULT);
+   g_source_set_callback(source, &Callback::Run, new std::shared_ptr<Call>(call), &Callback::Free);
+   g_source_attach(source, m_context.get());
+   g_source_unref(source);
+
+   done.get();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <thread>
+
+struct _GMainContext;
+struct _GMainLoop;
+
+namespace asha
+{
+
+// A thread running its own GMainContext, for keeping dbus traffic moving no
+// matter what the rest of the program is up to.
+//
+// Bus, Bluetooth, and the characteristics and sockets they hand out all stay
+// with the thread they were created on: their signal subscriptions, replies
+// and socket watches get dispatched on that thread's default context. So
+// create them with Invoke(), use them from callbacks on this thread, and
+// destroy them with Invoke() before the IoThread goes away. Anything slow
+// should be passed on to a WorkerPool instead of running here.
+class IoThread final
+{
+public:
+   IoThread();
+   ~IoThread();
+
+   IoThread(const IoThread&) = delete;
+   IoThread& operator=(const IoThread&) = delete;
+
+   _GMainContext* Context() const { return m_context.get(); }
+
+   // Run fn on the thread and wait for it to finish. Anything fn throws gets
+   // rethrown here.
+   void Invoke(const std::function<void()>& fn);
+
+private:
+   std::shared_ptr<_GMainContext> m_context;
+   std::shared_ptr<_GMainLoop> m_loop;
+   std::thread m_thread;
+};
+
+}
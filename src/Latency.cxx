@@ -0,0 +1,156 @@
+#include "Latency.hh"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace asha;
+
+namespace
+{
+   std::atomic<bool> g_enabled{false};
+
+   // Recorders by path. Only touched when a subscription starts and when
+   // dumping, never per notification.
+   std::mutex g_mutex;
+   std::map<std::string, std::unique_ptr<NotifyLatency>>& Recorders()
+   {
+      static auto* recorders = new std::map<std::string, std::unique_ptr<NotifyLatency>>;
+      return *recorders;
+   }
+
+   // "812ns", "3.4us", "12.0ms".
+   std::string Duration(uint64_t ns)
+   {
+      char s[32];
+      if (ns < 1000)
+         snprintf(s, sizeof(s), "%lluns", (unsigned long long)ns);
+      else if (ns < 1000000)
+         snprintf(s, sizeof(s), "%.1fus", ns / 1e3);
+      else if (ns < 1000000000)
+         snprintf(s, sizeof(s), "%.1fms", ns / 1e6);
+      else
+         snprintf(s, sizeof(s), "%.2fs", ns / 1e9);
+      return s;
+   }
+
+   std::string Summary(const LatencyHistogram& h)
+   {
+      if (!h.Count())
+         return "-";
+      return "p50 " + Duration(h.Percentile(0.5)) + " p90 " + Duration(h.Percentile(0.9)) +
+             " p99 " + Duration(h.Percentile(0.99)) + " max " + Duration(h.Max());
+   }
+}
+
+
+size_t LatencyHistogram::Bucket(uint64_t value)
+{
+   if (value < (1u << SUB_BITS))
+      return (size_t)value;
+   int exponent = 63 - __builtin_clzll(value);
+   if (exponent > MAX_EXPONENT)
+      return BUCKETS - 1;
+   size_t sub = (size_t)(value >> (exponent - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+   return ((size_t)(exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+
+uint64_t LatencyHistogram::BucketLimit(size_t bucket)
+{
+   if (bucket < (1u << SUB_BITS))
+      return bucket;
+   int shift = (int)(bucket >> SUB_BITS) - 1;
+   uint64_t sub = bucket & ((1u << SUB_BITS) - 1);
+   uint64_t lower = ((1ull << SUB_BITS) + sub) << shift;
+   return lower + (1ull << shift) - 1;
+}
+
+
+uint64_t LatencyHistogram::Percentile(double fraction) const
+{
+   uint64_t count = Count();
+   if (!count)
+      return 0;
+   uint64_t wanted = std::max<uint64_t>(1, (uint64_t)std::ceil(fraction * count));
+   uint64_t seen = 0;
+   for (size_t i = 0; i < BUCKETS; ++i)
+   {
+      seen += m_buckets[i].load(std::memory_order_relaxed);
+      if (seen >= wanted)
+         return std::min(BucketLimit(i), Max());
+   }
+   // Buckets read after the count moved on.
+   return Max();
+}
+
+
+uint64_t LatencyHistogram::CountAtMost(uint64_t limit) const
+{
+   uint64_t ret = 0;
+   for (size_t i = 0; i < BUCKETS && BucketLimit(i) <= limit; ++i)
+      ret += m_buckets[i].load(std::memory_order_relaxed);
+   return ret;
+}
+
+
+double NotifyLatency::Rate() const
+{
+   int64_t first = m_first.load(std::memory_order_relaxed);
+   int64_t last = m_last.load(std::memory_order_relaxed);
+   uint64_t count = m_callback.Count();
+   if (count < 2 || last <= first)
+      return 0;
+   return (count - 1) * 1e9 / (last - first);
+}
+
+
+int64_t latency::Now()
+{
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+bool latency::Enabled()
+{
+   return g_enabled.load(std::memory_order_relaxed);
+}
+
+
+void latency::Enable(bool enabled)
+{
+   g_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+NotifyLatency* latency::ForPath(const std::string& path)
+{
+   std::lock_guard<std::mutex> lock(g_mutex);
+   auto& recorder = Recorders()[path];
+   if (!recorder)
+      recorder.reset(new NotifyLatency(path));
+   return recorder.get();
+}
+
+
+void latency::Dump()
+{
+   std::lock_guard<std::mutex> lock(g_mutex);
+   for (auto& kv: Recorders())
+   {
+      auto& r = *kv.second;
+      uint64_t count = r.Callback().Count();
+      if (!count)
+         continue;
+      fprintf(stderr, "%s: %llu notifications, %.1f/s\n   queued   %s\n   callback %s\n",
+              r.Path().c_str(), (unsigned long long)count, r.Rate(),
+              Summary(r.Queued()).c_str(), Summary(r.Callback()).c_str());
+   }
+}
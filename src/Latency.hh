@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace asha
+{
+
+// A histogram in the style of HdrHistogram: buckets are a power of two wide
+// at the top level, split into 16 linear sub-buckets, so every value is kept
+// to within about 6% no matter how big it is. Covers 0 to about 17 seconds
+// in nanoseconds, in a fixed 2 KiB.
+//
+// Only one thread may record into a histogram, but any thread can read it at
+// the same time, which gives a snapshot that may be an event or two behind.
+class LatencyHistogram final
+{
+public:
+   static constexpr int SUB_BITS = 4;
+   static constexpr int MAX_EXPONENT = 34;
+   static constexpr size_t BUCKETS = (1 << SUB_BITS) * (MAX_EXPONENT - SUB_BITS + 2);
+
+   void Record(uint64_t value)
+   {
+      Bump(m_buckets[Bucket(value)]);
+      Bump(m_count);
+      m_sum.store(m_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+      if (value > m_max.load(std::memory_order_relaxed))
+         m_max.store(value, std::memory_order_relaxed);
+   }
+
+   uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+   uint64_t Max() const { return m_max.load(std::memory_order_relaxed); }
+   uint64_t Sum() const { return m_sum.load(std::memory_order_relaxed); }
+   // The smallest value that at least fraction (0 to 1) of the recorded
+   // values are no bigger than, give or take a bucket.
+   uint64_t Percentile(double fraction) const;
+   // How many values were no bigger than limit, rounded down to a bucket,
+   // for exporting as a histogram with coarser buckets.
+   uint64_t CountAtMost(uint64_t limit) const;
+
+   static size_t Bucket(uint64_t value);
+   // The largest value that lands in bucket.
+   static uint64_t BucketLimit(size_t bucket);
+
+private:
+   // There is only ever one writer, so this doesn't need to be a locked add.
+   template <typename T>
+   static void Bump(std::atomic<T>& n)
+   {
+      n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+   }
+
+   std::atomic<uint32_t> m_buckets[BUCKETS] = {};
+   std::atomic<uint64_t> m_count{0};
+   std::atomic<uint64_t> m_sum{0};
+   std::atomic<uint64_t> m_max{0};
+};
+
+
+// Where the time goes for one characteristic's notifications: from the
+// signal arriving off the socket to the callback being entered (queued behind
+// whatever else the main loop was doing), and in the callback itself.
+class NotifyLatency final
+{
+public:
+   explicit NotifyLatency(const std::string& path): m_path(path) {}
+
+   // Times from latency::Now(). arrived is 0 when it isn't known, as for
+   // notifications from an AcquireNotify socket, which have no signal to
+   // wait behind.
+   void Record(int64_t arrived, int64_t entered, int64_t left)
+   {
+      if (arrived && entered >= arrived)
+         m_queued.Record(entered - arrived);
+      m_callback.Record(left >= entered ? left - entered : 0);
+      if (!m_first.load(std::memory_order_relaxed))
+         m_first.store(entered, std::memory_order_relaxed);
+      m_last.store(entered, std::memory_order_relaxed);
+   }
+
+   const std::string& Path() const { return m_path; }
+   const LatencyHistogram& Queued() const { return m_queued; }
+   const LatencyHistogram& Callback() const { return m_callback; }
+   // Notifications per second, between the first and the last one.
+   double Rate() const;
+
+private:
+   std::string m_path;
+   LatencyHistogram m_queued;
+   LatencyHistogram m_callback;
+   std::atomic<int64_t> m_first{0};
+   std::atomic<int64_t> m_last{0};
+};
+
+
+namespace latency
+{
+
+// Monotonic nanoseconds.
+int64_t Now();
+
+// Off until turned on. Turn it on before connecting to dbus, since that is
+// when the bus decides whether to timestamp signals as they arrive.
+bool Enabled();
+void Enable(bool enabled);
+
+// The recorder for the characteristic at path. The same one comes back for
+// as long as the program runs, so reconnects and resubscribes add to it, and
+// it never gets freed, so holding onto the pointer is always safe.
+NotifyLatency* ForPath(const std::string& path);
+
+// Print p50/p90/p99/max and the rate for every characteristic that has had a
+// notification, to stderr. Safe to call while notifications are coming in.
+void Dump();
+
+}
+}
@@ -0,0 +1,179 @@
+#include "Log.hh"
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+
+namespace
+{
+   constexpr const char* DOMAINS[asha::log::CATEGORY_COUNT] = {
+      "asha-device",
+      "asha-signal",
+   };
+
+   // -1 until G_MESSAGES_DEBUG has been looked at.
+   std::atomic<int> g_enabled[asha::log::CATEGORY_COUNT] = {{-1}, {-1}};
+
+   bool FromEnvironment(asha::log::Category c)
+   {
+      const char* domains = getenv("G_MESSAGES_DEBUG");
+      if (!domains)
+         return false;
+      // The same test glib's default handler uses.
+      return strcmp(domains, "all") == 0 || strstr(domains, DOMAINS[c]);
+   }
+
+
+   // Long enough for a device property dump; anything longer is cut off.
+   constexpr size_t ENTRY_TEXT = 240;
+
+   struct Entry
+   {
+      // 2n + 1 while message n is being written, 2n + 2 once it's done. The
+      // reader checks it before and after copying, and skips the entry if it
+      // changed underneath it.
+      std::atomic<uint64_t> seq{0};
+      int64_t time;
+      GLogLevelFlags level;
+      asha::log::Category category;
+      char text[ENTRY_TEXT];
+   };
+
+   struct Ring
+   {
+      explicit Ring(size_t n): entries(new Entry[n]), size(n) {}
+
+      std::unique_ptr<Entry[]> entries;
+      size_t size;
+      std::atomic<uint64_t> head{0};  // Next message number to hand out.
+      uint64_t tail = 0;              // Next one to flush.
+   };
+
+   // Never freed, so that a writer on another thread can't be left holding a
+   // dangling pointer.
+   Ring* g_ring = nullptr;
+
+
+   void WriteRing(Ring& ring, GLogLevelFlags level, asha::log::Category c, const char* format, va_list args)
+   {
+      uint64_t n = ring.head.fetch_add(1, std::memory_order_relaxed);
+      Entry& e = ring.entries[n % ring.size];
+      e.seq.store(n * 2 + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      e.time = g_get_monotonic_time();
+      e.level = level;
+      e.category = c;
+      vsnprintf(e.text, sizeof(e.text), format, args);
+
+      e.seq.store(n * 2 + 2, std::memory_order_release);
+   }
+
+
+   const char* LevelName(GLogLevelFlags level)
+   {
+      switch (level)
+      {
+      case G_LOG_LEVEL_ERROR:    return "ERROR";
+      case G_LOG_LEVEL_CRITICAL: return "CRITICAL";
+      case G_LOG_LEVEL_WARNING:  return "WARNING";
+      case G_LOG_LEVEL_MESSAGE:  return "Message";
+      case G_LOG_LEVEL_INFO:     return "INFO";
+      default:                   return "DEBUG";
+      }
+   }
+}
+
+
+const char* asha::log::Domain(Category c)
+{
+   return DOMAINS[c];
+}
+
+
+bool asha::log::CategoryEnabled(Category c)
+{
+   int enabled = g_enabled[c].load(std::memory_order_relaxed);
+   if (enabled < 0)
+   {
+      enabled = FromEnvironment(c);
+      g_enabled[c].store(enabled, std::memory_order_relaxed);
+   }
+   return enabled;
+}
+
+
+void asha::log::Enable(Category c, bool enabled)
+{
+   g_enabled[c].store(enabled, std::memory_order_relaxed);
+}
+
+
+void asha::log::Write(GLogLevelFlags level, Category c, const char* format, ...)
+{
+   va_list args;
+   va_start(args, format);
+   if (g_ring)
+      WriteRing(*g_ring, level, c, format, args);
+   else
+      g_logv(DOMAINS[c], level, format, args);
+   va_end(args);
+}
+
+
+void asha::log::UseRingBuffer(size_t entries)
+{
+   if (!g_ring && entries)
+      g_ring = new Ring(entries);
+}
+
+
+void asha::log::FlushRingBuffer()
+{
+   if (!g_ring)
+      return;
+   Ring& ring = *g_ring;
+
+   uint64_t head = ring.head.load(std::memory_order_acquire);
+   uint64_t n = ring.tail;
+   // Anything more than a lap behind has been written over.
+   if (head - n > ring.size)
+      n = head - ring.size;
+   uint64_t lost = n - ring.tail;
+
+   for (; n < head; ++n)
+   {
+      Entry& e = ring.entries[n % ring.size];
+      uint64_t seq = e.seq.load(std::memory_order_acquire);
+      if (seq != n * 2 + 2)
+      {
+         // Still being written, or already lapped.
+         ++lost;
+         continue;
+      }
+      int64_t time = e.time;
+      GLogLevelFlags level = e.level;
+      asha::log::Category c = e.category;
+      char text[ENTRY_TEXT];
+      memcpy(text, e.text, sizeof(text));
+      text[sizeof(text) - 1] = '\0';
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (e.seq.load(std::memory_order_relaxed) != seq)
+      {
+         ++lost;
+         continue;
+      }
+      g_printerr("[%" G_GINT64_FORMAT ".%06" G_GINT64_FORMAT "] %s-%s: %s\n",
+         time / G_USEC_PER_SEC, time % G_USEC_PER_SEC, DOMAINS[c], LevelName(level), text);
+   }
+   if (lost)
+      g_printerr("%" G_GUINT64_FORMAT " log messages lost\n", lost);
+
+   ring.tail = head;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <glib-2.0/glib.h>
+
+#include <cstddef>
+
+// Anything less important than this is compiled out entirely, arguments and
+// all. Build with -DASHA_LOG_MIN_LEVEL=G_LOG_LEVEL_MESSAGE to drop the info
+// and debug logging.
+#ifndef ASHA_LOG_MIN_LEVEL
+#define ASHA_LOG_MIN_LEVEL G_LOG_LEVEL_DEBUG
+#endif
+
+namespace asha
+{
+namespace log
+{
+
+// Chatty areas that can be turned on and off on their own. Each one logs to
+// its own glib domain ("asha-device", "asha-signal"), so G_MESSAGES_DEBUG
+// picks them the same way it does for any other domain.
+enum Category
+{
+   DEVICE,     // Every device property, as it arrives.
+   SIGNAL,     // Signals nobody handles.
+   CATEGORY_COUNT
+};
+
+const char* Domain(Category c);
+
+// Whether info and debug messages in this category are wanted. Starts out
+// following G_MESSAGES_DEBUG, read the first time it's needed. Turning on a
+// category that G_MESSAGES_DEBUG leaves out is only useful with the ring
+// buffer, since glib drops those messages anyway.
+bool CategoryEnabled(Category c);
+void Enable(Category c, bool enabled);
+
+inline bool Enabled(GLogLevelFlags level, Category c)
+{
+   if (level > ASHA_LOG_MIN_LEVEL)
+      return false;
+   // glib always shows messages and worse.
+   if (level < G_LOG_LEVEL_INFO)
+      return true;
+   return CategoryEnabled(c);
+}
+
+// Use ASHA_LOG instead, so that the arguments only get evaluated when the
+// message is going somewhere.
+void Write(GLogLevelFlags level, Category c, const char* format, ...) G_GNUC_PRINTF(3, 4);
+
+// Keep the last entries messages in memory instead of logging them, for
+// FlushRingBuffer() to print on demand. Writing to it takes no locks, so it
+// is safe from any thread. Call this once, before anything gets logged.
+void UseRingBuffer(size_t entries);
+
+// Print whatever is in the ring buffer to stderr, oldest first, and empty it.
+// Only call this from one thread at a time (e.g. from the main loop, on
+// SIGUSR1).
+void FlushRingBuffer();
+
+}
+}
+
+#define ASHA_LOG(level, category, ...) \
+   do { \
+      if (asha::log::Enabled(level, category)) \
+         asha::log::Write(level, category, __VA_ARGS__); \
+   } while (0)
+
+#define ASHA_INFO(category, ...) ASHA_LOG(G_LOG_LEVEL_INFO, asha::log::category, __VA_ARGS__)
+#define ASHA_DEBUG(category, ...) ASHA_LOG(G_LOG_LEVEL_DEBUG, asha::log::category, __VA_ARGS__)
@@ -0,0 +1,171 @@
+#include "Metrics.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+
+using namespace asha;
+
+namespace
+{
+   constexpr char PREFIX[] = "gatt_dump_";
+
+   // Prometheus buckets for call latency, in seconds. dbus round trips to
+   // bluez run from a few hundred microseconds to the full call timeout.
+   constexpr double CALL_BUCKETS[] = {
+      0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25,
+   };
+
+   std::atomic<bool> g_enabled{false};
+
+   // Only touched when something is looked up for the first time, and when
+   // rendering.
+   std::mutex g_mutex;
+   std::map<std::string, std::unique_ptr<CallMetrics>>& Calls()
+   {
+      static auto* calls = new std::map<std::string, std::unique_ptr<CallMetrics>>;
+      return *calls;
+   }
+   std::map<std::string, std::unique_ptr<NotifyCounters>>& Notifications()
+   {
+      static auto* notifications = new std::map<std::string, std::unique_ptr<NotifyCounters>>;
+      return *notifications;
+   }
+
+   // Label values are quoted, with backslashes, quotes and newlines escaped.
+   std::string Label(const char* name, const std::string& value)
+   {
+      std::string ret = name;
+      ret += "=\"";
+      for (char c: value)
+      {
+         if (c == '\\' || c == '"')
+            ret += '\\';
+         if (c == '\n')
+         {
+            ret += "\\n";
+            continue;
+         }
+         ret += c;
+      }
+      return ret + '"';
+   }
+
+   void Header(std::string& out, const char* name, const char* type, const char* help)
+   {
+      out += "# HELP ";
+      out += PREFIX;
+      out += name;
+      out += ' ';
+      out += help;
+      out += "\n# TYPE ";
+      out += PREFIX;
+      out += name;
+      out += ' ';
+      out += type;
+      out += '\n';
+   }
+
+   void Sample(std::string& out, const char* name, const std::string& labels, double value)
+   {
+      char number[32];
+      snprintf(number, sizeof(number), "%.17g", value);
+      out += PREFIX;
+      out += name;
+      out += '{';
+      out += labels;
+      out += "} ";
+      out += number;
+      out += '\n';
+   }
+}
+
+
+void CallMetrics::Record(int64_t ns, bool ok)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_latency.Record(ns > 0 ? (uint64_t)ns : 0);
+   if (!ok)
+      m_errors.store(m_errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+
+bool metrics::Enabled()
+{
+   return g_enabled.load(std::memory_order_relaxed);
+}
+
+
+void metrics::Enable(bool enabled)
+{
+   g_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+CallMetrics* metrics::ForMethod(const char* interface, const char* method)
+{
+   std::lock_guard<std::mutex> lock(g_mutex);
+   auto& metrics = Calls()[std::string(interface) + "." + method];
+   if (!metrics)
+      metrics.reset(new CallMetrics(interface, method));
+   return metrics.get();
+}
+
+
+NotifyCounters* metrics::ForCharacteristic(const std::string& path)
+{
+   std::lock_guard<std::mutex> lock(g_mutex);
+   auto& counters = Notifications()[path];
+   if (!counters)
+      counters.reset(new NotifyCounters(path));
+   return counters.get();
+}
+
+
+std::string metrics::Render()
+{
+   std::lock_guard<std::mutex> lock(g_mutex);
+   std::string out;
+
+   auto method = [](const CallMetrics& m) {
+      return Label("interface", m.Interface()) + "," + Label("method", m.Method());
+   };
+
+   Header(out, "dbus_calls_total", "counter", "dbus method calls made to bluez.");
+   for (auto& kv: Calls())
+      Sample(out, "dbus_calls_total", method(*kv.second), kv.second->Latency().Count());
+
+   Header(out, "dbus_call_errors_total", "counter", "dbus method calls to bluez that failed.");
+   for (auto& kv: Calls())
+      Sample(out, "dbus_call_errors_total", method(*kv.second), kv.second->Errors());
+
+   Header(out, "dbus_call_seconds", "histogram", "Time from making a dbus call to having its reply.");
+   for (auto& kv: Calls())
+   {
+      auto& h = kv.second->Latency();
+      // Read the count first, so that no bucket can come out bigger than it.
+      uint64_t count = h.Count();
+      std::string labels = method(*kv.second);
+      for (double le: CALL_BUCKETS)
+      {
+         char bound[32];
+         snprintf(bound, sizeof(bound), "%g", le);
+         uint64_t n = std::min(count, h.CountAtMost((uint64_t)(le * 1e9)));
+         Sample(out, "dbus_call_seconds_bucket", labels + "," + Label("le", bound), n);
+      }
+      Sample(out, "dbus_call_seconds_bucket", labels + "," + Label("le", "+Inf"), count);
+      Sample(out, "dbus_call_seconds_sum", labels, h.Sum() / 1e9);
+      Sample(out, "dbus_call_seconds_count", labels, count);
+   }
+
+   Header(out, "notifications_total", "counter", "Notifications received, by characteristic.");
+   for (auto& kv: Notifications())
+      Sample(out, "notifications_total", Label("path", kv.first), kv.second->Count());
+
+   Header(out, "notification_bytes_total", "counter", "Bytes of notification values received, by characteristic.");
+   for (auto& kv: Notifications())
+      Sample(out, "notification_bytes_total", Label("path", kv.first), kv.second->Bytes());
+
+   return out;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Latency.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace asha
+{
+
+// Counters and a latency histogram for one dbus method. Calls can finish on
+// any thread, so recording takes a lock, which is nothing next to the round
+// trip being recorded.
+class CallMetrics final
+{
+public:
+   CallMetrics(const std::string& interface, const std::string& method): m_interface(interface), m_method(method) {}
+
+   // Nanoseconds from issuing the call to having the reply, or the error.
+   void Record(int64_t ns, bool ok);
+
+   const std::string& Interface() const { return m_interface; }
+   const std::string& Method() const { return m_method; }
+   uint64_t Errors() const { return m_errors.load(std::memory_order_relaxed); }
+   const LatencyHistogram& Latency() const { return m_latency; }
+
+private:
+   std::string m_interface;
+   std::string m_method;
+   std::mutex m_mutex;
+   LatencyHistogram m_latency;
+   std::atomic<uint64_t> m_errors{0};
+};
+
+
+// Notifications and bytes for one characteristic. Only the thread delivering
+// the characteristic's notifications may record.
+class NotifyCounters final
+{
+public:
+   explicit NotifyCounters(const std::string& path): m_path(path) {}
+
+   void Record(size_t bytes)
+   {
+      m_count.store(m_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      m_bytes.store(m_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+   }
+
+   const std::string& Path() const { return m_path; }
+   uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+   uint64_t Bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+
+private:
+   std::string m_path;
+   std::atomic<uint64_t> m_count{0};
+   std::atomic<uint64_t> m_bytes{0};
+};
+
+
+namespace metrics
+{
+
+// Off until turned on, and like latency recording, turn it on before
+// connecting to dbus.
+bool Enabled();
+void Enable(bool enabled);
+
+// Both are never freed, so holding onto the pointer is always safe, and they
+// keep counting across reconnects.
+CallMetrics* ForMethod(const char* interface, const char* method);
+NotifyCounters* ForCharacteristic(const std::string& path);
+
+// Times a call from construction to Finish(), when metrics are on.
+class CallTimer final
+{
+public:
+   CallTimer(const char* interface, const char* method):
+      m_metrics(Enabled() ? ForMethod(interface, method) : nullptr),
+      m_start(m_metrics ? latency::Now() : 0)
+   {
+   }
+
+   void Finish(bool ok)
+   {
+      if (m_metrics)
+         m_metrics->Record(latency::Now() - m_start, ok);
+   }
+
+private:
+   CallMetrics* m_metrics;
+   int64_t m_start;
+};
+
+// Everything, in the Prometheus text exposition format.
+std::string Render();
+
+}
+}
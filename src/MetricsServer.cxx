@@ -0,0 +1,274 @@
+#include "MetricsServer.hh"
+#include "Metrics.hh"
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace asha;
+
+namespace
+{
+   constexpr char UNIX_PREFIX[] = "unix:";
+   constexpr char LOOPBACK[] = "127.0.0.1";
+
+   // g_unix_fd_add() and g_source_remove() only know about the global
+   // default context, which may not be the one running this thread.
+   unsigned AddWatch(GMainContext* context, int fd, GIOCondition condition, GUnixFDSourceFunc fn, gpointer user_data)
+   {
+      GSource* source = g_unix_fd_source_new(fd, condition);
+      g_source_set_callback(source, (GSourceFunc)fn, user_data, nullptr);
+      unsigned id = g_source_attach(source, context);
+      g_source_unref(source);
+      return id;
+   }
+
+   void RemoveWatch(GMainContext* context, unsigned& id)
+   {
+      GSource* source = g_main_context_find_source_by_id(context, id);
+      if (source)
+         g_source_destroy(source);
+      id = 0;
+   }
+
+   int ListenUnix(const std::string& path)
+   {
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (path.empty() || path.size() >= sizeof(addr.sun_path))
+      {
+         g_warning("Bad metrics socket path: %s", path.c_str());
+         return -1;
+      }
+      memcpy(addr.sun_path, path.c_str(), path.size());
+
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+         return -1;
+      // Left behind by an earlier run that didn't get to clean up. Anything
+      // that isn't a socket is left alone, and bind() reports it.
+      struct stat st;
+      if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+         unlink(path.c_str());
+      if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+      {
+         g_warning("Unable to listen on %s: %s", path.c_str(), strerror(errno));
+         close(fd);
+         return -1;
+      }
+      return fd;
+   }
+
+   int ListenTcp(const std::string& host, const std::string& port)
+   {
+      char* end = nullptr;
+      unsigned long n = strtoul(port.c_str(), &end, 10);
+      sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons((uint16_t)n);
+      if (port.empty() || *end || n == 0 || n > 65535 || inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+      {
+         g_warning("Bad metrics address: %s:%s", host.c_str(), port.c_str());
+         return -1;
+      }
+
+      int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+         return -1;
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+      {
+         g_warning("Unable to listen on %s:%s: %s", host.c_str(), port.c_str(), strerror(errno));
+         close(fd);
+         return -1;
+      }
+      return fd;
+   }
+
+   std::string Response(const char* status, const std::string& body)
+   {
+      std::string ret = "HTTP/1.0 ";
+      ret += status;
+      ret += "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: ";
+      ret += std::to_string(body.size());
+      ret += "\r\nConnection: close\r\n\r\n";
+      return ret + body;
+   }
+}
+
+
+MetricsServer::MetricsServer(const std::string& address):
+   m_context(g_main_context_ref_thread_default(), g_main_context_unref)
+{
+   if (address.compare(0, sizeof(UNIX_PREFIX) - 1, UNIX_PREFIX) == 0)
+   {
+      m_unix_path = address.substr(sizeof(UNIX_PREFIX) - 1);
+      m_fd = ListenUnix(m_unix_path);
+      if (m_fd < 0)
+         m_unix_path.clear();
+   }
+   else
+   {
+      size_t colon = address.rfind(':');
+      if (colon == std::string::npos)
+         m_fd = ListenTcp(LOOPBACK, address);
+      else
+         m_fd = ListenTcp(address.substr(0, colon), address.substr(colon + 1));
+   }
+   if (m_fd < 0)
+      throw std::runtime_error("Unable to serve metrics");
+
+   // Lambda doesn't work with a C callback that needs a user_data.
+   struct Callback {
+      static gboolean Acceptable(gint fd, GIOCondition condition, gpointer user_data)
+      {
+         ((MetricsServer*)user_data)->Accept();
+         return G_SOURCE_CONTINUE;
+      }
+   };
+   m_source = AddWatch(m_context.get(), m_fd, G_IO_IN, &Callback::Acceptable, this);
+   g_info("Serving metrics on %s", address.c_str());
+}
+
+
+MetricsServer::~MetricsServer()
+{
+   while (!m_clients.empty())
+      Drop(m_clients.back().get());
+   if (m_source)
+      RemoveWatch(m_context.get(), m_source);
+   close(m_fd);
+   if (!m_unix_path.empty())
+      unlink(m_unix_path.c_str());
+}
+
+
+void MetricsServer::Accept()
+{
+   struct Callback {
+      static gboolean Readable(gint fd, GIOCondition condition, gpointer user_data)
+      {
+         auto* client = (Client*)user_data;
+         if ((condition & G_IO_IN) && client->server->Read(*client))
+            return G_SOURCE_CONTINUE;
+         // Drop removes this source, and the return value is ignored once
+         // it has been destroyed.
+         client->server->Drop(client);
+         return G_SOURCE_REMOVE;
+      }
+      static gboolean Expired(gpointer user_data)
+      {
+         auto* client = (Client*)user_data;
+         client->deadline = 0;
+         client->server->Drop(client);
+         return G_SOURCE_REMOVE;
+      }
+   };
+
+   // Take everything that is waiting, so one wakeup can cover a burst.
+   for (;;)
+   {
+      int fd = accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+      {
+         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            g_info("Error accepting metrics connection: %s", strerror(errno));
+         return;
+      }
+      if (m_clients.size() >= MAX_CLIENTS)
+      {
+         close(fd);
+         continue;
+      }
+
+      std::unique_ptr<Client> client(new Client{this, fd});
+      client->source = AddWatch(m_context.get(), fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), &Callback::Readable, client.get());
+      GSource* deadline = g_timeout_source_new(CLIENT_TIMEOUT_MS);
+      g_source_set_callback(deadline, &Callback::Expired, client.get(), nullptr);
+      client->deadline = g_source_attach(deadline, m_context.get());
+      g_source_unref(deadline);
+      m_clients.push_back(std::move(client));
+   }
+}
+
+
+bool MetricsServer::Read(Client& client)
+{
+   char buffer[1024];
+   ssize_t n = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+   if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+   if (n == 0)
+      return false;
+   client.request.append(buffer, n);
+
+   // Nothing in the headers matters, but they have to have all arrived
+   // before replying, or closing would reset the connection under them.
+   if (client.request.find("\r\n\r\n") == std::string::npos)
+      return client.request.size() <= MAX_REQUEST;
+
+   if (client.request.compare(0, 4, "GET ") == 0)
+      client.reply = Response("200 OK", metrics::Render());
+   else
+      client.reply = Response("405 Method Not Allowed", "Only GET is supported\n");
+   client.request.clear();
+
+   struct Callback {
+      static gboolean Writable(gint fd, GIOCondition condition, gpointer user_data)
+      {
+         auto* client = (Client*)user_data;
+         if ((condition & G_IO_OUT) && client->server->Write(*client))
+            return G_SOURCE_CONTINUE;
+         client->server->Drop(client);
+         return G_SOURCE_REMOVE;
+      }
+   };
+
+   // Most replies go in one write, without waiting for the socket to say
+   // it is writable.
+   if (!Write(client))
+      return false;
+   RemoveWatch(m_context.get(), client.source);
+   client.source = AddWatch(m_context.get(), client.fd, (GIOCondition)(G_IO_OUT | G_IO_HUP | G_IO_ERR), &Callback::Writable, &client);
+   return true;
+}
+
+
+bool MetricsServer::Write(Client& client)
+{
+   while (client.sent < client.reply.size())
+   {
+      ssize_t n = send(client.fd, client.reply.data() + client.sent, client.reply.size() - client.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n < 0)
+         return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      client.sent += n;
+   }
+   // All sent, and HTTP/1.0 means closing is how the client knows.
+   return false;
+}
+
+
+void MetricsServer::Drop(Client* client)
+{
+   if (client->source)
+      RemoveWatch(m_context.get(), client->source);
+   if (client->deadline)
+      RemoveWatch(m_context.get(), client->deadline);
+   close(client->fd);
+   auto it = std::find_if(m_clients.begin(), m_clients.end(), [client](const std::unique_ptr<Client>& c) { return c.get() == client; });
+   if (it != m_clients.end())
+      m_clients.erase(it);
+}
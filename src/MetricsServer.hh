@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct _GMainContext;
+
+namespace asha
+{
+
+// Serves metrics::Render() over HTTP for Prometheus to scrape, from the
+// calling thread's default main context. Every GET gets the metrics, whatever
+// the path. Sockets are non-blocking and the reply is written as the client
+// takes it, so a slow scraper never holds up the main loop.
+class MetricsServer final
+{
+public:
+   // address is unix:PATH for a Unix socket, PORT for the loopback
+   // interface, or HOST:PORT. Throws if it can't listen there.
+   explicit MetricsServer(const std::string& address);
+   ~MetricsServer();
+
+   MetricsServer(const MetricsServer&) = delete;
+   MetricsServer& operator=(const MetricsServer&) = delete;
+
+   // Connections beyond this get closed straight away.
+   static constexpr size_t MAX_CLIENTS = 16;
+   // Requests bigger than this get closed without a reply.
+   static constexpr size_t MAX_REQUEST = 8192;
+   // Connections still open this long after accept get closed, so idle
+   // clients can't hold every slot and lock out the scraper.
+   static constexpr unsigned CLIENT_TIMEOUT_MS = 10000;
+
+private:
+   struct Client
+   {
+      MetricsServer* server;
+      int fd;
+      unsigned source = 0;
+      unsigned deadline = 0;
+      std::string request;
+      std::string reply;
+      size_t sent = 0;
+   };
+
+   void Accept();
+   // Return false when the client is finished with, and should be dropped.
+   bool Read(Client& client);
+   bool Write(Client& client);
+   void Drop(Client* client);
+
+   std::shared_ptr<_GMainContext> m_context;
+   int m_fd = -1;
+   unsigned m_source = 0;
+   std::string m_unix_path;
+   std::vector<std::unique_ptr<Client>> m_clients;
+};
+
+}
@@ -0,0 +1,157 @@
+#include "ObjectCache.hh"
+
+#include <gio/gio.h>
+
+#include <cstring>
+
+using namespace asha;
+
+namespace
+{
+   constexpr char VALUE[] = "Value";
+
+   std::shared_ptr<GVariant> Wrap(GVariant* value)
+   {
+      return std::shared_ptr<GVariant>(value, g_variant_unref);
+   }
+}
+
+
+void ObjectCache::Reset(GVariant* objects)
+{
+   m_objects.clear();
+
+   GVariantIter it;
+   g_variant_iter_init(&it, objects);
+   gchar* path{};
+   GVariant* interfaces{};
+   while (g_variant_iter_loop(&it, "{o@a{sa{sv}}}", &path, &interfaces))
+      AddInterfaces(path, interfaces);
+}
+
+
+void ObjectCache::AddInterfaces(const std::string& path, GVariant* interfaces)
+{
+   auto& object = m_objects[path];
+
+   GVariantIter it;
+   g_variant_iter_init(&it, interfaces);
+   gchar* interface{};
+   GVariant* properties{};
+   while (g_variant_iter_loop(&it, "{s@a{sv}}", &interface, &properties))
+   {
+      auto& entry = object[interface];
+      entry.dictionary = Wrap(g_variant_ref(properties));
+      GVariant* value = g_variant_lookup_value(properties, VALUE, G_VARIANT_TYPE_BYTESTRING);
+      entry.value = value ? Wrap(value) : nullptr;
+   }
+}
+
+
+void ObjectCache::RemoveInterfaces(const std::string& path, GVariant* interfaces)
+{
+   auto object = m_objects.find(path);
+   if (object == m_objects.end())
+      return;
+
+   GVariantIter it;
+   g_variant_iter_init(&it, interfaces);
+   gchar* interface{};
+   while (g_variant_iter_loop(&it, "s", &interface))
+      object->second.erase(interface);
+
+   if (object->second.empty())
+      m_objects.erase(object);
+}
+
+
+void ObjectCache::UpdateProperties(const char* path, const char* interface, GVariant* changed, GVariant* invalidated)
+{
+   // Don't resurrect objects that were already removed.
+   auto object = m_objects.find(path);
+   if (object == m_objects.end())
+      return;
+   auto properties = object->second.find(interface);
+   if (properties == object->second.end())
+      return;
+
+   // Nearly every signal is a notification that only changes Value, which
+   // goes straight into its slot. Anything else rebuilds the dictionary.
+   auto& entry = properties->second;
+   bool rebuild = false;
+   GVariantIter it;
+   g_variant_iter_init(&it, changed);
+   const gchar* key{};
+   GVariant* value{};
+   while (g_variant_iter_next(&it, "{&sv}", &key, &value))
+   {
+      if (strcmp(key, VALUE) != 0)
+      {
+         rebuild = true;
+         g_variant_unref(value);
+      }
+      else if (g_variant_is_of_type(value, G_VARIANT_TYPE_BYTESTRING))
+         entry.value = Wrap(value);
+      else
+         g_variant_unref(value);
+   }
+   if (invalidated)
+   {
+      g_variant_iter_init(&it, invalidated);
+      while (g_variant_iter_next(&it, "&s", &key))
+      {
+         if (strcmp(key, VALUE) == 0)
+            entry.value.reset();
+         else
+            rebuild = true;
+      }
+   }
+   if (!rebuild)
+      return;
+
+   GVariantDict dict;
+   g_variant_dict_init(&dict, entry.dictionary.get());
+
+   gchar* name{};
+   g_variant_iter_init(&it, changed);
+   while (g_variant_iter_loop(&it, "{sv}", &name, &value))
+   {
+      if (strcmp(name, VALUE) != 0)
+         g_variant_dict_insert_value(&dict, name, value);
+   }
+
+   if (invalidated)
+   {
+      g_variant_iter_init(&it, invalidated);
+      while (g_variant_iter_loop(&it, "s", &name))
+         g_variant_dict_remove(&dict, name);
+   }
+
+   // g_variant_dict_end returns a floating reference.
+   entry.dictionary = Wrap(g_variant_ref_sink(g_variant_dict_end(&dict)));
+}
+
+
+std::shared_ptr<_GVariant> ObjectCache::Find(const std::string& path, const std::string& interface) const
+{
+   auto object = m_objects.find(path);
+   if (object == m_objects.end())
+      return nullptr;
+   auto properties = object->second.find(interface);
+   if (properties == object->second.end())
+      return nullptr;
+   return properties->second.dictionary;
+}
+
+
+void ObjectCache::ForEachChild(const std::string& parent, const std::function<void(const std::string&, const Interfaces&)>& fn) const
+{
+   // Every child path starts with "parent/", and they all sort together.
+   std::string prefix = parent + '/';
+   for (auto it = m_objects.lower_bound(prefix); it != m_objects.end(); ++it)
+   {
+      if (it->first.compare(0, prefix.size(), prefix) != 0)
+         break;
+      fn(it->first, it->second);
+   }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+struct _GVariant;
+
+namespace asha
+{
+
+// In-process mirror of the bluez object tree. It gets seeded from a single
+// GetManagedObjects call, and then kept up to date from the InterfacesAdded,
+// InterfacesRemoved and PropertiesChanged signals, so that nothing else needs
+// to go back to the bus to look at it.
+class ObjectCache final
+{
+public:
+   // One interface's properties. Value changes with every notification, so
+   // it is kept on its own rather than in the dictionary, which would have to
+   // be rebuilt each time. Whatever Value the dictionary has is the one it had
+   // when the interface was added.
+   struct Properties
+   {
+      std::shared_ptr<_GVariant> dictionary; // a{sv}
+      std::shared_ptr<_GVariant> value;      // ay, or null if there is none
+   };
+   // Properties keyed by interface name. Both maps can be searched with a
+   // plain C string, without building a std::string.
+   typedef std::map<std::string, Properties, std::less<>> Interfaces;
+   // Interfaces keyed by object path. This is ordered, so all the children of
+   // an object are contiguous.
+   typedef std::map<std::string, Interfaces, std::less<>> Objects;
+
+   // Replace everything with the reply from GetManagedObjects (a{oa{sa{sv}}}).
+   void Reset(struct _GVariant* objects);
+   // Apply an InterfacesAdded signal. interfaces is a{sa{sv}}.
+   void AddInterfaces(const std::string& path, struct _GVariant* interfaces);
+   // Apply an InterfacesRemoved signal. interfaces is as.
+   void RemoveInterfaces(const std::string& path, struct _GVariant* interfaces);
+   // Apply a PropertiesChanged signal. changed is a{sv}, invalidated is as.
+   // Every notification comes through here, hence the C strings.
+   void UpdateProperties(const char* path, const char* interface, struct _GVariant* changed, struct _GVariant* invalidated);
+
+   const Objects& All() const { return m_objects; }
+
+   // Look up the property dictionary of one interface on one object. Returns
+   // null if the object doesn't have that interface.
+   std::shared_ptr<_GVariant> Find(const std::string& path, const std::string& interface) const;
+
+   // Call fn for every object underneath parent (not including parent itself).
+   void ForEachChild(const std::string& parent, const std::function<void(const std::string&, const Interfaces&)>& fn) const;
+
+private:
+   Objects m_objects;
+};
+
+}
@@ -0,0 +1,385 @@
+#include "OutputSink.hh"
+#include "Characteristic.hh"
+#include "Hex.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace asha;
+
+namespace
+{
+   const char* TypeName(OutputEvent::Type type)
+   {
+      switch (type)
+      {
+      case OutputEvent::Type::DEVICE: return "device";
+      case OutputEvent::Type::SERVICE: return "service";
+      case OutputEvent::Type::CHARACTERISTIC: return "characteristic";
+      case OutputEvent::Type::DESCRIPTOR: return "descriptor";
+      case OutputEvent::Type::NOTIFY: return "notify";
+      }
+      return "unknown";
+   }
+
+   // "/char0012" out of ".../service000a/char0012".
+   std::string LastComponent(const std::string& path)
+   {
+      auto slash = path.rfind('/');
+      return slash == std::string::npos ? path : path.substr(slash);
+   }
+
+   // Exactly what gatt_dump has always printed.
+   class TextFormat final: public OutputFormat
+   {
+   public:
+      void Append(const OutputEvent& e, std::string& out) const override
+      {
+         switch (e.type)
+         {
+         case OutputEvent::Type::DEVICE:
+            out += e.name + " with " + std::to_string(e.services) + " services\n";
+            break;
+         case OutputEvent::Type::SERVICE:
+            out += "   " + e.uuid.ToString() + " " + e.path + "\n";
+            break;
+         case OutputEvent::Type::CHARACTERISTIC:
+            out += "      " + e.uuid.ToString() + " " + LastComponent(e.path) + " [";
+            {
+               const char* separator = "";
+               for (auto name: Characteristic::FlagNames(e.flags))
+               {
+                  out += separator;
+                  out += name;
+                  separator = ", ";
+               }
+            }
+            out += "] ";
+            if (e.subscribed)
+               out += "[subscribed] ";
+            AppendRead(e, out);
+            out += '\n';
+            break;
+         case OutputEvent::Type::DESCRIPTOR:
+            out += "         " + e.uuid.ToString() + " " + LastComponent(e.path) + " [" + e.name + "] ";
+            AppendRead(e, out);
+            out += '\n';
+            break;
+         case OutputEvent::Type::NOTIFY:
+            out += "Notify: " + e.uuid.ToString() + " " + e.path + " " + HexDump(e.value) + '\n';
+            break;
+         }
+      }
+
+   private:
+      static void AppendRead(const OutputEvent& e, std::string& out)
+      {
+         if (e.read == OutputEvent::Read::DONE)
+            out += HexDump(e.value) + " \"" + Printable(e.value) + "\"";
+         else if (e.read == OutputEvent::Read::SKIPPED)
+            out += " <not read>";
+      }
+   };
+
+
+   // Walks the fields of an event in a fixed order, so that the JSON and CBOR
+   // encodings always agree. Writer needs Begin(field count), Key(), String(),
+   // Uint(), Bool(), Bytes(), Strings() and End().
+   template <typename Writer>
+   void Encode(const OutputEvent& e, Writer& w)
+   {
+      typedef OutputEvent::Type Type;
+      bool value = e.type == Type::NOTIFY || e.read == OutputEvent::Read::DONE;
+      bool skipped = e.read == OutputEvent::Read::SKIPPED;
+
+      size_t fields = 3;
+      switch (e.type)
+      {
+      case Type::DEVICE: fields += 3; break;
+      case Type::SERVICE: fields += 2; break;
+      case Type::CHARACTERISTIC: fields += 4; break;
+      case Type::DESCRIPTOR: fields += 3; break;
+      case Type::NOTIFY: fields += 2; break;
+      }
+      fields += value + skipped;
+
+      w.Begin(fields);
+      w.Key("type"); w.String(TypeName(e.type));
+      w.Key("time"); w.Uint((uint64_t)e.time);
+      w.Key("device"); w.String(e.device);
+      if (e.type == Type::DEVICE)
+      {
+         w.Key("name"); w.String(e.name);
+         w.Key("address"); w.String(e.address);
+         w.Key("services"); w.Uint(e.services);
+      }
+      else
+      {
+         w.Key("path"); w.String(e.path);
+         w.Key("uuid"); w.String(e.uuid.ToString());
+      }
+      if (e.type == Type::CHARACTERISTIC)
+      {
+         w.Key("flags"); w.Strings(Characteristic::FlagNames(e.flags));
+         w.Key("subscribed"); w.Bool(e.subscribed);
+      }
+      if (e.type == Type::DESCRIPTOR)
+      {
+         w.Key("name"); w.String(e.name);
+      }
+      if (value)
+      {
+         w.Key("value"); w.Bytes(e.value);
+      }
+      if (skipped)
+      {
+         w.Key("skipped"); w.Bool(true);
+      }
+      w.End();
+   }
+
+
+   // One object per line. Values are hex strings.
+   class JsonWriter
+   {
+   public:
+      explicit JsonWriter(std::string& out): m_out(out) {}
+
+      void Begin(size_t) { m_out += '{'; m_first = true; }
+      void End() { m_out += "}\n"; }
+
+      void Key(const char* key)
+      {
+         if (!m_first)
+            m_out += ',';
+         m_first = false;
+         Quote(key, strlen(key));
+         m_out += ':';
+      }
+
+      void String(const std::string& s) { Quote(s.data(), s.size()); }
+      void String(const char* s) { Quote(s, strlen(s)); }
+      void Uint(uint64_t n) { m_out += std::to_string(n); }
+      void Bool(bool b) { m_out += b ? "true" : "false"; }
+      void Bytes(const std::vector<uint8_t>& bytes)
+      {
+         m_out += '"';
+         m_out += HexString(ByteView(bytes));
+         m_out += '"';
+      }
+      void Strings(const std::vector<const char*>& list)
+      {
+         m_out += '[';
+         for (size_t i = 0; i < list.size(); ++i)
+         {
+            if (i)
+               m_out += ',';
+            String(list[i]);
+         }
+         m_out += ']';
+      }
+
+   private:
+      // dbus strings are already UTF-8, so only quotes, backslashes and
+      // control characters need escaping.
+      void Quote(const char* s, size_t size)
+      {
+         m_out += '"';
+         for (size_t i = 0; i < size; ++i)
+         {
+            unsigned char c = s[i];
+            switch (c)
+            {
+            case '"': m_out += "\\\""; break;
+            case '\\': m_out += "\\\\"; break;
+            case '\n': m_out += "\\n"; break;
+            case '\r': m_out += "\\r"; break;
+            case '\t': m_out += "\\t"; break;
+            default:
+               if (c < 0x20)
+               {
+                  char escape[8];
+                  snprintf(escape, sizeof(escape), "\\u%04x", c);
+                  m_out += escape;
+               }
+               else
+                  m_out += (char)c;
+            }
+         }
+         m_out += '"';
+      }
+
+      std::string& m_out;
+      bool m_first = true;
+   };
+
+
+   // One map per event, with text keys and values as byte strings.
+   class CborWriter
+   {
+   public:
+      explicit CborWriter(std::string& out): m_out(out) {}
+
+      void Begin(size_t fields) { Head(5, fields); }
+      void End() {}
+
+      void Key(const char* key) { String(key); }
+      void String(const std::string& s) { Head(3, s.size()); m_out += s; }
+      void String(const char* s) { size_t size = strlen(s); Head(3, size); m_out.append(s, size); }
+      void Uint(uint64_t n) { Head(0, n); }
+      void Bool(bool b) { m_out += (char)(b ? 0xf5 : 0xf4); }
+      void Bytes(const std::vector<uint8_t>& bytes)
+      {
+         Head(2, bytes.size());
+         m_out.append((const char*)bytes.data(), bytes.size());
+      }
+      void Strings(const std::vector<const char*>& list)
+      {
+         Head(4, list.size());
+         for (auto s: list)
+            String(s);
+      }
+
+   private:
+      // The major type and the shortest encoding of n that fits.
+      void Head(uint8_t major, uint64_t n)
+      {
+         major <<= 5;
+         if (n < 24)
+         {
+            m_out += (char)(major | n);
+            return;
+         }
+         int bytes;
+         if (n <= 0xff)
+         {
+            m_out += (char)(major | 24);
+            bytes = 1;
+         }
+         else if (n <= 0xffff)
+         {
+            m_out += (char)(major | 25);
+            bytes = 2;
+         }
+         else if (n <= 0xffffffff)
+         {
+            m_out += (char)(major | 26);
+            bytes = 4;
+         }
+         else
+         {
+            m_out += (char)(major | 27);
+            bytes = 8;
+         }
+         for (int i = bytes - 1; i >= 0; --i)
+            m_out += (char)(n >> (i * 8));
+      }
+
+      std::string& m_out;
+   };
+
+
+   template <typename Writer>
+   class EncodedFormat final: public OutputFormat
+   {
+   public:
+      void Append(const OutputEvent& e, std::string& out) const override
+      {
+         Writer w(out);
+         Encode(e, w);
+      }
+   };
+}
+
+
+std::unique_ptr<OutputFormat> OutputFormat::Create(const std::string& name)
+{
+   if (name == "text")
+      return std::unique_ptr<OutputFormat>(new TextFormat);
+   if (name == "json")
+      return std::unique_ptr<OutputFormat>(new EncodedFormat<JsonWriter>);
+   if (name == "cbor")
+      return std::unique_ptr<OutputFormat>(new EncodedFormat<CborWriter>);
+   return nullptr;
+}
+
+
+OutputSink::OutputSink(int fd, std::unique_ptr<OutputFormat> format, FlushPolicy policy, size_t buffer_size):
+   m_fd(fd),
+   m_format(std::move(format)),
+   m_policy(policy),
+   m_buffer_size(std::max<size_t>(buffer_size, 1))
+{
+   m_buffer.reserve(m_buffer_size);
+}
+
+
+OutputSink::~OutputSink()
+{
+   Flush();
+}
+
+
+void OutputSink::Write(const OutputEvent& e)
+{
+   // Encode before taking the lock, so that writers only contend for the
+   // copy into the buffer.
+   std::string encoded;
+   m_format->Append(e, encoded);
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_buffer += encoded;
+   if (m_policy == FlushPolicy::EVENT || m_buffer.size() >= m_buffer_size)
+      FlushLocked();
+}
+
+
+void OutputSink::Write(const std::vector<OutputEvent>& events)
+{
+   if (events.empty())
+      return;
+   std::string encoded;
+   for (auto& e: events)
+      m_format->Append(e, encoded);
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_buffer += encoded;
+   if (m_policy == FlushPolicy::EVENT || m_buffer.size() >= m_buffer_size)
+      FlushLocked();
+}
+
+
+void OutputSink::Flush()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   FlushLocked();
+}
+
+
+void OutputSink::FlushLocked()
+{
+   const char* p = m_buffer.data();
+   size_t remaining = m_buffer.size();
+   while (remaining)
+   {
+      ssize_t n = write(m_fd, p, remaining);
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         // Nothing sensible to do with output nobody can read, beyond not
+         // letting it pile up.
+         g_warning("Dropping %zu bytes of output: %s", remaining, strerror(errno));
+         break;
+      }
+      p += n;
+      remaining -= n;
+   }
+   m_buffer.clear();
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Uuid.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace asha
+{
+
+// One thing worth reporting about a device, in a form that can be written
+// out as text for people or encoded for programs.
+struct OutputEvent
+{
+   enum class Type
+   {
+      DEVICE,
+      SERVICE,
+      CHARACTERISTIC,
+      DESCRIPTOR,
+      NOTIFY,
+   };
+
+   enum class Read
+   {
+      NONE,      // Not readable.
+      DONE,      // value holds what was read, which is empty if it failed.
+      SKIPPED,   // Readable, but deliberately left alone.
+   };
+
+   Type type = Type::DEVICE;
+   // Microseconds since the epoch: when the device was added, when the value
+   // arrived, and so on.
+   int64_t time = 0;
+   std::string device;        // Device object path.
+   std::string path;          // Object path of the service, characteristic or descriptor.
+   std::string name;          // Device name, or what kind of descriptor this is.
+   std::string address;       // Devices only.
+   size_t services = 0;       // Devices only.
+   Uuid uuid;
+   uint32_t flags = 0;        // Characteristic::Flag bits.
+   bool subscribed = false;
+   Read read = Read::NONE;
+   std::vector<uint8_t> value;
+};
+
+
+// Turns events into bytes.
+class OutputFormat
+{
+public:
+   virtual ~OutputFormat() {}
+
+   // Appends e to out.
+   virtual void Append(const OutputEvent& e, std::string& out) const = 0;
+
+   // "text" for the traditional human readable dump, "json" for JSON Lines,
+   // or "cbor" for a CBOR sequence (RFC 8742) of one map per event. Returns
+   // null for anything else.
+   static std::unique_ptr<OutputFormat> Create(const std::string& name);
+};
+
+
+// Encodes events into a userspace buffer, and writes the buffer to a file
+// descriptor according to the flush policy. Events can come from any thread.
+class OutputSink final
+{
+public:
+   enum class FlushPolicy
+   {
+      EVENT,     // After every event, for watching interactively.
+      BUFFER,    // Only when the buffer fills up, or on Flush().
+   };
+
+   OutputSink(int fd, std::unique_ptr<OutputFormat> format, FlushPolicy policy, size_t buffer_size = 1 << 16);
+   // Flushes whatever is left.
+   ~OutputSink();
+
+   OutputSink(const OutputSink&) = delete;
+   OutputSink& operator=(const OutputSink&) = delete;
+
+   void Write(const OutputEvent& e);
+   void Write(const std::vector<OutputEvent>& events);
+   void Flush();
+
+private:
+   void FlushLocked();
+
+   int m_fd;
+   std::unique_ptr<OutputFormat> m_format;
+   FlushPolicy m_policy;
+   size_t m_buffer_size;
+
+   std::mutex m_mutex;
+   std::string m_buffer;
+};
+
+}
@@ -0,0 +1,172 @@
+#include "Quarantine.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <cstring>
+#include <memory>
+
+using namespace asha;
+
+constexpr unsigned Quarantine::STRIKES;
+
+namespace
+{
+   constexpr char STRIKES_KEY[] = "Strikes";
+   constexpr char DEVICE_KEY[] = "Device";
+   constexpr char REASON_KEY[] = "Reason";
+
+   std::string GetString(GKeyFile* keys, const gchar* group, const gchar* key)
+   {
+      std::shared_ptr<gchar> value(g_key_file_get_string(keys, group, key, nullptr), g_free);
+      return value ? value.get() : std::string();
+   }
+}
+
+
+Quarantine::Quarantine(const std::string& file):
+   m_file(file)
+{
+   if (!m_file.empty())
+      Load();
+}
+
+
+std::string Quarantine::DefaultFile()
+{
+   std::shared_ptr<gchar> path(g_build_filename(g_get_user_cache_dir(), "gatt_dump", "quarantine", nullptr), g_free);
+   return path.get();
+}
+
+
+bool Quarantine::Contains(const Uuid& uuid, const std::string& mac) const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return ContainsLocked(uuid, mac);
+}
+
+
+bool Quarantine::ContainsLocked(const Uuid& uuid, const std::string& mac) const
+{
+   for (auto& key: {Key(mac, uuid), Key(std::string(), uuid)})
+   {
+      auto it = m_entries.find(key);
+      if (it != m_entries.end() && it->second.strikes >= STRIKES)
+         return true;
+   }
+   return false;
+}
+
+
+void Quarantine::Add(const Uuid& uuid, const std::string& mac, const std::string& reason)
+{
+   if (mac.empty())
+      return;
+   std::unique_lock<std::mutex> lock(m_mutex);
+   if (ContainsLocked(uuid, mac))
+      return;
+   auto& entry = m_entries[Key(mac, uuid)];
+   entry.strikes = STRIKES;
+   entry.reason = reason;
+   g_warning("Quarantining %s, %s on %s", uuid.ToString().c_str(), reason.c_str(), mac.c_str());
+   Save(lock);
+}
+
+
+void Quarantine::Strike(const Uuid& uuid, const std::string& mac, const std::string& reason)
+{
+   if (mac.empty())
+      return;
+   std::unique_lock<std::mutex> lock(m_mutex);
+   if (ContainsLocked(uuid, mac))
+      return;
+   auto& entry = m_entries[Key(mac, uuid)];
+   ++entry.strikes;
+   entry.reason = reason;
+   if (entry.strikes >= STRIKES)
+      g_warning("Quarantining %s, %s on %s", uuid.ToString().c_str(), reason.c_str(), mac.c_str());
+   else
+      g_info("Strike %u against %s, %s on %s", entry.strikes, uuid.ToString().c_str(), reason.c_str(), mac.c_str());
+   Save(lock);
+}
+
+
+void Quarantine::Load()
+{
+   std::shared_ptr<GKeyFile> keys(g_key_file_new(), g_key_file_free);
+   GError* err = nullptr;
+   if (!g_key_file_load_from_file(keys.get(), m_file.c_str(), G_KEY_FILE_NONE, &err))
+   {
+      // Not having one yet is normal.
+      if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+         g_warning("Unable to load %s: %s", m_file.c_str(), err->message);
+      g_error_free(err);
+      return;
+   }
+
+   gchar** groups = g_key_file_get_groups(keys.get(), nullptr);
+   for (gchar** group = groups; *group; ++group)
+   {
+      // Either "MAC UUID", or a UUID by itself for every device.
+      std::string mac;
+      const gchar* uuid_string = *group;
+      const gchar* space = strchr(*group, ' ');
+      if (space)
+      {
+         mac.assign(*group, space - *group);
+         uuid_string = space + 1;
+      }
+      else
+      {
+         // Files from before entries were per device name it separately.
+         mac = GetString(keys.get(), *group, DEVICE_KEY);
+      }
+      Uuid uuid = Uuid::TryParse(uuid_string);
+      if (uuid.IsNull())
+      {
+         g_warning("%s: ignoring [%s], which isn't a UUID", m_file.c_str(), *group);
+         continue;
+      }
+      auto& entry = m_entries[Key(mac, uuid)];
+      // Anything put in by hand without a count is meant to be quarantined.
+      entry.strikes = g_key_file_has_key(keys.get(), *group, STRIKES_KEY, nullptr) ?
+         (unsigned)g_key_file_get_integer(keys.get(), *group, STRIKES_KEY, nullptr) : STRIKES;
+      entry.reason = GetString(keys.get(), *group, REASON_KEY);
+   }
+   g_strfreev(groups);
+}
+
+
+void Quarantine::Save(std::unique_lock<std::mutex>& lock)
+{
+   if (m_file.empty())
+      return;
+
+   std::shared_ptr<GKeyFile> keys(g_key_file_new(), g_key_file_free);
+   for (auto& kv: m_entries)
+   {
+      std::string group = kv.first.second.ToString();
+      if (!kv.first.first.empty())
+         group = kv.first.first + ' ' + group;
+      g_key_file_set_integer(keys.get(), group.c_str(), STRIKES_KEY, (gint)kv.second.strikes);
+      if (!kv.second.reason.empty())
+         g_key_file_set_string(keys.get(), group.c_str(), REASON_KEY, kv.second.reason.c_str());
+   }
+
+   gsize length = 0;
+   std::shared_ptr<gchar> data(g_key_file_to_data(keys.get(), &length, nullptr), g_free);
+   uint64_t generation = ++m_generation;
+   lock.unlock();
+
+   std::lock_guard<std::mutex> saving(m_save_mutex);
+   if (generation <= m_saved)
+      return;
+   m_saved = generation;
+   std::shared_ptr<gchar> directory(g_path_get_dirname(m_file.c_str()), g_free);
+   GError* err = nullptr;
+   g_mkdir_with_parents(directory.get(), 0700);
+   if (!g_file_set_contents(m_file.c_str(), data.get(), length, &err))
+   {
+      g_warning("Unable to save quarantine to %s: %s", m_file.c_str(), err->message);
+      g_error_free(err);
+   }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Uuid.hh"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace asha
+{
+
+// Characteristics that aren't safe to read, learned from reads that timed out
+// or took the device down with them. Kept in a key file, so that later runs
+// skip them without anybody having to add them to a list by hand:
+//
+//    [00:11:22:33:44:55 2bdcaebe-8746-45df-a841-96b840980fb8]
+//    Strikes=2
+//    Reason=in flight when the device disconnected
+//
+// Entries are per device, since the same UUID is often fine elsewhere; a
+// group named by the UUID alone applies to every device.
+//
+// A read that times out quarantines its characteristic straight away. A
+// disconnect only counts as a strike against every read that was in flight,
+// since there is no telling which of them caused it, and it takes STRIKES of
+// those. Delete the file, or the characteristic's group, to let it be read
+// again.
+//
+// Safe to share between threads, which the per-adapter dumps do.
+class Quarantine final
+{
+public:
+   static constexpr unsigned STRIKES = 2;
+
+   // An empty file keeps the quarantine in memory only.
+   explicit Quarantine(const std::string& file = DefaultFile());
+
+   // $XDG_CACHE_HOME/gatt_dump/quarantine, or ~/.cache/gatt_dump/quarantine.
+   static std::string DefaultFile();
+
+   // Whether uuid is quarantined on the device with address mac.
+   bool Contains(const Uuid& uuid, const std::string& mac) const;
+
+   // Quarantine uuid on mac now. Without a mac there is nothing to key it
+   // by, and nothing happens.
+   void Add(const Uuid& uuid, const std::string& mac, const std::string& reason);
+   // One strike against uuid on mac, which gets quarantined once it has
+   // STRIKES.
+   void Strike(const Uuid& uuid, const std::string& mac, const std::string& reason);
+
+private:
+   // The device's address, or empty for every device.
+   using Key = std::pair<std::string, Uuid>;
+
+   struct Entry
+   {
+      unsigned strikes = 0;
+      std::string reason;
+   };
+
+   bool ContainsLocked(const Uuid& uuid, const std::string& mac) const;
+   void Load();
+   // Unlocks lock, so that other threads aren't held up while the file gets
+   // written.
+   void Save(std::unique_lock<std::mutex>& lock);
+
+   mutable std::mutex m_mutex;
+   std::string m_file;
+   std::map<Key, Entry> m_entries;
+   // Bumped by every change. Saves can finish out of order, and one that
+   // has been overtaken mustn't overwrite what came after it.
+   uint64_t m_generation = 0;
+
+   std::mutex m_save_mutex;
+   uint64_t m_saved = 0;
+};
+
+}
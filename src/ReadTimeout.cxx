@@ -0,0 +1,20 @@
+#include "ReadTimeout.hh"
+
+#include <algorithm>
+
+using namespace asha;
+
+constexpr int ReadTimeout::INITIAL_MS;
+constexpr int ReadTimeout::MIN_MS;
+constexpr int ReadTimeout::MAX_MS;
+constexpr uint64_t ReadTimeout::MIN_SAMPLES;
+constexpr unsigned ReadTimeout::P99_MULTIPLE;
+
+
+int ReadTimeout::Timeout() const
+{
+   if (m_latency.Count() < MIN_SAMPLES)
+      return INITIAL_MS;
+   uint64_t ms = m_latency.Percentile(0.99) * P99_MULTIPLE / 1000000;
+   return (int)std::min<uint64_t>(std::max<uint64_t>(ms, MIN_MS), MAX_MS);
+}
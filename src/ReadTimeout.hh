@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Latency.hh"
+
+#include <cstdint>
+
+namespace asha
+{
+
+// Picks the timeout for reads on one device from how long its reads have
+// been taking, so that a read that is never going to be answered gives up
+// long before bluez's 25 seconds, without cutting off a device that is just
+// slow. Until there are enough reads to go on, reads get INITIAL_MS.
+class ReadTimeout final
+{
+public:
+   static constexpr int INITIAL_MS = 10000;
+   static constexpr int MIN_MS = 1000;
+   static constexpr int MAX_MS = 10000;
+   // Reads needed before the p99 is worth going on.
+   static constexpr uint64_t MIN_SAMPLES = 8;
+   // How far past the p99 a read can run before it gets given up on.
+   static constexpr unsigned P99_MULTIPLE = 4;
+
+   // How long a read that succeeded took, in nanoseconds. Failed reads
+   // don't count; a timed out one would only push the timeout up.
+   void Record(int64_t ns) { m_latency.Record(ns > 0 ? (uint64_t)ns : 0); }
+
+   // In milliseconds, for Bus::CallAsync.
+   int Timeout() const;
+
+private:
+   LatencyHistogram m_latency;
+};
+
+}
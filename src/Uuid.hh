@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+namespace asha
+{
+
+// A 128 bit UUID, packed into two integers so that comparing, hashing and
+// copying one is cheap. Parses the usual "0000180a-0000-1000-8000-00805f9b34fb"
+// form that bluez uses, at compile time for literals.
+class Uuid final
+{
+public:
+   constexpr Uuid() {}
+   constexpr Uuid(uint64_t hi, uint64_t lo): m_hi(hi), m_lo(lo) {}
+
+   // Throws std::invalid_argument on anything malformed. That is only a
+   // compile error where the literal gets constant evaluated, so keep
+   // tables of _uuid literals constexpr; anywhere else a bad one throws
+   // during static initialisation.
+   static constexpr Uuid Parse(const char* s, size_t length)
+   {
+      bool ok = false;
+      Uuid ret = TryParse(s, length, ok);
+      return ok ? ret : throw std::invalid_argument("Malformed UUID");
+   }
+
+   // Gives back a null Uuid on anything malformed.
+   static constexpr Uuid TryParse(const char* s, size_t length)
+   {
+      bool ok = false;
+      Uuid ret = TryParse(s, length, ok);
+      return ok ? ret : Uuid();
+   }
+   static Uuid TryParse(const std::string& s) { return TryParse(s.data(), s.size()); }
+   static Uuid TryParse(const char* s) { return TryParse(s, strlen(s)); }
+
+   // A Bluetooth SIG assigned number in the base UUID,
+   // 0000xxxx-0000-1000-8000-00805f9b34fb.
+   static constexpr Uuid FromShort(uint16_t n) { return Uuid(BASE_HI | ((uint64_t)n << 32), BASE_LO); }
+
+   std::string ToString() const
+   {
+      char s[37];
+      size_t n = 0;
+      for (int i = 0; i < 32; ++i)
+      {
+         if (i == 8 || i == 12 || i == 16 || i == 20)
+            s[n++] = '-';
+         uint64_t half = i < 16 ? m_hi : m_lo;
+         s[n++] = "0123456789abcdef"[(half >> (60 - (i % 16) * 4)) & 0xf];
+      }
+      return std::string(s, n);
+   }
+
+   constexpr uint64_t High() const { return m_hi; }
+   constexpr uint64_t Low() const { return m_lo; }
+   constexpr bool IsNull() const { return m_hi == 0 && m_lo == 0; }
+
+   constexpr bool operator==(const Uuid& o) const { return m_hi == o.m_hi && m_lo == o.m_lo; }
+   constexpr bool operator!=(const Uuid& o) const { return !(*this == o); }
+   constexpr bool operator<(const Uuid& o) const { return m_hi < o.m_hi || (m_hi == o.m_hi && m_lo < o.m_lo); }
+
+private:
+   static constexpr uint64_t BASE_HI = 0x0000000000001000ull;
+   static constexpr uint64_t BASE_LO = 0x800000805f9b34fbull;
+
+   static constexpr int Nibble(char c)
+   {
+      return c >= '0' && c <= '9' ? c - '0'
+           : c >= 'a' && c <= 'f' ? c - 'a' + 10
+           : c >= 'A' && c <= 'F' ? c - 'A' + 10
+           : -1;
+   }
+
+   static constexpr Uuid TryParse(const char* s, size_t length, bool& ok)
+   {
+      ok = false;
+      if (length != 36)
+         return Uuid();
+      uint64_t half[2] = {0, 0};
+      int digits = 0;
+      for (size_t i = 0; i < length; ++i)
+      {
+         if (i == 8 || i == 13 || i == 18 || i == 23)
+         {
+            if (s[i] != '-')
+               return Uuid();
+            continue;
+         }
+         int n = Nibble(s[i]);
+         if (n < 0)
+            return Uuid();
+         half[digits / 16] = (half[digits / 16] << 4) | (uint64_t)n;
+         ++digits;
+      }
+      ok = true;
+      return Uuid(half[0], half[1]);
+   }
+
+   uint64_t m_hi = 0;
+   uint64_t m_lo = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& o, const Uuid& u)
+{
+   return o << u.ToString();
+}
+
+namespace literals
+{
+   // "0000180a-0000-1000-8000-00805f9b34fb"_uuid
+   constexpr Uuid operator"" _uuid(const char* s, size_t length) { return Uuid::Parse(s, length); }
+}
+
+}
+
+namespace std
+{
+template <>
+struct hash<asha::Uuid>
+{
+   size_t operator()(const asha::Uuid& u) const
+   {
+      // The low half is the same for every SIG assigned UUID, so mix both.
+      uint64_t h = u.High() * 0x9e3779b97f4a7c15ull ^ u.Low();
+      return (size_t)(h ^ (h >> 32));
+   }
+};
+}
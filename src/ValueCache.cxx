@@ -0,0 +1,333 @@
+#include "ValueCache.hh"
+#include "GattTable.hh"
+#include "Hex.hh"
+
+#include <glib-2.0/glib.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+using namespace asha;
+
+namespace
+{
+   // "GDVC", then a version, so that a file from some other format never
+   // gets mistaken for values.
+   constexpr uint32_t MAGIC = 0x43564447;
+   constexpr uint32_t VERSION = 1;
+
+   const Uuid STATIC_UUIDS[] = {
+      Uuid::FromShort(0x2a00),   // Device Name
+      Uuid::FromShort(0x2a01),   // Appearance
+      Uuid::FromShort(0x2a04),   // Peripheral Preferred Connection Parameters
+      Uuid::FromShort(0x2a23),   // System ID
+      Uuid::FromShort(0x2a24),   // Model Number String
+      Uuid::FromShort(0x2a25),   // Serial Number String
+      Uuid::FromShort(0x2a26),   // Firmware Revision String
+      Uuid::FromShort(0x2a27),   // Hardware Revision String
+      Uuid::FromShort(0x2a28),   // Software Revision String
+      Uuid::FromShort(0x2a29),   // Manufacturer Name String
+      Uuid::FromShort(0x2a2a),   // IEEE 11073-20601 Regulatory Certification Data List
+      Uuid::FromShort(0x2a50),   // PnP ID
+      Uuid::FromShort(0x2900),   // Characteristic Extended Properties
+      Uuid::FromShort(0x2901),   // Characteristic User Description
+      Uuid::FromShort(0x2904),   // Characteristic Presentation Format
+      Uuid::FromShort(0x2905),   // Characteristic Aggregate Format
+   };
+
+   // Little endian, whatever the host is.
+   void Put32(std::string& out, uint32_t n)
+   {
+      for (int i = 0; i < 4; ++i)
+         out += (char)(n >> (i * 8));
+   }
+
+   void Put64(std::string& out, uint64_t n)
+   {
+      Put32(out, (uint32_t)n);
+      Put32(out, (uint32_t)(n >> 32));
+   }
+
+   void PutBytes(std::string& out, const void* data, size_t size)
+   {
+      Put32(out, (uint32_t)size);
+      out.append((const char*)data, size);
+   }
+
+   // Bounds checked reads from a file's contents. Any read past the end
+   // fails, and so does every one after it.
+   class Reader
+   {
+   public:
+      Reader(const char* data, size_t size): m_data((const uint8_t*)data), m_size(size) {}
+
+      bool Ok() const { return m_ok; }
+      bool AtEnd() const { return m_offset == m_size; }
+
+      uint32_t Get32()
+      {
+         if (!Need(4))
+            return 0;
+         uint32_t n = 0;
+         for (int i = 0; i < 4; ++i)
+            n |= (uint32_t)m_data[m_offset++] << (i * 8);
+         return n;
+      }
+
+      uint64_t Get64()
+      {
+         uint64_t lo = Get32();
+         return lo | ((uint64_t)Get32() << 32);
+      }
+
+      const uint8_t* GetBytes(size_t& size)
+      {
+         size = Get32();
+         if (!Need(size))
+            return nullptr;
+         const uint8_t* ret = m_data + m_offset;
+         m_offset += size;
+         return ret;
+      }
+
+   private:
+      bool Need(size_t n)
+      {
+         m_ok = m_ok && m_size - m_offset >= n;
+         return m_ok;
+      }
+
+      const uint8_t* m_data;
+      size_t m_size;
+      size_t m_offset = 0;
+      bool m_ok = true;
+   };
+
+
+   // FNV-1a, which is plenty for telling two databases apart.
+   class Fingerprint
+   {
+   public:
+      void Add(const void* data, size_t size)
+      {
+         for (size_t i = 0; i < size; ++i)
+         {
+            m_hash ^= ((const uint8_t*)data)[i];
+            m_hash *= 0x100000001b3ull;
+         }
+      }
+      void Add(const char* s) { Add(s, strlen(s) + 1); }
+      void Add(const Uuid& uuid)
+      {
+         uint64_t halves[] = {uuid.High(), uuid.Low()};
+         Add(halves, sizeof(halves));
+      }
+
+      uint64_t Value() const { return m_hash; }
+
+   private:
+      uint64_t m_hash = 0xcbf29ce484222325ull;
+   };
+}
+
+
+ValueCache::ValueCache(const std::string& directory):
+   m_directory(directory)
+{
+}
+
+
+std::string ValueCache::DefaultDirectory()
+{
+   std::shared_ptr<gchar> path(g_build_filename(g_get_user_cache_dir(), "gatt_dump", nullptr), g_free);
+   return path.get();
+}
+
+
+bool ValueCache::IsStatic(const Uuid& uuid)
+{
+   for (auto& u: STATIC_UUIDS)
+      if (u == uuid)
+         return true;
+   return false;
+}
+
+
+std::string ValueCache::HashKey(ByteView hash)
+{
+   return "hash:" + HexString(hash);
+}
+
+
+std::string ValueCache::TableKey(const std::string& device_path, const GattTable& gatt)
+{
+   // Paths relative to the device, so that the key is the same whichever
+   // adapter the device turns up on.
+   Fingerprint f;
+   auto add = [&](const char* path, const Uuid& uuid) {
+      f.Add(path + std::min(device_path.size(), strlen(path)));
+      f.Add(uuid);
+   };
+   for (auto s: gatt.Services())
+   {
+      add(s.Path(), s.UUID());
+      for (auto c: s.Characteristics())
+      {
+         add(c.Path(), c.UUID());
+         uint32_t flags = c.Flags();
+         f.Add(&flags, sizeof(flags));
+         for (auto d: c.Descriptors())
+            add(d.Path(), d.UUID());
+      }
+   }
+   uint64_t value = f.Value();
+   uint8_t bytes[8];
+   for (int i = 0; i < 8; ++i)
+      bytes[i] = (uint8_t)(value >> (56 - i * 8));
+   return "gatt:" + HexString(ByteView(bytes, sizeof(bytes)));
+}
+
+
+bool ValueCache::Open(const std::string& mac, const std::string& key)
+{
+   if (m_directory.empty() || mac.empty())
+      return false;
+
+   Device& device = m_devices[mac];
+   if (device.key == key && !device.values.empty())
+      return true;
+
+   device = Device();
+   if (Load(mac, device) && device.key == key)
+      return !device.values.empty();
+
+   if (!device.key.empty())
+      g_info("Database of %s changed, dropping its cached values", mac.c_str());
+   device = Device();
+   device.key = key;
+   // Nothing left worth keeping in the file either.
+   unlink(FileName(mac).c_str());
+   return false;
+}
+
+
+void ValueCache::Invalidate(const std::string& mac)
+{
+   if (m_directory.empty() || mac.empty())
+      return;
+   m_devices.erase(mac);
+   unlink(FileName(mac).c_str());
+}
+
+
+void ValueCache::Save(const std::string& mac)
+{
+   auto it = m_devices.find(mac);
+   if (it == m_devices.end() || !it->second.dirty)
+      return;
+   Device& device = it->second;
+
+   std::string out;
+   Put32(out, MAGIC);
+   Put32(out, VERSION);
+   PutBytes(out, device.key.data(), device.key.size());
+   Put32(out, (uint32_t)device.values.size());
+   for (auto& kv: device.values)
+   {
+      PutBytes(out, kv.first.data(), kv.first.size());
+      Put64(out, kv.second.uuid.High());
+      Put64(out, kv.second.uuid.Low());
+      PutBytes(out, kv.second.value.data(), kv.second.value.size());
+   }
+
+   GError* err = nullptr;
+   g_mkdir_with_parents(m_directory.c_str(), 0700);
+   if (!g_file_set_contents(FileName(mac).c_str(), out.data(), out.size(), &err))
+   {
+      g_warning("Unable to save cached values for %s: %s", mac.c_str(), err->message);
+      g_error_free(err);
+      return;
+   }
+   device.dirty = false;
+}
+
+
+bool ValueCache::Find(const std::string& mac, const std::string& attribute, const Uuid& uuid, std::vector<uint8_t>& value) const
+{
+   auto device = m_devices.find(mac);
+   if (device == m_devices.end())
+      return false;
+   auto it = device->second.values.find(attribute);
+   if (it == device->second.values.end() || it->second.uuid != uuid)
+      return false;
+   value = it->second.value;
+   return true;
+}
+
+
+void ValueCache::Store(const std::string& mac, const std::string& attribute, const Uuid& uuid, ByteView value)
+{
+   auto device = m_devices.find(mac);
+   if (device == m_devices.end())
+      return;
+   auto& entry = device->second.values[attribute];
+   entry.uuid = uuid;
+   entry.value = value.ToVector();
+   device->second.dirty = true;
+}
+
+
+std::string ValueCache::FileName(const std::string& mac) const
+{
+   std::string name = mac;
+   for (auto& c: name)
+      if (c == ':')
+         c = '_';
+   std::shared_ptr<gchar> path(g_build_filename(m_directory.c_str(), name.c_str(), nullptr), g_free);
+   return path.get();
+}
+
+
+bool ValueCache::Load(const std::string& mac, Device& device) const
+{
+   gchar* contents = nullptr;
+   gsize length = 0;
+   if (!g_file_get_contents(FileName(mac).c_str(), &contents, &length, nullptr))
+      return false;
+   std::shared_ptr<gchar> pcontents(contents, g_free);
+
+   Reader r(contents, length);
+   if (r.Get32() != MAGIC || r.Get32() != VERSION)
+      return false;
+
+   size_t size = 0;
+   const uint8_t* data = r.GetBytes(size);
+   if (!data)
+      return false;
+   device.key.assign((const char*)data, size);
+
+   uint32_t count = r.Get32();
+   for (uint32_t i = 0; i < count && r.Ok(); ++i)
+   {
+      data = r.GetBytes(size);
+      if (!data)
+         break;
+      std::string attribute((const char*)data, size);
+      uint64_t hi = r.Get64();
+      uint64_t lo = r.Get64();
+      data = r.GetBytes(size);
+      if (!data)
+         break;
+      device.values[attribute] = Entry{Uuid(hi, lo), std::vector<uint8_t>(data, data + size)};
+   }
+   if (!r.Ok() || !r.AtEnd())
+   {
+      g_warning("Ignoring damaged value cache for %s", mac.c_str());
+      device = Device();
+      return false;
+   }
+   return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ByteView.hh"
+#include "Uuid.hh"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace asha
+{
+
+class GattTable;
+
+// Values of attributes that don't change for as long as the device's GATT
+// database doesn't, saved on disk so that reconnecting doesn't have to read
+// them over the radio again.
+//
+// Each device gets a file named after its address, tagged with a key for the
+// database it was read from: the Database Hash characteristic when the device
+// has one, and a fingerprint of the services, characteristics and
+// descriptors bluez found otherwise. Values stored under any other key get
+// thrown away.
+class ValueCache final
+{
+public:
+   // An empty directory turns the cache off.
+   explicit ValueCache(const std::string& directory = DefaultDirectory());
+
+   // $XDG_CACHE_HOME/gatt_dump, or ~/.cache/gatt_dump.
+   static std::string DefaultDirectory();
+
+   // Whether this is a characteristic or descriptor whose value is fixed for
+   // a given database, like Device Name or Characteristic User Description.
+   static bool IsStatic(const Uuid& uuid);
+
+   // The key for a device with a Database Hash of hash.
+   static std::string HashKey(ByteView hash);
+   // The key for a device without one.
+   static std::string TableKey(const std::string& device_path, const GattTable& gatt);
+
+   // Start serving mac's values, if they were stored under key. Otherwise
+   // start over. Returns whether anything was found.
+   bool Open(const std::string& mac, const std::string& key);
+   // Forget everything about mac, on disk too.
+   void Invalidate(const std::string& mac);
+   // Write mac's values out, if anything changed since they were loaded.
+   void Save(const std::string& mac);
+
+   // attribute is the object path relative to the device.
+   bool Find(const std::string& mac, const std::string& attribute, const Uuid& uuid, std::vector<uint8_t>& value) const;
+   void Store(const std::string& mac, const std::string& attribute, const Uuid& uuid, ByteView value);
+
+private:
+   struct Entry
+   {
+      Uuid uuid;
+      std::vector<uint8_t> value;
+   };
+
+   struct Device
+   {
+      std::string key;
+      std::map<std::string, Entry> values;
+      bool dirty = false;
+   };
+
+   std::string FileName(const std::string& mac) const;
+   bool Load(const std::string& mac, Device& device) const;
+
+   std::string m_directory;
+   std::map<std::string, Device> m_devices;
+};
+
+}
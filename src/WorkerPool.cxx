@@ -0,0 +1,96 @@
+#include "WorkerPool.hh"
+
+#include <algorithm>
+#include <atomic>
+
+using namespace asha;
+
+
+WorkerPool::WorkerPool(size_t threads, size_t queue_size)
+{
+   threads = std::max<size_t>(threads, 1);
+   for (size_t i = 0; i < threads; ++i)
+      m_workers.emplace_back(new Worker(queue_size));
+   // Start them only once the vector has stopped moving.
+   for (auto& w: m_workers)
+      w->thread = std::thread(&WorkerPool::Run, this, std::ref(*w));
+}
+
+
+WorkerPool::~WorkerPool()
+{
+   m_stopping = true;
+   for (auto& w: m_workers)
+   {
+      {
+         std::lock_guard<std::mutex> lock(w->mutex);
+         w->wake.notify_one();
+      }
+      w->thread.join();
+   }
+}
+
+
+bool WorkerPool::Post(size_t key, Task task)
+{
+   Worker& w = *m_workers[key % m_workers.size()];
+   if (!w.queue.TryPush(std::move(task)))
+      return false;
+
+   // The worker sets sleeping before its last look at the queue, so either it
+   // sees this task or we see that it needs waking. The lock is only ever
+   // held across that look, never while a task runs. TryPush only publishes
+   // with relaxed and release operations, which a weakly ordered CPU can
+   // let this load overtake, so the fence (paired with the one in Run) is
+   // what keeps both sides from missing each other.
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (w.sleeping.load())
+   {
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.wake.notify_one();
+   }
+   return true;
+}
+
+
+std::vector<WorkerPool::Stats> WorkerPool::GetStats() const
+{
+   std::vector<Stats> ret;
+   for (auto& w: m_workers)
+   {
+      ret.push_back(Stats{
+         w->queue.Depth(),
+         w->queue.Capacity(),
+         w->queue.Pushed(),
+         w->queue.Dropped(),
+         w->run.load(std::memory_order_relaxed),
+      });
+   }
+   return ret;
+}
+
+
+void WorkerPool::Run(Worker& w)
+{
+   Task task;
+   for (;;)
+   {
+      if (w.queue.TryPop(task))
+      {
+         task();
+         task = nullptr;
+         w.run.fetch_add(1, std::memory_order_relaxed);
+         continue;
+      }
+      if (m_stopping)
+         return;
+
+      std::unique_lock<std::mutex> lock(w.mutex);
+      w.sleeping = true;
+      // Pairs with the fence in Post: orders the store above before the
+      // predicate's look at the queue.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      w.wake.wait(lock, [&]() { return !w.queue.Empty() || m_stopping; });
+      w.sleeping = false;
+   }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "BoundedQueue.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace asha
+{
+
+// Threads for running user code (printing, mostly) off of the dbus thread.
+// Each worker has its own bounded queue, and Post() never waits for any of
+// them: if the queue is full, the task is dropped and counted.
+class WorkerPool final
+{
+public:
+   typedef std::function<void()> Task;
+
+   struct Stats
+   {
+      size_t depth;      // Tasks waiting right now.
+      size_t capacity;
+      uint64_t posted;
+      uint64_t dropped;  // Tasks thrown away because the queue was full.
+      uint64_t run;
+   };
+
+   WorkerPool(size_t threads, size_t queue_size);
+   // Runs whatever is still queued, then stops the threads.
+   ~WorkerPool();
+
+   WorkerPool(const WorkerPool&) = delete;
+   WorkerPool& operator=(const WorkerPool&) = delete;
+
+   // key picks the worker, so tasks posted with the same key run in the order
+   // they were posted. Returns false if the task was dropped.
+   bool Post(size_t key, Task task);
+
+   size_t Size() const { return m_workers.size(); }
+   std::vector<Stats> GetStats() const;
+
+private:
+   struct Worker
+   {
+      explicit Worker(size_t queue_size): queue(queue_size) {}
+
+      BoundedQueue<Task> queue;
+      std::thread thread;
+      // Only for sleeping when there is nothing to do. Nobody holds this
+      // while running a task.
+      std::mutex mutex;
+      std::condition_variable wake;
+      std::atomic<bool> sleeping{false};
+      std::atomic<uint64_t> run{0};
+   };
+
+   void Run(Worker& w);
+
+   std::vector<std::unique_ptr<Worker>> m_workers;
+   std::atomic<bool> m_stopping{false};
+};
+
+}